@@ -10,16 +10,38 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TFA_SIMD_X86
+#endif
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 #include "tfa_dsp_fw.h"
+#include "tfa_dsp_cmd.h"
+#include "tfa_dsp_stream.h"
 
-typedef char int8_t;
-typedef unsigned char uint8_t;
-typedef short int16_t;
-typedef unsigned short uint16_t;
-typedef int int32_t;
-typedef unsigned int uint32_t;
+/* per thread conversion context, every worker converts its own container */
+#if defined(_MSC_VER)
+#define TFA_TLS __declspec(thread)
+#else
+#define TFA_TLS __thread
+#endif
 
 #define MEMTRACK_MAX_WORDS           150
 #define LSMODEL_MAX_WORDS            150
@@ -30,9 +52,7 @@ typedef unsigned int uint32_t;
 #define TFA_MAX_VSTEP_MSG_MARKER        (100) /* This marker  is used to indicate if all msgs need to be written to the device */
 #define TFA_MAX_MSGS                    (10)
 /* static limits */
-#define TFACONT_MAXDEVS  (4)   /* maximum nr of devices */
-#define TFACONT_MAXPROFS (16) /* maximum nr of profiles */
-#define TFA_MAX_CNT_LENGTH (256*1024)
+#define TFA_MAX_CNT_LENGTH (16*1024*1024) /* descriptor offsets are 24 bits */
 
 enum tfa98xx_error {
 	TFA_ERROR = -1,
@@ -303,6 +323,17 @@ struct tfa98xx_buffer_pool {
 	int size;
 	unsigned char in_use;
 	void* pool;
+	int dirty;	/* bytes from the start that may be non zero */
+	int next_free;	/* free list of the size class, -1 ends it */
+};
+
+struct tfa98xx_pool_stats {
+	int in_use;		/* buffers handed out now */
+	int high_water;		/* max buffers handed out at once */
+	int max_request;	/* largest requested size */
+	int gets;
+	int fallbacks;		/* requests that could not be served from the pool */
+	long long bytes_cleared;
 };
 
 #define HDR(c1,c2) (c2<<8|c1) // little endian
@@ -392,8 +423,13 @@ struct tfa98xx_handle_private {
 	int default_boost_trip_level;
 	int saam_use_case; /* 0: not in use, 1: RaM / SaM only, 2: bidirectional */
 	int stream_state; /* b0: pstream (Rx), b1: cstream (Tx), b2: samstream (SaaM) */
+	int partial_enable; /* vstep messages as partial update against the previous vstep */
 #if defined(TFADSP_DSP_BUFFER_POOL)
 	struct tfa98xx_buffer_pool buf_pool[POOL_MAX_INDEX];
+	int pool_nr_classes;
+	int pool_class_size[POOL_MAX_INDEX];	/* ascending */
+	int pool_free_head[POOL_MAX_INDEX];	/* per size class */
+	struct tfa98xx_pool_stats pool_stats;
 #endif
 };
 
@@ -430,16 +466,76 @@ struct tfa_speaker_file {
 	uint8_t data[]; //payload TFA98XX_SPEAKERPARAMETER_LENGTH
 };
 
-static struct tfa_container* g_cont = NULL; /* container file */
-static int g_devs=-1; // nr of devices TODO use direct access to cont?
-static struct tfa_device_list *g_dev[TFACONT_MAXDEVS];
-static int g_profs[TFACONT_MAXDEVS];
-static struct tfa_profile_list  *g_prof[TFACONT_MAXDEVS][TFACONT_MAXPROFS];
+static TFA_TLS struct tfa_container* g_cont = NULL; /* container file */
+static TFA_TLS int g_devs=-1; // nr of devices TODO use direct access to cont?
+
+/*
+ * flattened descriptor index, one entry per item of every device and profile list.
+ * The items of a device list come first, followed by those of each of its profiles,
+ * so list l holds the entries [list_first[l], list_first[l + 1]).
+ * dev_list[dev] is the device list itself, dev_list[dev] + 1 + prof its profiles.
+ */
+struct tfa_cont_index {
+	int nr_dscs, max_dscs;
+	uint8_t *type;		// enum tfa_descriptor_type
+	uint32_t *offset;	// from the start of the container
+	uint16_t *dev;		// owning device
+	int16_t *prof;		// owning profile, -1 for the device list
+	uint32_t *length;	// payload bytes, 0 for types without payload
+	int nr_lists, max_lists;
+	int *list_first;	// nr_lists + 1 entries
+	void **list;		// struct tfa_device_list or tfa_profile_list, NULL if not valid
+	int max_devs;
+	int *dev_list;		// g_devs + 1 entries
+};
+static TFA_TLS struct tfa_cont_index g_idx;
 static int is_cold = 1;
 static int buf_pool_size[POOL_MAX_INDEX] = {64*1024, 64*1024, 64*1024, 64*1024, 64*1024, 8*1024};
+static int batch_mode = 0; /* all devices x profiles x vsteps */
+
+enum tfa_out_format {
+	OUT_HEADER,	/* C header with const int CMD<n>[] arrays */
+	OUT_BLOB,	/* binary command blob, struct tfa_blob_header */
+};
+static enum tfa_out_format out_format = OUT_HEADER;
+static int out_packed = 0; /* 24-bit messages as uint8_t arrays / packed blob instead of 32-bit words */
+static int dedup_mode = 0; /* emit every unique message payload once */
+static int switch_mode = 0; /* profile to profile switch sequences */
+static int vstep_delta_mode = 0; /* 1: vstep +-1 transitions, 2: all vstep pairs */
+static int coeff_partial_mode = 0; /* per biquad updates of coefficient messages */
+static int msg_batch_max = 0; /* max bytes of a multi message of small set messages, 0 is off */
+static unsigned sink_mask = 0; /* 1 << enum tfa_sink_type of the --sinks outputs, 0 is synchronous out_format output */
+static int sink_queue_len = 256; /* events queued for the sink threads */
+static int cnt_max_length = TFA_MAX_CNT_LENGTH; /* container size limit */
+static int cnt_verify_crc = 1; /* check the container crc at load */
+static int pool_clear_on_demand = 0; /* returned pool buffers are not cleared, every user overwrites what it gets */
+
+TFA_TLS struct tfa98xx_handle_private *handles_local = NULL;
+static TFA_TLS int nr_handles = 0; /* grows with the nr of devices, never shrinks */
+
+static int tfa_handles_grow(int nr)
+{
+	struct tfa98xx_handle_private *h;
+
+	if (nr <= nr_handles)
+		return 0;
+	h = realloc(handles_local, nr * sizeof(*h));
+	if (h == NULL)
+		return -1;
+	memset(&h[nr_handles], 0, (nr - nr_handles) * sizeof(*h));
+	handles_local = h;
+	nr_handles = nr;
+
+	return 0;
+}
 
-#define MAX_HANDLES 4
-struct tfa98xx_handle_private handles_local[MAX_HANDLES];
+/* handles of a thread, its pools must be freed */
+static void tfa_handles_free(void)
+{
+	free(handles_local);
+	handles_local = NULL;
+	nr_handles = 0;
+}
 
 uint32_t swap_uint32(uint32_t val)
 {
@@ -461,162 +557,63 @@ uint16_t cpu_to_be16(uint16_t val)
 	return (b0|b1);
 }
 
-#define BIT(x) (1 << (x))
-
-char *get_command_string(uint8_t module_id, uint8_t param_id)
+/* little endian in memory on any host, also the conversion back */
+uint16_t cpu_to_le16(uint16_t val)
 {
-	if(module_id == MODULE_FRAMEWORK) { // MODULE_FRAMEWORK
-		if(param_id == FW_PAR_ID_SET_BAT_FACTORS)
-			return "FW_PAR_ID_SET_BAT_FACTORS";
-		else if(param_id == FW_PAR_ID_SET_MEMORY)
-			return "FW_PAR_ID_SET_MEMORY";
-		else if(param_id == FW_PAR_ID_SET_SENSES_DELAY)
-			return "FW_PAR_ID_SET_SENSES_DELAY";
-		else if(param_id == FW_PAR_ID_SETSENSESCAL)
-			return "FW_PAR_ID_SETSENSESCAL";
-		else if(param_id == FW_PAR_ID_SET_INPUT_SELECTOR)
-			return "FW_PAR_ID_SET_INPUT_SELECTOR";
-		else if(param_id == FW_PAR_ID_SET_OUTPUT_SELECTOR)
-			return "FW_PAR_ID_SET_OUTPUT_SELECTOR";
-		else if(param_id == FW_PAR_ID_SET_PROGRAM_CONFIG)
-			return "FW_PAR_ID_SET_PROGRAM_CONFIG";
-		else if(param_id == FW_PAR_ID_SET_GAINS)
-			return "FW_PAR_ID_SET_GAINS";
-		else if(param_id == FW_PAR_ID_SET_MEMTRACK)
-			return "FW_PAR_ID_SET_MEMTRACK";
-		else if(param_id == FW_PAR_ID_SET_FWKUSECASE)
-			return "FW_PAR_ID_SET_FWKUSECASE";
-		else if(param_id == FW_PAR_ID_SET_HW_CONFIG)
-			return "FW_PAR_ID_SET_HW_CONFIG";
-		else if(param_id == FW_PAR_ID_SET_CHIP_TEMPSELECTOR)
-			return "FW_PAR_ID_SET_CHIP_TEMPSELECTOR";
-		else if(param_id == TFA1_FW_PAR_ID_SET_CURRENT_DELAY)
-			return "TFA1_FW_PAR_ID_SET_CURRENT_DELAY";
-		else if(param_id == TFA1_FW_PAR_ID_SET_CURFRAC_DELAY)
-			return "TFA1_FW_PAR_ID_SET_CURFRAC_DELAY";
-		else if(param_id == FW_PAR_ID_GET_MEMORY)
-			return "FW_PAR_ID_GET_MEMORY";
-		else if(param_id == FW_PAR_ID_GLOBAL_GET_INFO)
-			return "FW_PAR_ID_GLOBAL_GET_INFO";
-		else if(param_id == FW_PAR_ID_GET_FEATURE_INFO)
-			return "FW_PAR_ID_GET_FEATURE_INFO";
-		else if(param_id == FW_PAR_ID_GET_MEMTRACK)
-			return "FW_PAR_ID_GET_MEMTRACK";
-		else if(param_id == FW_PAR_ID_GET_TAG)
-			return "FW_PAR_ID_GET_TAG";
-		else if(param_id == FW_PAR_ID_GET_API_VERSION)
-			return "FW_PAR_ID_GET_API_VERSION";
-		else if(param_id == FW_PAR_ID_GET_STATUS_CHANGE)
-			return "FW_PAR_ID_GET_STATUS_CHANGE";
-	} else if(module_id == MODULE_SPEAKERBOOST) { // MODULE_SPEAKERBOOST
-		if(param_id == SB_PARAM_SET_ALGO_PARAMS)
-			return "SB_PARAM_SET_ALGO_PARAMS";
-		else if(param_id == SB_PARAM_SET_LAGW)
-			return "SB_PARAM_SET_LAGW";
-		else if(param_id == SB_PARAM_SET_ALGO_PARAMS_WITHOUT_RESET)
-			return "SB_PARAM_SET_ALGO_PARAMS_WITHOUT_RESET";
-		else if(param_id == SB_PARAM_SET_MUTE)
-			return "SB_PARAM_SET_MUTE";
-		else if(param_id == SB_PARAM_SET_VOLUME)
-			return "SB_PARAM_SET_VOLUME";
-		else if(param_id == SB_PARAM_SET_RE25C)
-			return "SB_PARAM_SET_RE25C";
-		else if(param_id == SB_PARAM_SET_LSMODEL)
-			return "SB_PARAM_SET_LSMODEL";
-		else if(param_id == SB_PARAM_SET_MBDRC)
-			return "SB_PARAM_SET_MBDRC";
-		else if(param_id == SB_PARAM_SET_MBDRC_WITHOUT_RESET)
-			return "SB_PARAM_SET_MBDRC_WITHOUT_RESET";
-		else if(param_id == SB_PARAM_SET_DRC)
-			return "SB_PARAM_SET_DRC";
-		else if(param_id == SB_PARAM_GET_ALGO_PARAMS)
-			return "SB_PARAM_GET_ALGO_PARAMS";
-		else if(param_id == SB_PARAM_GET_LAGW)
-			return "SB_PARAM_GET_LAGW";
-		else if(param_id == SB_PARAM_GET_RE25C)
-			return "SB_PARAM_GET_RE25C";
-		else if(param_id == SB_PARAM_GET_LSMODEL)
-			return "SB_PARAM_GET_LSMODEL";
-		else if(param_id == SB_PARAM_GET_MBDRC)
-			return "SB_PARAM_GET_MBDRC";
-		else if(param_id == SB_PARAM_GET_MBDRC_DYNAMICS)
-			return "SB_PARAM_GET_MBDRC_DYNAMICS";
-		else if(param_id == SB_PARAM_GET_TAG)
-			return "SB_PARAM_GET_TAG";
-		else if(param_id == SB_PARAM_SET_EXCURSION_FILTERS)
-			return "SB_PARAM_SET_EXCURSION_FILTERS";
-		else if(param_id == SB_PARAM_SET_DATA_LOGGER)
-			return "SB_PARAM_SET_DATA_LOGGER";
-		else if(param_id == SB_PARAM_SET_CONFIG)
-			return "SB_PARAM_SET_CONFIG";
-		else if(param_id == SB_PARAM_SET_AGCINS)
-			return "SB_PARAM_SET_AGCINS";
-		else if(param_id == SB_PARAM_SET_CURRENT_DELAY)
-			return "SB_PARAM_SET_CURRENT_DELAY";
-		else if(param_id == SB_PARAM_GET_STATE)
-			return "SB_PARAM_GET_STATE";
-		else if(param_id == SB_PARAM_GET_XMODEL)
-			return "SB_PARAM_GET_XMODEL";
-		else if(param_id == SB_PARAM_SET_RE0)
-			return "SB_PARAM_SET_RE0";
-	} else if(module_id == MODULE_BIQUADFILTERBANK) { // MODULE_BIQUADFILTERBANK
-		if(param_id == BFB_PAR_ID_SET_COEFS)
-			return "BFB_PAR_ID_SET_COEFS";
-		else if(param_id == BFB_PAR_ID_GET_COEFS)
-			return "BFB_PAR_ID_GET_COEFS";
-		else if(param_id == BFB_PAR_ID_GET_CONFIG)
-			return "BFB_PAR_ID_GET_CONFIG";
-	}
-	return "unknown_command";
-}
-
-/*
- * return device list dsc from index
- */
-struct tfa_device_list *tfa_cont_get_dev_list(struct tfa_container * cont, int dev_idx)
-{
-	uint8_t *base = (uint8_t *) cont;
-
-	if ( (dev_idx < 0) || (dev_idx >= cont->ndev))
-		return NULL;
-
-	if (cont->index[dev_idx].type != dsc_device)
-		return NULL;
+	uint8_t b[2] = { (uint8_t)val, (uint8_t)(val >> 8) };
 
-	base += cont->index[dev_idx].offset;
-	return (struct tfa_device_list *) base;
+	memcpy(&val, b, sizeof(val));
+	return val;
 }
 
-struct tfa_profile_list *tfa_cont_get_dev_prof_list(struct tfa_container * cont, int dev_idx,
-					   int prof_idx)
+uint32_t cpu_to_le32(uint32_t val)
 {
-	struct tfa_device_list *dev;
-	int idx, hit;
-	uint8_t *base = (uint8_t *) cont;
+	uint8_t b[4] = { (uint8_t)val, (uint8_t)(val >> 8), (uint8_t)(val >> 16), (uint8_t)(val >> 24) };
 
-	dev = tfa_cont_get_dev_list(cont, dev_idx);
-	if (dev) {
-		for (idx = 0, hit = 0; idx < dev->length; idx++) {
-			if (dev->list[idx].type == dsc_profile) {
-				if (prof_idx == hit++)
-					return (struct tfa_profile_list *) (dev->list[idx].offset + base);
-			}
-		}
-	}
+	memcpy(&val, b, sizeof(val));
+	return val;
+}
 
-	return NULL;
+#define BIT(x) (1 << (x))
+
+char *get_command_string(uint8_t module_id, uint8_t param_id)
+{
+	const char *name = tfa_dsp_cmd_name(module_id, param_id);
+
+	return (char *)(name ? name : "unknown_command");
 }
 
 struct tfa_device_list *tfa_cont_device(int dev_idx) {
-	if(dev_idx < g_devs) {
-		if (g_dev[dev_idx] == NULL)
-			return NULL;
-		return g_dev[dev_idx];
-	}
+	if(dev_idx >= 0 && dev_idx < g_devs)
+		return g_idx.list[g_idx.dev_list[dev_idx]];
 	//pr_err("Devlist index too high:%d!", idx);
 	return NULL;
 }
 
+int tfa_cont_nr_profiles(int dev_idx)
+{
+	if (dev_idx < 0 || dev_idx >= g_devs)
+		return 0;
+	return g_idx.dev_list[dev_idx + 1] - g_idx.dev_list[dev_idx] - 1;
+}
+
+/*
+ * index entries of the device list (prof_idx -1) or of a profile list,
+ * returns the first entry and sets end, an empty range if there is no such list
+ */
+static int tfa_cont_dscs(int dev_idx, int prof_idx, int *end)
+{
+	int l;
+
+	*end = 0;
+	if (prof_idx < -1 || prof_idx >= tfa_cont_nr_profiles(dev_idx))
+		return 0;
+	l = g_idx.dev_list[dev_idx] + 1 + prof_idx;
+	*end = g_idx.list_first[l + 1];
+
+	return g_idx.list_first[l];
+}
+
 static struct tfa_volume_step_message_info *
 tfa_cont_get_msg_info_from_reg(struct tfa_volume_step_register_info *reg_info)
 {
@@ -656,58 +653,150 @@ tfa_cont_get_next_reg_from_end_info(struct  tfa_volume_step_message_info *msg_in
 
 }
 
+/*
+ * vstep index of one volumestepMax2 file, built once at load.
+ * All offsets are relative to the start of the vstep file.
+ */
+struct tfa_vstep_index {
+	struct tfa_volume_step_max2_file *vp;
+	int nr_vsteps;
+	uint32_t *reg_offset;	/* [nr_vsteps] register info of every vstep */
+	int *msg_first;		/* [nr_vsteps+1] first message of every vstep in msg_offset */
+	uint32_t *msg_offset;	/* all message infos of all vsteps */
+};
+
+/* sorted on vp */
+static TFA_TLS struct tfa_vstep_index *g_vstep_index = NULL;
+static TFA_TLS int g_vstep_files = 0;
+
+static struct tfa_vstep_index *tfa_cont_find_vstep_index(struct tfa_volume_step_max2_file *vp)
+{
+	int lo = 0, hi = g_vstep_files - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (g_vstep_index[mid].vp == vp)
+			return &g_vstep_index[mid];
+		if ((uint8_t *)g_vstep_index[mid].vp < (uint8_t *)vp)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * return the message info of message msg_idx in vstep idx, every vstep
+ * file is indexed at load, tfa_cont_find_vstep_index() gives its index
+ */
+static struct tfa_volume_step_message_info *
+tfa_cont_get_msg_for_vstep(struct tfa_vstep_index *vsi, int idx, int msg_idx)
+{
+	return (struct tfa_volume_step_message_info *)
+		((uint8_t *)vsi->vp + vsi->msg_offset[vsi->msg_first[idx] + msg_idx]);
+}
+
 static struct tfa_volume_step_register_info*
-tfa_cont_get_reg_for_vstep(struct tfa_volume_step_max2_file *vp, int idx)
+tfa_cont_get_reg_for_vstep(struct tfa_vstep_index *vsi, int idx)
+{
+	return (struct tfa_volume_step_register_info *)((uint8_t *)vsi->vp + vsi->reg_offset[idx]);
+}
+
+#define tfa98xx_handle_t int
+
+/* remove a free buffer from the free list of its size class */
+static void tfa98xx_buffer_pool_unlink(struct tfa98xx_handle_private *h, int index)
 {
-	int i, j, nrMessage;
+	int c, *link;
 
-	struct tfa_volume_step_register_info *reg_info
-		= (struct tfa_volume_step_register_info*) vp->vsteps_bin;
-	struct tfa_volume_step_message_info *msg_info = NULL;
+	for (c = 0; c < h->pool_nr_classes; c++) {
+		for (link = &h->pool_free_head[c]; *link != -1; link = &h->buf_pool[*link].next_free) {
+			if (*link == index) {
+				*link = h->buf_pool[index].next_free;
+				return;
+			}
+		}
+	}
+}
 
-	for (i = 0; i < idx; i++) {
-		msg_info = tfa_cont_get_msg_info_from_reg(reg_info);
-		nrMessage = msg_info->nr_of_messages;
+/* put a buffer on the free list of its size class, classes are kept in ascending size */
+static void tfa98xx_buffer_pool_link(struct tfa98xx_handle_private *h, int index)
+{
+	int c, i, size = h->buf_pool[index].size;
+
+	for (c = 0; c < h->pool_nr_classes; c++) {
+		if (h->pool_class_size[c] >= size)
+			break;
+	}
 
-		for (j = 0; j < nrMessage; j++) {
-			msg_info = tfa_cont_get_next_msg_info(msg_info);
+	if (c == h->pool_nr_classes || h->pool_class_size[c] != size) { // new class
+		for (i = h->pool_nr_classes; i > c; i--) {
+			h->pool_class_size[i] = h->pool_class_size[i-1];
+			h->pool_free_head[i] = h->pool_free_head[i-1];
 		}
-		reg_info = tfa_cont_get_next_reg_from_end_info(msg_info);
+		h->pool_class_size[c] = size;
+		h->pool_free_head[c] = -1;
+		h->pool_nr_classes++;
 	}
 
-	return reg_info;
+	h->buf_pool[index].next_free = h->pool_free_head[c];
+	h->pool_free_head[c] = index;
 }
 
-#define tfa98xx_handle_t int
 int tfa98xx_buffer_pool_access(tfa98xx_handle_t handle, int r_index, size_t g_size, int control)
 {
-	int index;
+	struct tfa98xx_handle_private *h = &handles_local[handle];
+	struct tfa98xx_buffer_pool *buf;
+	int c, index;
 
 	switch (control) {
 		case POOL_GET: // get
-			for (index = 0; index < POOL_MAX_INDEX; index++)
+			h->pool_stats.gets++;
+			if ((int)g_size > h->pool_stats.max_request)
+				h->pool_stats.max_request = (int)g_size;
+
+			/* smallest size class that fits and has a free buffer */
+			for (c = 0; c < h->pool_nr_classes; c++)
 			{
-				if (handles_local[handle].buf_pool[index].in_use)
+				if (h->pool_class_size[c] < (int)g_size)
 					continue;
-				if (handles_local[handle].buf_pool[index].size < g_size)
+				index = h->pool_free_head[c];
+				if (index == -1)
 					continue;
-				handles_local[handle].buf_pool[index].in_use = 1;
+
+				buf = &h->buf_pool[index];
+				h->pool_free_head[c] = buf->next_free;
+				buf->in_use = 1;
+				if ((int)g_size > buf->dirty)
+					buf->dirty = (int)g_size; // the caller may write this much
+
+				if (++h->pool_stats.in_use > h->pool_stats.high_water)
+					h->pool_stats.high_water = h->pool_stats.in_use;
 				//printf("dev %d - get buffer_pool[%d]\n", handle, index);
 				return index;
 			}
 
+			h->pool_stats.fallbacks++;
 			printf("dev %d - failed to get buffer_pool\n", handle);
 			break;
 
 		case POOL_RETURN: // return
-			if (handles_local[handle].buf_pool[r_index].in_use == 0) {
+			buf = &h->buf_pool[r_index];
+			if (buf->in_use == 0) {
 				printf("dev %d - buffer_pool[%d] is not in use\n", handle, r_index);
 				break;
 			}
 
 			//printf("dev %d - return buffer_pool[%d]\n", handle, r_index);
-			memset(handles_local[handle].buf_pool[r_index].pool, 0, handles_local[handle].buf_pool[r_index].size);
-			handles_local[handle].buf_pool[r_index].in_use = 0;
+			if (!pool_clear_on_demand) { // only the bytes handed out can be dirty
+				memset(buf->pool, 0, buf->dirty);
+				h->pool_stats.bytes_cleared += buf->dirty;
+				buf->dirty = 0;
+			}
+			buf->in_use = 0;
+			tfa98xx_buffer_pool_link(h, r_index);
+			h->pool_stats.in_use--;
 
 			return 0;
 			break;
@@ -720,18 +809,31 @@ int tfa98xx_buffer_pool_access(tfa98xx_handle_t handle, int r_index, size_t g_si
 	return -1;
 }
 
+void tfa98xx_buffer_pool_print_stats(tfa98xx_handle_t handle)
+{
+	struct tfa98xx_pool_stats *st = &handles_local[handle].pool_stats;
+
+	printf("dev %d - buffer_pool : gets=%d, high water=%d buffers, max request=%d bytes, "
+		"fallbacks=%d, cleared=%lld bytes\n", handle, st->gets, st->high_water,
+		st->max_request, st->fallbacks, st->bytes_cleared);
+}
+
 int tfa98xx_cnt_max_device(void) {
-	return (g_cont != NULL) ? ((g_cont->ndev < TFACONT_MAXDEVS) ? g_cont->ndev : TFACONT_MAXDEVS) : 0;
+	return (g_cont != NULL) ? g_devs : 0;
 }
 
+/* devices with allocated pools, freed with the count they were allocated for */
+static TFA_TLS int g_pool_devs = 0;
+
 enum tfa98xx_error tfa_buffer_pool(int index, int size, int control)
 {
-	int dev, devcount = tfa98xx_cnt_max_device();
+	int dev, i, left = 0, devcount = tfa98xx_cnt_max_device();
 
 	switch (control) {
 		case POOL_ALLOC: // allocate
+			g_pool_devs = devcount;
 			for (dev = 0; dev < devcount; dev++) {
-				handles_local[dev].buf_pool[index].pool = malloc(size);
+				handles_local[dev].buf_pool[index].pool = calloc(1, size);
 				if (handles_local[dev].buf_pool[index].pool == NULL)
 				{
 					//printf("tfa_buffer_pool: dev %d - buffer_pool[%d] - kmalloc error %d bytes\n", dev, index, size);
@@ -742,18 +844,38 @@ enum tfa98xx_error tfa_buffer_pool(int index, int size, int control)
 				//printf("tfa_buffer_pool: dev %d - buffer_pool[%d] - malloc allocated %d bytes\n", dev, index, size);
 				handles_local[dev].buf_pool[index].size = size;
 				handles_local[dev].buf_pool[index].in_use = 0;
+				handles_local[dev].buf_pool[index].dirty = 0;
+				tfa98xx_buffer_pool_link(&handles_local[dev], index);
 			}
 			break;
 
 		case POOL_FREE: // deallocate
+			devcount = g_pool_devs;
 			for (dev = 0; dev < devcount; dev++) {
-				if (handles_local[dev].buf_pool[index].pool != NULL)
+				if (handles_local[dev].buf_pool[index].pool != NULL) {
+					if (!handles_local[dev].buf_pool[index].in_use)
+						tfa98xx_buffer_pool_unlink(&handles_local[dev], index);
 					free(handles_local[dev].buf_pool[index].pool);
+				}
 				//printf("tfa_buffer_pool: dev %d - buffer_pool[%d] - free\n", dev, index);
 				handles_local[dev].buf_pool[index].pool = NULL;
 				handles_local[dev].buf_pool[index].size = 0;
 				handles_local[dev].buf_pool[index].in_use = 0;
+				handles_local[dev].buf_pool[index].dirty = 0;
+
+				for (i = 0; i < POOL_MAX_INDEX; i++) {
+					if (handles_local[dev].buf_pool[i].pool != NULL)
+						break;
+				}
+				if (i == POOL_MAX_INDEX) { // all freed, start over at the next POOL_ALLOC
+					handles_local[dev].pool_nr_classes = 0;
+					memset(&handles_local[dev].pool_stats, 0, sizeof(struct tfa98xx_pool_stats));
+				} else {
+					left = 1;
+				}
 			}
+			if (!left)
+				g_pool_devs = 0;
 			break;
 
 		default:
@@ -764,8 +886,13 @@ enum tfa98xx_error tfa_buffer_pool(int index, int size, int control)
 	return TFA98XX_ERROR_OK;
 }
 
-int32_t g_out32buf[512] = {0,};
-static uint32_t tfa_msg24to32(int32_t *out32buf, const uint8_t *in24buf, int length)
+TFA_TLS int32_t g_out32buf[512] = {0,};
+
+/*
+ * reference conversion of big endian 24-bit DSP words to sign extended 32-bit words,
+ * also the fallback for cpus without SSSE3 and the tail of the vector versions
+ */
+static uint32_t tfa_msg24to32_scalar(int32_t *out32buf, const uint8_t *in24buf, int length)
 {
 	int i = 0;
 	int cmd_index = 0;
@@ -788,902 +915,5931 @@ static uint32_t tfa_msg24to32(int32_t *out32buf, const uint8_t *in24buf, int len
 	return buf32_len;
 }
 
-FILE * pFileHeader = NULL;
-uint8_t cmd_count = 1;
-void fwrite_message(uint32_t* command, uint32_t length, char *str_cmd)
+#if defined(TFA_SIMD_X86)
+/*
+ * shuffle every 3 byte big endian word into the upper 3 bytes of a 32-bit lane,
+ * the arithmetic shift right by 8 then does the sign extension
+ */
+#define TFA_SHUF24(k) (char)0x80, (char)(3*(k)+2), (char)(3*(k)+1), (char)(3*(k))
+
+__attribute__((target("ssse3")))
+static uint32_t tfa_msg24to32_ssse3(int32_t *out32buf, const uint8_t *in24buf, int length)
 {
-  char buffer[256];
-  uint8_t pos = 0;
-  uint32_t size = length / 4;
+	const __m128i shuf = _mm_setr_epi8(TFA_SHUF24(0), TFA_SHUF24(1), TFA_SHUF24(2), TFA_SHUF24(3));
+	uint32_t buf32_len = (length/3)*4;
+	int i = 0, cmd_index = 0;
 
-  if(pFileHeader == NULL)
-	  return;
+	/* 4 words from 12 bytes, the 16 byte load must stay inside the input */
+	for (; i + 16 <= length; i += 12, cmd_index += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&in24buf[i]);
+		v = _mm_srai_epi32(_mm_shuffle_epi8(v, shuf), 8);
+		_mm_storeu_si128((__m128i *)&out32buf[cmd_index], v);
+	}
 
-  fprintf(pFileHeader, "\n// %s\n", str_cmd);
+	tfa_msg24to32_scalar(&out32buf[cmd_index], &in24buf[i], length - i);
 
-  memset((int8_t*)buffer, 0x0, 256);
-  sprintf(buffer, "%s%d%s", "const int CMD", cmd_count, "[]={");
-  pos = strlen(buffer);
+	return buf32_len;
+}
 
-  for(int i = 0; i < size ; i++)
-  {
-    char one_32bit[11];
-    sprintf(one_32bit, "0x%08x", command[i]);
-    if((i % 20) == 0 &&  i != 0 && size != (i -1)) //every 20th, put new line
-    {
-      fprintf(pFileHeader, "%s\n", buffer);
-      memset((int8_t*)buffer, 0x0, 256);
+__attribute__((target("avx2")))
+static uint32_t tfa_msg24to32_avx2(int32_t *out32buf, const uint8_t *in24buf, int length)
+{
+	/* vpshufb works per 128-bit lane, every lane gets its own 12 input bytes */
+	const __m256i shuf = _mm256_setr_epi8(TFA_SHUF24(0), TFA_SHUF24(1), TFA_SHUF24(2), TFA_SHUF24(3),
+					      TFA_SHUF24(0), TFA_SHUF24(1), TFA_SHUF24(2), TFA_SHUF24(3));
+	uint32_t buf32_len = (length/3)*4;
+	int i = 0, cmd_index = 0;
+
+	/* 8 words from 24 bytes, the upper lane load ends at byte 28 */
+	for (; i + 28 <= length; i += 24, cmd_index += 8) {
+		__m256i v = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&in24buf[i])),
+				_mm_loadu_si128((const __m128i *)&in24buf[i + 12]), 1);
+		v = _mm256_srai_epi32(_mm256_shuffle_epi8(v, shuf), 8);
+		_mm256_storeu_si256((__m256i *)&out32buf[cmd_index], v);
+	}
 
-      sprintf(buffer, "%s", "                 ");
-      pos = strlen(buffer);
-    }
-    sprintf(buffer + pos, "%s,", one_32bit);
-    pos = strlen(buffer);
-  }
+	tfa_msg24to32_ssse3(&out32buf[cmd_index], &in24buf[i], length - i);
 
-  if(pos > 1)
-  {
-    buffer[pos - 1] = '}';
-    buffer[pos] = ';';
-  }
-  fprintf(pFileHeader, "%s\n", buffer);
+	return buf32_len;
 }
+#endif /* TFA_SIMD_X86 */
 
-void print_message(uint32_t* command, uint32_t length)
-{
-  char buffer[256];
-  uint8_t pos = 0;
-  uint32_t size = length / 4;
-
-  memset((int8_t*)buffer, 0x0, 256);
-  sprintf(buffer, "%s", "[CMD] const int MSG[]={");
-  pos = strlen(buffer);
+/* set once by tfa_cpu_select() */
+static uint32_t (*tfa_msg24to32_impl)(int32_t *, const uint8_t *, int) = tfa_msg24to32_scalar;
 
-  for(int i = 0; i < size ; i++)
-  {
-    char one_32bit[11];
-    sprintf(one_32bit, "0x%08x", command[i]);
-    if((i % 20) == 0 &&  i != 0 && size != (i -1)) //every 20th, put new line
-    {
-      printf("%s\n", buffer);
-      memset((int8_t*)buffer, 0x0, 256);
+static uint32_t tfa_msg24to32(int32_t *out32buf, const uint8_t *in24buf, int length)
+{
+	return tfa_msg24to32_impl(out32buf, in24buf, length);
+}
 
-      sprintf(buffer, "%s", "[CMD]                  ");
-      pos = strlen(buffer);
-    }
-    sprintf(buffer + pos, "%s,", one_32bit);
-    pos = strlen(buffer);
-  }
+/*
+ * message in the output form in g_out32buf, returns its bytes.
+ * packed output keeps the 24-bit bytes, it fits since the 32-bit form does
+ */
+static uint32_t tfa_msg_out(const uint8_t *in24buf, int length)
+{
+	if (out_packed) {
+		memcpy(g_out32buf, in24buf, length);
+		return length;
+	}
 
-  if(pos > 1)
-  {
-    buffer[pos - 1] = '}';
-    buffer[pos] = ';';
-  }
-  printf("%s\n", buffer);
+	return tfa_msg24to32(g_out32buf, in24buf, length);
 }
 
-enum tfa98xx_error dsp_msg(tfa98xx_handle_t device_index, int buffer_size, uint8_t *buffer)
+/*
+ * word diff of packed 24-bit words : bit i of mask[i / 32] is set when word i
+ * differs, mask holds (nr_words + 31) / 32 words. returns the nr of changed words
+ */
+static int tfa_word_diff_tail(const uint8_t *a, const uint8_t *b, int first, int nr_words, uint32_t *mask)
 {
-	//printf("dsp_msg : idx=%d, size=%d, cmd=0x%02x%02x%02x\n", device_index, buffer_size, buffer[0], buffer[1], buffer[2]);
+	int i, changed = 0;
 
-	uint32_t length_32bit = tfa_msg24to32(g_out32buf, buffer, buffer_size);
-	printf("Set Command --> [%s], size=%d\n", get_command_string(buffer[1], buffer[2]), length_32bit);
-	//printf("dsp_msg : 32bit_length = %d\n", length_32bit);
-	//print_message((uint32_t *)g_out32buf, length_32bit);
-	fwrite_message((uint32_t *)g_out32buf, length_32bit, get_command_string(buffer[1], buffer[2]));
-	cmd_count++;
+	for (i = first, a += 3 * first, b += 3 * first; i < nr_words; i++, a += 3, b += 3) {
+		if (a[0] != b[0] || a[1] != b[1] || a[2] != b[2]) {
+			mask[i / 32] |= 1u << (i % 32);
+			changed++;
+		}
+	}
 
-	return TFA98XX_ERROR_OK;
+	return changed;
 }
 
-#define NR_COEFFS 6
-#define NR_BIQUADS 28
-#define BQ_SIZE (3 * NR_COEFFS)
-#define DSP_MSG_OVERHEAD 27
+static int tfa_word_diff_scalar(const uint8_t *a, const uint8_t *b, int nr_words, uint32_t *mask)
+{
+	memset(mask, 0, ((nr_words + 31) / 32) * sizeof(uint32_t));
 
-#pragma pack (push, 1)
-struct dsp_msg_all_coeff {
-	uint8_t select_eq[3];
-	uint8_t biquad[NR_BIQUADS][NR_COEFFS][3];
-};
-#pragma pack (pop)
+	return tfa_word_diff_tail(a, b, 0, nr_words, mask);
+}
 
-static const int eq_biquads[] = {
-	10, 10, 2, 2, 2, 2
-};
-#define NR_EQ (int)(sizeof(eq_biquads) / sizeof(int))
-enum tfa98xx_error dsp_partial_coefficients(tfa98xx_handle_t dev_idx, uint8_t *prev, uint8_t *next)
+#if defined(TFA_SIMD_X86)
+/* byte compare of 16 words (48 bytes), any byte of a word differs sets its bit */
+__attribute__((target("sse2")))
+static int tfa_word_diff_sse2(const uint8_t *a, const uint8_t *b, int nr_words, uint32_t *mask)
 {
-	uint8_t bq, eq;
-	int eq_offset;
-	int new_cost, old_cost;
-	uint32_t eq_biquad_mask[NR_EQ];
-	enum tfa98xx_error err = TFA98XX_ERROR_OK;
-	struct dsp_msg_all_coeff *data1 = (struct dsp_msg_all_coeff *)prev;
-	struct dsp_msg_all_coeff *data2 = (struct dsp_msg_all_coeff *)next;
+	int w, i, changed = 0;
+	uint64_t m;
+	uint32_t bits;
+
+	memset(mask, 0, ((nr_words + 31) / 32) * sizeof(uint32_t));
+
+	for (w = 0; w + 16 <= nr_words; w += 16) {
+		m = 0;
+		for (i = 0; i < 3; i++) {
+			__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&a[3 * w + 16 * i]),
+						    _mm_loadu_si128((const __m128i *)&b[3 * w + 16 * i]));
+			m |= (uint64_t)(~_mm_movemask_epi8(eq) & 0xffff) << (16 * i);
+		}
+		if (m == 0)
+			continue;
 
-	old_cost = DSP_MSG_OVERHEAD + 3 + sizeof(struct dsp_msg_all_coeff);
-	new_cost = 0;
+		bits = 0;
+		for (i = 0; i < 16; i++)
+			bits |= (uint32_t)(((m >> (3 * i)) & 7) != 0) << i;
+		mask[w / 32] |= bits << (w % 32);
+		changed += __builtin_popcount(bits);
+	}
 
-	eq_offset = 0;
-	for (eq=0; eq<NR_EQ; eq++) {
-		uint8_t *eq1 = &data1->biquad[eq_offset][0][0];
-		uint8_t *eq2 = &data2->biquad[eq_offset][0][0];
+	return changed + tfa_word_diff_tail(a, b, w, nr_words, mask);
+}
 
-		eq_biquad_mask[eq] = 0;
+/* every word shuffled into a 32-bit lane, 8 words compared at once */
+__attribute__((target("avx2")))
+static int tfa_word_diff_avx2(const uint8_t *a, const uint8_t *b, int nr_words, uint32_t *mask)
+{
+	const __m256i shuf = _mm256_setr_epi8(TFA_SHUF24(0), TFA_SHUF24(1), TFA_SHUF24(2), TFA_SHUF24(3),
+					      TFA_SHUF24(0), TFA_SHUF24(1), TFA_SHUF24(2), TFA_SHUF24(3));
+	int w, changed = 0;
+	uint32_t bits;
+
+	memset(mask, 0, ((nr_words + 31) / 32) * sizeof(uint32_t));
+
+	/* the upper lane load ends 4 bytes past the 8 words */
+	for (w = 0; 3 * w + 28 <= 3 * nr_words; w += 8) {
+		__m256i va = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&a[3 * w])),
+				_mm_loadu_si128((const __m128i *)&a[3 * w + 12]), 1);
+		__m256i vb = _mm256_inserti128_si256(
+				_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&b[3 * w])),
+				_mm_loadu_si128((const __m128i *)&b[3 * w + 12]), 1);
+		__m256i eq = _mm256_cmpeq_epi32(_mm256_shuffle_epi8(va, shuf), _mm256_shuffle_epi8(vb, shuf));
+
+		bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(eq)) & 0xff;
+		mask[w / 32] |= bits << (w % 32);
+		changed += __builtin_popcount(bits);
+	}
 
-		if (memcmp(eq1, eq2, BQ_SIZE*eq_biquads[eq]) != 0) {
-			int nr_bq = 0;
-			int bq_sz, eq_sz;
+	return changed + tfa_word_diff_tail(a, b, w, nr_words, mask);
+}
+#endif /* TFA_SIMD_X86 */
 
-			for (bq=0; bq < eq_biquads[eq]; bq++) {
-				uint8_t *bq1 = &eq1[bq*BQ_SIZE];
-				uint8_t *bq2 = &eq2[bq*BQ_SIZE];
+/* set once by tfa_cpu_select() */
+static int (*tfa_word_diff_impl)(const uint8_t *, const uint8_t *, int, uint32_t *) = tfa_word_diff_scalar;
 
-				if (memcmp(bq1, bq2, BQ_SIZE) != 0) {
-					eq_biquad_mask[eq] |= (1<<bq);
-					nr_bq++;
-				}
-			}
+static int tfa_word_diff(const uint8_t *a, const uint8_t *b, int nr_words, uint32_t *mask)
+{
+	return tfa_word_diff_impl(a, b, nr_words, mask);
+}
 
-			bq_sz = (2 * 3 + BQ_SIZE) * nr_bq;
-			eq_sz = 2 * 3 + BQ_SIZE * eq_biquads[eq];
+/* nr change bits from word first on, nr <= 32 */
+static uint32_t tfa_word_mask_bits(const uint32_t *mask, int first, int nr)
+{
+	uint64_t m = mask[first / 32];
 
-			/* dsp message i2c transaction overhead */
-			bq_sz += DSP_MSG_OVERHEAD * nr_bq;
-			eq_sz += DSP_MSG_OVERHEAD;
+	if ((first % 32) + nr > 32)
+		m |= (uint64_t)mask[first / 32 + 1] << 32;
 
-			if (bq_sz >= eq_sz) {
-				eq_biquad_mask[eq] = 0xffffffff;
+	return (uint32_t)(m >> (first % 32)) & (uint32_t)((1ULL << nr) - 1);
+}
 
-				new_cost += eq_sz;
+TFA_TLS FILE * pFileHeader = NULL;
+TFA_TLS uint32_t cmd_count = 1; /* wide enough for a full batch expansion */
+/* "00" .. "ff", two hex digits per byte value */
+static const char hex_pairs[513] =
+  "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+  "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+  "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+  "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+  "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+  "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+  "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+  "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/* message text buffer, grown to the largest message */
+static TFA_TLS char *g_text_buf = NULL;
+static TFA_TLS size_t g_text_size = 0;
+
+static char *text_reserve(size_t size)
+{
+  if (size > g_text_size) {
+    char *buf = realloc(g_text_buf, size);
+    if (buf == NULL)
+      return NULL;
+    g_text_buf = buf;
+    g_text_size = size;
+  }
+  return g_text_buf;
+}
 
-			} else {
-				new_cost += bq_sz;
-			}
-		}
-		printf("eq_biquad_mask[%d] = 0x%.8x\n", eq, eq_biquad_mask[eq]);
+void text_buf_free(void)
+{
+  free(g_text_buf);
+  g_text_buf = NULL;
+  g_text_size = 0;
+}
 
-		eq_offset += eq_biquads[eq];
-	}
+/* worst case text size of a message of size words */
+#define TEXT_SIZE(size, prefix_len) (((size) + 1) * 11 + (((size) / 20) + 1) * ((prefix_len) + 1) + 64)
 
-	printf("cost for writing all coefficients     = %d\n", old_cost);
-	printf("cost for writing changed coefficients = %d\n", new_cost);
+static char *text_append(char *p, const char *str)
+{
+  size_t len = strlen(str);
+  memcpy(p, str, len);
+  return p + len;
+}
 
-	if (new_cost >= old_cost) {
-		const int buffer_sz = 3 + sizeof(struct dsp_msg_all_coeff);
-		uint8_t *buffer;
+static char *text_append_uint(char *p, uint32_t val)
+{
+  char digits[10];
+  int n = 0;
 
-		buffer = malloc(buffer_sz);
-		if (buffer == NULL)
-			return TFA98XX_ERROR_FAIL;
+  do {
+    digits[n++] = '0' + (val % 10);
+    val /= 10;
+  } while (val);
 
-		/* cmd id */
-		buffer[0] = 0x00;
-		buffer[1] = 0x82;
-		buffer[2] = 0x00;
+  while (n)
+    *p++ = digits[--n];
+  return p;
+}
 
-		/* parameters */
-		memcpy(&buffer[3], data2, sizeof(struct dsp_msg_all_coeff));
-		err = dsp_msg(dev_idx, buffer_sz, (uint8_t *)buffer);
+/*
+ * format the words as "0x%08x," 20 per line, following lines start with indent,
+ * the last ',' (or the '{' of an empty array) becomes "};"
+ */
+static char *text_append_words(char *p, uint32_t* command, uint32_t size, const char *indent)
+{
+  size_t indent_len = strlen(indent);
 
-		free(buffer);
-		if (err)
-			return err;
+  for(uint32_t i = 0; i < size ; i++)
+  {
+    uint32_t word = command[i];
 
-	} else {
-		eq_offset = 0;
-		for (eq=0; eq<NR_EQ; eq++) {
-			uint8_t *eq2 = &data2->biquad[eq_offset][0][0];
+    if((i % 20) == 0 &&  i != 0) //every 20th, put new line
+    {
+      *p++ = '\n';
+      memcpy(p, indent, indent_len);
+      p += indent_len;
+    }
+    p[0] = '0';
+    p[1] = 'x';
+    memcpy(&p[2], &hex_pairs[2 * (word >> 24)], 2);
+    memcpy(&p[4], &hex_pairs[2 * ((word >> 16) & 0xff)], 2);
+    memcpy(&p[6], &hex_pairs[2 * ((word >> 8) & 0xff)], 2);
+    memcpy(&p[8], &hex_pairs[2 * (word & 0xff)], 2);
+    p[10] = ',';
+    p += 11;
+  }
 
-			if (eq_biquad_mask[eq] == 0xffffffff) {
-				const int msg_sz = 6 + BQ_SIZE * eq_biquads[eq];
-				uint8_t *msg;
+  p[-1] = '}';
+  *p++ = ';';
+  *p++ = '\n';
+  return p;
+}
 
-				msg = malloc(msg_sz);
-				if (msg == NULL)
-					return TFA98XX_ERROR_FAIL;
+/*
+ * packed output : the message bytes as "0x%02x," 60 (20 words) per line,
+ * with the line breaks and ending of text_append_words
+ */
+static char *text_append_bytes(char *p, const uint8_t *msg, uint32_t size, const char *indent)
+{
+  size_t indent_len = strlen(indent);
 
-				/* cmd id */
-				msg[0] = 0x00;
-				msg[1] = 0x82;
-				msg[2] = 0x00;
+  for(uint32_t i = 0; i < size ; i++)
+  {
+    if((i % 60) == 0 &&  i != 0)
+    {
+      *p++ = '\n';
+      memcpy(p, indent, indent_len);
+      p += indent_len;
+    }
+    p[0] = '0';
+    p[1] = 'x';
+    memcpy(&p[2], &hex_pairs[2 * msg[i]], 2);
+    p[4] = ',';
+    p += 5;
+  }
 
-				/* select eq and bq */
-				msg[3] = 0x00;
-				msg[4] = eq+1;
-				msg[5] = 0x00; /* all biquads */
+  p[-1] = '}';
+  *p++ = ';';
+  *p++ = '\n';
+  return p;
+}
 
-				/* biquad parameters */
+static void tfa_cache_put_text(const char *text, int size);
+static enum tfa98xx_error tfa_batch_msg(int dev_idx, int size, const uint8_t *buffer);
+static enum tfa98xx_error tfa_batch_flush(void);
+uint32_t tfa_crc32(const uint8_t *buf, size_t len);
+
+/* asynchronous output, the producer side of the sink queue */
+enum tfa_sink_type {
+	SINK_HEADER,	/* C header, as OUT_HEADER */
+	SINK_BLOB,	/* binary command blob, as OUT_BLOB */
+	SINK_NULL,	/* convert and drop, for benchmarking */
+	SINK_STATS,	/* json statistics, as -S */
+	SINK_MAX
+};
+
+enum tfa_sink_ev_type {
+	SINK_EV_BEGIN_SET,	/* dev, prof, vstep, kind, from */
+	SINK_EV_MSG,		/* 24-bit message and its label */
+	SINK_EV_TEXT,		/* header comment */
+	SINK_EV_END_SET,
+	SINK_EV_PARTIAL,	/* full and sent bytes of a partial update */
+	SINK_EV_END		/* finish the outputs, last event */
+};
+
+struct tfa_sinks;
+static TFA_TLS struct tfa_sinks *g_sinks = NULL; // NULL is synchronous output
+static enum tfa98xx_error tfa_sinks_msg(int size, const uint8_t *buffer, const char *label);
+static enum tfa98xx_error tfa_sinks_text(const char *text, int size);
+static enum tfa98xx_error tfa_sinks_event(int type, int a0, int a1, int a2, int a3, int a4);
+
+void fwrite_message(uint32_t* command, uint32_t length, char *str_cmd)
+{
+  uint32_t size = length / 4;
+  char *buffer, *p;
+
+  if(pFileHeader == NULL)
+	  return;
+
+  buffer = text_reserve(TEXT_SIZE(size, 17) + strlen(str_cmd));
+  if(buffer == NULL)
+	  return;
+
+  p = text_append(buffer, "\n// ");
+  p = text_append(p, str_cmd);
+  p = text_append(p, "\nconst int CMD");
+  p = text_append_uint(p, cmd_count);
+  p = text_append(p, "[]={");
+  p = text_append_words(p, command, size, "                 ");
+
+  fwrite(buffer, 1, p - buffer, pFileHeader);
+  tfa_cache_put_text(buffer, (int)(p - buffer));
+}
+
+void fwrite_message_packed(const uint8_t *msg, uint32_t size, char *str_cmd)
+{
+  char *buffer, *p;
+
+  if(pFileHeader == NULL)
+	  return;
+
+  buffer = text_reserve(size * 5 + (size / 60 + 1) * 22 + 64 + strlen(str_cmd));
+  if(buffer == NULL)
+	  return;
+
+  p = text_append(buffer, "\n// ");
+  p = text_append(p, str_cmd);
+  p = text_append(p, "\nconst uint8_t CMD");
+  p = text_append_uint(p, cmd_count);
+  p = text_append(p, "[]={");
+  p = text_append_bytes(p, msg, size, "                     ");
+
+  fwrite(buffer, 1, p - buffer, pFileHeader);
+  tfa_cache_put_text(buffer, (int)(p - buffer));
+}
+
+void print_message(uint32_t* command, uint32_t length)
+{
+  uint32_t size = length / 4;
+  char *buffer, *p;
+
+  buffer = text_reserve(TEXT_SIZE(size, 23));
+  if(buffer == NULL)
+	  return;
+
+  p = text_append(buffer, "[CMD] const int MSG[]={");
+  p = text_append_words(p, command, size, "[CMD]                  ");
+
+  fwrite(buffer, 1, p - buffer, stdout);
+}
+
+/*
+ * binary command blob, collected in memory and written at the end of a run
+ */
+struct tfa_blob {
+	struct tfa_blob_set *sets;
+	int nr_sets, max_sets;
+	struct tfa_blob_msg *msgs;
+	int nr_msgs, max_msgs;
+	uint8_t *payload;	// payload offsets are relative to this buffer until written
+	uint32_t payload_size, payload_max;
+};
+
+static TFA_TLS struct tfa_blob g_blob;
+
+void tfa_blob_free(void)
+{
+	free(g_blob.sets);
+	free(g_blob.msgs);
+	free(g_blob.payload);
+	memset(&g_blob, 0, sizeof(g_blob));
+}
+
+static int tfa_blob_grow(void **buf, int *max, int nr, int size)
+{
+	void *new_buf;
+
+	if (nr < *max)
+		return 0;
+
+	new_buf = realloc(*buf, (*max ? *max * 2 : 64) * size);
+	if (new_buf == NULL)
+		return -1;
+	*buf = new_buf;
+	*max = *max ? *max * 2 : 64;
+
+	return 0;
+}
+
+/*
+ * conversion statistics : wall time per stage and traffic per device/profile/vstep set
+ */
+enum tfa_stats_stage {
+	STAGE_LOAD,
+	STAGE_INDEX,
+	STAGE_DIFF,
+	STAGE_CONVERT,
+	STAGE_EMIT,
+	STAGE_MAX
+};
+
+static const char *const tfa_stats_stage_name[STAGE_MAX] = {
+	"load", "index", "diff", "convert", "emit"
+};
+
+struct tfa_stats_param {
+	uint16_t id;		/* module id << 8 | param id, without the partial bit */
+	int msgs;
+	int bytes;
+};
+
+/* enum tfa_blob_set_kind */
+static const char *const tfa_stats_kind_name[] = {
+	"full", "switch", "vstep_delta"
+};
+
+struct tfa_stats_set {
+	int dev, prof, vstep;
+	int kind, from;		/* as in struct tfa_blob_set */
+	int msgs;
+	int bytes;		/* 24-bit bytes of all emitted messages */
+	int partial_msgs;	/* vstep messages written as partial update or skipped */
+	int partial_full_bytes;	/* bytes of those messages as a full write */
+	int partial_bytes;	/* bytes emitted for them */
+	struct tfa_stats_param *params;
+	int nr_params, max_params;
+};
+
+struct tfa_stats {
+	double stage_sec[STAGE_MAX];
+	struct tfa_stats_set *sets;
+	int nr_sets, max_sets;
+	int cur;		/* set of the messages now emitted */
+};
+
+static int stats_mode = 0;
+static TFA_TLS struct tfa_stats *g_stats = NULL;
+
+static double tfa_time_sec(void)
+{
+#if !defined(_WIN32)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* start time of a stage, 0 if not collecting */
+static double tfa_stats_start(void)
+{
+	return g_stats ? tfa_time_sec() : 0;
+}
+
+static void tfa_stats_stop(enum tfa_stats_stage stage, double start)
+{
+	if (g_stats)
+		g_stats->stage_sec[stage] += tfa_time_sec() - start;
+}
+
+/*
+ * select the set following messages are counted in, kind and from as in
+ * struct tfa_blob_set. sets written more than once are accumulated
+ */
+static void tfa_stats_begin_set(int dev_idx, int prof_idx, int vstep_idx, int kind, int from)
+{
+	struct tfa_stats_set *set;
+	int i;
+
+	for (i = g_stats->nr_sets - 1; i >= 0; i--) {
+		set = &g_stats->sets[i];
+		if (set->dev == dev_idx && set->prof == prof_idx && set->vstep == vstep_idx
+			&& set->kind == kind && set->from == from) {
+			g_stats->cur = i;
+			return;
+		}
+	}
+
+	if (tfa_blob_grow((void **)&g_stats->sets, &g_stats->max_sets, g_stats->nr_sets, sizeof(*set)))
+		return;
+	set = &g_stats->sets[g_stats->nr_sets];
+	memset(set, 0, sizeof(*set));
+	set->dev = dev_idx;
+	set->prof = prof_idx;
+	set->vstep = vstep_idx;
+	set->kind = kind;
+	set->from = from;
+	g_stats->cur = g_stats->nr_sets++;
+}
+
+static struct tfa_stats_set *tfa_stats_cur_set(void)
+{
+	if (g_stats->nr_sets == 0)
+		tfa_stats_begin_set(0, 0, 0, TFA_BLOB_SET_FULL, 0);
+	if (g_stats->nr_sets == 0)
+		return NULL;
+
+	return &g_stats->sets[g_stats->cur];
+}
+
+/* count one emitted 24-bit message */
+static void tfa_stats_msg(int size, const uint8_t *buffer)
+{
+	struct tfa_stats_set *set = tfa_stats_cur_set();
+	struct tfa_dsp_cmd_info info;
+	uint16_t id;
+	int i;
+
+	if (set == NULL || tfa_dsp_cmd_decode(buffer, size, &info))
+		return;
+
+	set->msgs++;
+	set->bytes += size;
+
+	id = (uint16_t)(info.module_id << 8 | info.param_id);
+	for (i = 0; i < set->nr_params; i++) {
+		if (set->params[i].id == id)
+			break;
+	}
+	if (i == set->nr_params) {
+		if (tfa_blob_grow((void **)&set->params, &set->max_params, set->nr_params, sizeof(*set->params)))
+			return;
+		set->params[i].id = id;
+		set->params[i].msgs = 0;
+		set->params[i].bytes = 0;
+		set->nr_params++;
+	}
+	set->params[i].msgs++;
+	set->params[i].bytes += size;
+}
+
+/* a vstep message of full_size bytes went out as sent_size bytes of partial updates */
+static void tfa_stats_partial(int full_size, int sent_size)
+{
+	struct tfa_stats_set *set = tfa_stats_cur_set();
+
+	if (set == NULL)
+		return;
+
+	set->partial_msgs++;
+	set->partial_full_bytes += full_size;
+	set->partial_bytes += sent_size;
+}
+
+void tfa_stats_free(void)
+{
+	int i;
+
+	if (g_stats == NULL)
+		return;
+
+	for (i = 0; i < g_stats->nr_sets; i++)
+		free(g_stats->sets[i].params);
+	free(g_stats->sets);
+	free(g_stats);
+	g_stats = NULL;
+}
+
+/*
+ * regeneration cache : the messages of every device/profile/vstep set, keyed on
+ * a hash of all descriptors reached from its device and profile list. unchanged
+ * sets are replayed instead of expanded, their header text is reused as long as
+ * the CMD numbering still matches
+ */
+#define TFA_CACHE_MAGIC "TFCC"
+#define TFA_CACHE_VERSION 2
+
+struct tfa_cache_entry {
+	uint64_t key;
+	uint32_t first_cmd;	/* cmd_count of the first message in text */
+	uint32_t nr_msgs;
+	uint32_t msg_size;	/* bytes of all messages, each one preceded by its uint32_t size */
+	uint32_t text_size;	/* bytes of the header text, 0 if not available */
+	uint8_t *data;		/* messages followed by the text */
+};
+
+struct tfa_cache_dsc {
+	uint32_t offset;	/* 0 = free slot */
+	uint64_t hash;
+};
+
+struct tfa_cache {
+	struct tfa_cache_entry *old;	/* read from the cache file, sorted on key */
+	int nr_old;
+	struct tfa_cache_entry *cur;	/* entries of this run, written back */
+	int nr_cur, max_cur;
+	struct tfa_cache_dsc *dsc;	/* content hash per descriptor offset */
+	int dsc_size, dsc_used;
+	int capture;			/* 1 : messages and text, 2 : text only */
+	struct tfa_cache_entry cap;	/* set being captured */
+	int cap_max;
+	uint8_t *text;
+	int text_size, text_max;
+	int hits, misses, text_reused;
+};
+
+static int cache_mode = 0;
+static int watch_mode = 0;
+static TFA_TLS struct tfa_cache *g_cache = NULL;
+
+/* FNV-1a, 64 bit */
+static uint64_t tfa_cache_hash(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static int tfa_cache_put(uint8_t **buf, int *size, int *max, const void *data, int len)
+{
+	while (*size + len > *max) {
+		if (tfa_blob_grow((void **)buf, max, *max, 1))
+			return -1;
+	}
+	memcpy(*buf + *size, data, len);
+	*size += len;
+
+	return 0;
+}
+
+/* one emitted 24-bit message of the set being captured */
+static void tfa_cache_put_msg(int size, const uint8_t *buffer)
+{
+	uint32_t len = (uint32_t)size;
+	int msg_size = (int)g_cache->cap.msg_size;
+
+	if (g_cache->capture != 1)
+		return;
+	if (tfa_cache_put(&g_cache->cap.data, &msg_size, &g_cache->cap_max, &len, sizeof(len))
+		|| tfa_cache_put(&g_cache->cap.data, &msg_size, &g_cache->cap_max, buffer, size)) {
+		g_cache->capture = 0; // incomplete, not cached
+		return;
+	}
+	g_cache->cap.msg_size = msg_size;
+	g_cache->cap.nr_msgs++;
+}
+
+/* header text of the set being captured */
+static void tfa_cache_put_text(const char *text, int size)
+{
+	if (g_cache == NULL || g_cache->capture == 0)
+		return;
+	if (tfa_cache_put(&g_cache->text, &g_cache->text_size, &g_cache->text_max, text, size))
+		g_cache->capture = 0;
+}
+
+/* next payload offset, packed payloads are not aligned */
+static uint32_t tfa_blob_next_offset(void)
+{
+	uint32_t align = out_packed ? 1 : TFA_BLOB_ALIGN;
+
+	return (g_blob.payload_size + align - 1) & ~(align - 1);
+}
+
+/*
+ * start a new command set, following messages belong to it
+ */
+enum tfa98xx_error tfa_blob_begin_set(int dev_idx, int prof_idx, int vstep_idx, int kind, int from)
+{
+	struct tfa_blob_set *set;
+
+	if (tfa_blob_grow((void **)&g_blob.sets, &g_blob.max_sets, g_blob.nr_sets, sizeof(*set)))
+		return TFA98XX_ERROR_FAIL;
+
+	set = &g_blob.sets[g_blob.nr_sets++];
+	memset(set, 0, sizeof(*set));
+	set->dev = (uint8_t)dev_idx;
+	set->prof = (uint16_t)prof_idx;
+	set->vstep = (uint16_t)vstep_idx;
+	set->kind = (uint8_t)kind;
+	set->from = (uint16_t)from;
+	set->first_msg = g_blob.nr_msgs;
+
+	return TFA98XX_ERROR_OK;
+}
+
+enum tfa98xx_error tfa_blob_add_message(uint32_t *command, uint32_t length)
+{
+	struct tfa_blob_msg *msg;
+	uint32_t offset = tfa_blob_next_offset();
+
+	if (g_blob.nr_sets == 0)
+		tfa_blob_begin_set(0, 0, 0, TFA_BLOB_SET_FULL, 0);
+
+	if (tfa_blob_grow((void **)&g_blob.msgs, &g_blob.max_msgs, g_blob.nr_msgs, sizeof(*msg)))
+		return TFA98XX_ERROR_FAIL;
+
+	if (offset + length > g_blob.payload_max) {
+		uint32_t max = g_blob.payload_max ? g_blob.payload_max : 64*1024;
+		uint8_t *payload;
+
+		while (offset + length > max)
+			max *= 2;
+		payload = realloc(g_blob.payload, max);
+		if (payload == NULL)
+			return TFA98XX_ERROR_FAIL;
+		g_blob.payload = payload;
+		g_blob.payload_max = max;
+	}
+
+	memset(&g_blob.payload[g_blob.payload_size], 0, offset - g_blob.payload_size); // padding
+	memcpy(&g_blob.payload[offset], command, length);
+	g_blob.payload_size = offset + length;
+
+	msg = &g_blob.msgs[g_blob.nr_msgs++];
+	msg->offset = offset;
+	msg->length = out_packed ? length : length / 4;
+	g_blob.sets[g_blob.nr_sets - 1].nr_msgs++;
+
+	return TFA98XX_ERROR_OK;
+}
+
+/*
+ * byte order of a blob in memory <-> file, converting twice gives the
+ * host order back. the 32-bit payload words are only converted when not packed
+ */
+static void tfa_blob_header_le(struct tfa_blob_header *hdr)
+{
+	hdr->version = cpu_to_le16(hdr->version);
+	hdr->header_size = cpu_to_le16(hdr->header_size);
+	hdr->nr_sets = cpu_to_le32(hdr->nr_sets);
+	hdr->nr_msgs = cpu_to_le32(hdr->nr_msgs);
+	hdr->set_offset = cpu_to_le32(hdr->set_offset);
+	hdr->msg_offset = cpu_to_le32(hdr->msg_offset);
+	hdr->payload_offset = cpu_to_le32(hdr->payload_offset);
+	hdr->payload_size = cpu_to_le32(hdr->payload_size);
+}
+
+static void tfa_blob_tables_le(struct tfa_blob_set *sets, uint32_t nr_sets, struct tfa_blob_msg *msgs, uint32_t nr_msgs)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr_sets; i++) {
+		sets[i].prof = cpu_to_le16(sets[i].prof);
+		sets[i].vstep = cpu_to_le16(sets[i].vstep);
+		sets[i].from = cpu_to_le16(sets[i].from);
+		sets[i].first_msg = cpu_to_le32(sets[i].first_msg);
+		sets[i].nr_msgs = cpu_to_le32(sets[i].nr_msgs);
+	}
+	for (i = 0; i < nr_msgs; i++) {
+		msgs[i].offset = cpu_to_le32(msgs[i].offset);
+		msgs[i].length = cpu_to_le32(msgs[i].length);
+	}
+}
+
+static void tfa_blob_words_le(uint8_t *payload, uint32_t size)
+{
+	uint32_t i, w;
+
+	for (i = 0; i + 4 <= size; i += 4) {
+		memcpy(&w, &payload[i], 4);
+		w = cpu_to_le32(w);
+		memcpy(&payload[i], &w, 4);
+	}
+}
+
+/*
+ * write header, set index, message table and payloads, little endian
+ */
+enum tfa98xx_error tfa_blob_write(char *out_name)
+{
+	struct tfa_blob_header hdr, hdr_le;
+	static const uint8_t pad[TFA_BLOB_ALIGN];
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	uint32_t pos;
+	FILE *pFileBlob;
+	int i;
+
+	pFileBlob = fopen(out_name, "wb");
+	if (pFileBlob == NULL) {
+		printf("File open fail : %s\n", out_name);
+		return TFA98XX_ERROR_FAIL;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, out_packed ? TFA_BLOB_PACKED_MAGIC : TFA_BLOB_MAGIC, sizeof(hdr.magic));
+	hdr.version = TFA_BLOB_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.nr_sets = g_blob.nr_sets;
+	hdr.nr_msgs = g_blob.nr_msgs;
+	hdr.set_offset = sizeof(hdr);
+	hdr.msg_offset = hdr.set_offset + g_blob.nr_sets * sizeof(struct tfa_blob_set);
+	pos = hdr.msg_offset + g_blob.nr_msgs * sizeof(struct tfa_blob_msg);
+	hdr.payload_offset = (pos + TFA_BLOB_ALIGN - 1) & ~(TFA_BLOB_ALIGN - 1);
+	hdr.payload_size = g_blob.payload_size;
+
+	/* message offsets become file offsets */
+	for (i = 0; i < g_blob.nr_msgs; i++)
+		g_blob.msgs[i].offset += hdr.payload_offset;
+
+	hdr_le = hdr;
+	tfa_blob_header_le(&hdr_le);
+	tfa_blob_tables_le(g_blob.sets, g_blob.nr_sets, g_blob.msgs, g_blob.nr_msgs);
+	if (!out_packed)
+		tfa_blob_words_le(g_blob.payload, g_blob.payload_size);
+
+	fwrite(&hdr_le, sizeof(hdr_le), 1, pFileBlob);
+	fwrite(g_blob.sets, sizeof(struct tfa_blob_set), g_blob.nr_sets, pFileBlob);
+	fwrite(g_blob.msgs, sizeof(struct tfa_blob_msg), g_blob.nr_msgs, pFileBlob);
+	fwrite(pad, 1, hdr.payload_offset - pos, pFileBlob);
+	fwrite(g_blob.payload, 1, g_blob.payload_size, pFileBlob);
+
+	tfa_blob_tables_le(g_blob.sets, g_blob.nr_sets, g_blob.msgs, g_blob.nr_msgs);
+	if (!out_packed)
+		tfa_blob_words_le(g_blob.payload, g_blob.payload_size);
+	for (i = 0; i < g_blob.nr_msgs; i++)
+		g_blob.msgs[i].offset -= hdr.payload_offset;
+
+	if (ferror(pFileBlob))
+		err = TFA98XX_ERROR_FAIL;
+	if (fclose(pFileBlob) != 0)
+		err = TFA98XX_ERROR_FAIL;
+	if (err != TFA98XX_ERROR_OK)
+		printf("File write fail : %s\n", out_name);
+
+	return err;
+}
+
+enum tfa98xx_error tfa_blob_add_ref(uint32_t offset, uint32_t length)
+{
+	struct tfa_blob_msg *msg;
+
+	if (tfa_blob_grow((void **)&g_blob.msgs, &g_blob.max_msgs, g_blob.nr_msgs, sizeof(*msg)))
+		return TFA98XX_ERROR_FAIL;
+
+	msg = &g_blob.msgs[g_blob.nr_msgs++];
+	msg->offset = offset;
+	msg->length = out_packed ? length : length / 4;
+	g_blob.sets[g_blob.nr_sets - 1].nr_msgs++;
+
+	return TFA98XX_ERROR_OK;
+}
+
+/*
+ * message deduplication : every unique payload is emitted once,
+ * repeated payloads refer to the first one.
+ * id is the CMD<n> number (header) or the payload offset (blob).
+ */
+struct tfa_dedup_entry {
+	uint64_t hash;		// 0 = free slot
+	uint32_t length;	// bytes
+	uint32_t id;
+	uint32_t *words;	// copy for the final compare
+};
+
+struct tfa_dedup {
+	struct tfa_dedup_entry *table;
+	uint32_t size;		// power of 2
+	uint32_t used;
+	uint32_t nr_msgs, nr_dups;
+	uint32_t bytes_saved;
+};
+
+static TFA_TLS struct tfa_dedup g_dedup;
+
+void tfa_dedup_free(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < g_dedup.size; i++)
+		free(g_dedup.table[i].words);
+	free(g_dedup.table);
+	memset(&g_dedup, 0, sizeof(g_dedup));
+}
+
+/* FNV-1a over the payload words */
+static uint64_t tfa_dedup_hash(const uint32_t *command, uint32_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint32_t i;
+
+	for (i = 0; i < length / 4; i++) {
+		hash ^= command[i];
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= length;
+
+	return hash ? hash : 1;
+}
+
+static struct tfa_dedup_entry *tfa_dedup_slot(uint64_t hash, const uint32_t *command, uint32_t length)
+{
+	struct tfa_dedup_entry *e;
+	uint32_t i = (uint32_t)hash & (g_dedup.size - 1);
+
+	for (;;) {
+		e = &g_dedup.table[i];
+		if (e->hash == 0)
+			return e;
+		if (e->hash == hash && e->length == length && memcmp(e->words, command, length) == 0)
+			return e;
+		i = (i + 1) & (g_dedup.size - 1);
+	}
+}
+
+static int tfa_dedup_grow(void)
+{
+	struct tfa_dedup old = g_dedup;
+	struct tfa_dedup_entry *e;
+	uint32_t i;
+
+	g_dedup.size = old.size ? old.size * 2 : 1024;
+	g_dedup.table = calloc(g_dedup.size, sizeof(struct tfa_dedup_entry));
+	if (g_dedup.table == NULL) {
+		g_dedup = old;
+		return -1;
+	}
+
+	for (i = 0; i < old.size; i++) {
+		if (old.table[i].hash == 0)
+			continue;
+		e = tfa_dedup_slot(old.table[i].hash, old.table[i].words, old.table[i].length);
+		*e = old.table[i];
+	}
+	free(old.table);
+
+	return 0;
+}
+
+/*
+ * return 1 and the id of an earlier identical payload,
+ * else remember this payload under the new id and return 0
+ */
+int tfa_dedup_lookup(uint32_t *command, uint32_t length, uint32_t new_id, uint32_t *id)
+{
+	struct tfa_dedup_entry *e;
+	uint64_t hash = tfa_dedup_hash(command, length);
+
+	g_dedup.nr_msgs++;
+	*id = new_id; // also when it can not be remembered, it is emitted as new
+
+	/* keep the table at most half full */
+	if ((g_dedup.used + 1) * 2 > g_dedup.size && tfa_dedup_grow())
+		return 0;
+
+	e = tfa_dedup_slot(hash, command, length);
+	if (e->hash) {
+		g_dedup.nr_dups++;
+		g_dedup.bytes_saved += length;
+		*id = e->id;
+		return 1;
+	}
+
+	e->words = malloc(length + 1);
+	if (e->words == NULL)
+		return 0;
+	memcpy(e->words, command, length);
+	e->hash = hash;
+	e->length = length;
+	e->id = new_id;
+	g_dedup.used++;
+
+	return 0;
+}
+
+/*
+ * references of the current set in dedup mode, written as
+ * const int *const SET<k>[]={CMDa,...}; with the array sizes in SET<k>_SIZE[],
+ * uint8_t arrays and uint16_t byte sizes when packed
+ */
+struct tfa_set_ref {
+	uint32_t cmd;
+	uint32_t size;	// words, bytes when packed
+};
+
+static TFA_TLS struct tfa_set_ref *g_set_refs = NULL;
+static TFA_TLS int g_set_nr_refs = 0, g_set_max_refs = 0;
+static TFA_TLS uint32_t g_set_count = 0;
+
+/* kind and from as in struct tfa_blob_set */
+enum tfa98xx_error tfa_out_begin_set(int dev_idx, int prof_idx, int vstep_idx, int kind, int from)
+{
+	if (g_sinks)
+		return tfa_sinks_event(SINK_EV_BEGIN_SET, dev_idx, prof_idx, vstep_idx, kind, from);
+
+	g_set_nr_refs = 0;
+	if (g_stats)
+		tfa_stats_begin_set(dev_idx, prof_idx, vstep_idx, kind, from);
+	if (out_format == OUT_BLOB)
+		return tfa_blob_begin_set(dev_idx, prof_idx, vstep_idx, kind, from);
+
+	return TFA98XX_ERROR_OK;
+}
+
+/* the SET<k> reference arrays of a set in dedup mode, a set without messages has none */
+static void tfa_out_header_end_set(void)
+{
+	char *buffer, *p;
+	int i;
+
+	if (!dedup_mode || pFileHeader == NULL || g_set_nr_refs == 0)
+		return;
+
+	buffer = text_reserve(64 + g_set_nr_refs * 24);
+	if (buffer == NULL)
+		return;
+
+	g_set_count++;
+	p = text_append(buffer, out_packed ? "\nconst uint8_t *const SET" : "\nconst int *const SET");
+	p = text_append_uint(p, g_set_count);
+	p = text_append(p, "[]={");
+	for (i = 0; i < g_set_nr_refs; i++) {
+		p = text_append(p, "CMD");
+		p = text_append_uint(p, g_set_refs[i].cmd);
+		*p++ = ',';
+	}
+	p[-1] = '}';
+	p = text_append(p, out_packed ? ";\nconst uint16_t SET" : ";\nconst int SET");
+	p = text_append_uint(p, g_set_count);
+	p = text_append(p, "_SIZE[]={");
+	for (i = 0; i < g_set_nr_refs; i++) {
+		p = text_append_uint(p, g_set_refs[i].size);
+		*p++ = ',';
+	}
+	p[-1] = '}';
+	p = text_append(p, ";\n");
+
+	fwrite(buffer, 1, p - buffer, pFileHeader);
+}
+
+void tfa_out_end_set(void)
+{
+	tfa_batch_flush();
+	if (g_sinks)
+		tfa_sinks_event(SINK_EV_END_SET, 0, 0, 0, 0, 0);
+	else if (out_format == OUT_HEADER)
+		tfa_out_header_end_set();
+}
+
+/* 1 if header comments are written, by this thread or by the header sink */
+static int tfa_out_has_text(void)
+{
+	return pFileHeader != NULL || (g_sinks && (sink_mask & (1u << SINK_HEADER)));
+}
+
+/* comment text of the C header */
+static void tfa_out_text(const char *fmt, ...)
+{
+	char text[512];
+	va_list ap;
+	int len;
+
+	if (!tfa_out_has_text())
+		return;
+
+	va_start(ap, fmt);
+	len = vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len >= (int)sizeof(text))
+		len = sizeof(text) - 1;
+
+	if (g_sinks)
+		tfa_sinks_text(text, len);
+	else
+		fwrite(text, 1, len, pFileHeader);
+}
+
+/* a vstep message of full_size bytes went out as sent_size bytes of partial updates */
+static void tfa_out_partial(int full_size, int sent_size)
+{
+	if (g_sinks) {
+		if (sink_mask & (1u << SINK_STATS))
+			tfa_sinks_event(SINK_EV_PARTIAL, full_size, sent_size, 0, 0, 0);
+	} else if (g_stats)
+		tfa_stats_partial(full_size, sent_size);
+}
+
+static void tfa_out_add_ref(uint32_t cmd, uint32_t size)
+{
+	if (tfa_blob_grow((void **)&g_set_refs, &g_set_max_refs, g_set_nr_refs, sizeof(struct tfa_set_ref)))
+		return;
+	g_set_refs[g_set_nr_refs].cmd = cmd;
+	g_set_refs[g_set_nr_refs].size = size;
+	g_set_nr_refs++;
+}
+
+void tfa_out_free(void)
+{
+	free(g_set_refs);
+	g_set_refs = NULL;
+	g_set_nr_refs = g_set_max_refs = 0;
+	g_set_count = 0;
+	tfa_dedup_free();
+}
+
+static enum tfa98xx_error tfa_out_blob_message(uint32_t *command, uint32_t length)
+{
+	uint32_t id;
+
+	if (g_blob.nr_sets == 0)
+		tfa_blob_begin_set(0, 0, 0, TFA_BLOB_SET_FULL, 0);
+	if (dedup_mode && tfa_dedup_lookup(command, length, tfa_blob_next_offset(), &id))
+		return tfa_blob_add_ref(id, length);
+	return tfa_blob_add_message(command, length);
+}
+
+/* one CMD<n> array, a packed message is length 24-bit bytes in command */
+static void tfa_out_header_array(uint32_t *command, uint32_t length, char *str_cmd)
+{
+	if (out_packed)
+		fwrite_message_packed((uint8_t *)command, length, str_cmd);
+	else
+		fwrite_message(command, length, str_cmd);
+}
+
+static enum tfa98xx_error tfa_out_header_message(uint32_t *command, uint32_t length, char *str_cmd)
+{
+	uint32_t id;
+
+	if (dedup_mode) {
+		if (!tfa_dedup_lookup(command, length, cmd_count, &id)) {
+			tfa_out_header_array(command, length, str_cmd);
+			cmd_count++;
+		}
+		tfa_out_add_ref(id, out_packed ? length : length / 4);
+	} else {
+		tfa_out_header_array(command, length, str_cmd);
+		cmd_count++;
+	}
+
+	return TFA98XX_ERROR_OK;
+}
+
+/*
+ * emit one converted message in the selected output format
+ */
+static enum tfa98xx_error tfa_out_message(uint32_t *command, uint32_t length, char *str_cmd)
+{
+	if (out_format == OUT_BLOB)
+		return tfa_out_blob_message(command, length);
+
+	return tfa_out_header_message(command, length, str_cmd);
+}
+
+/*
+ * message recording, used to know the DSP state a profile leaves behind.
+ * key is the 24-bit command id, data NULL marks the parameter as unknown
+ */
+struct tfa_rec_msg {
+	uint32_t key;
+	int size;
+	uint8_t *data;
+	int sent;	// bytes sent of a TFA_REC_PARTIAL entry, its size is the full size
+};
+
+/* partial update stats entry of a replay record, not a message */
+#define TFA_REC_PARTIAL 0xffffffffu
+
+struct tfa_msg_record {
+	struct tfa_rec_msg *msgs;
+	int nr_msgs, max_msgs;
+	int total_size;	// bytes of all recorded messages
+	int replay;	// for tfa_record_replay(), keep partial updates and their stats
+	struct tfa_volume_step_register_info *reg_info; // last vstep written
+};
+
+static TFA_TLS struct tfa_msg_record *g_record = NULL;	// record instead of emit
+static TFA_TLS struct tfa_msg_record *g_switch_state = NULL;	// drop messages already in this state
+static TFA_TLS int g_emit_bytes = 0;	// bytes of all emitted messages
+
+#define TFA_MSG_KEY(buffer) ((uint32_t)((buffer)[0] << 16 | (buffer)[1] << 8 | ((buffer)[2] & ~BIT(6))))
+
+static enum tfa98xx_error tfa_record_add(struct tfa_msg_record *rec, int size, uint8_t *buffer)
+{
+	struct tfa_rec_msg *msg;
+
+	if (tfa_blob_grow((void **)&rec->msgs, &rec->max_msgs, rec->nr_msgs, sizeof(*msg)))
+		return TFA98XX_ERROR_FAIL;
+
+	msg = &rec->msgs[rec->nr_msgs];
+	msg->key = TFA_MSG_KEY(buffer);
+	msg->size = size;
+	msg->data = NULL;
+	if (rec->replay || (buffer[2] & BIT(6)) == 0) { // partial updates leave the parameter unknown here
+		msg->data = malloc(size);
+		if (msg->data == NULL)
+			return TFA98XX_ERROR_FAIL;
+		memcpy(msg->data, buffer, size);
+	}
+	rec->nr_msgs++;
+	rec->total_size += size;
+
+	return TFA98XX_ERROR_OK;
+}
+
+static enum tfa98xx_error tfa_record_partial(struct tfa_msg_record *rec, int full_size, int sent_size)
+{
+	struct tfa_rec_msg *msg;
+
+	if (tfa_blob_grow((void **)&rec->msgs, &rec->max_msgs, rec->nr_msgs, sizeof(*msg)))
+		return TFA98XX_ERROR_FAIL;
+
+	msg = &rec->msgs[rec->nr_msgs++];
+	msg->key = TFA_REC_PARTIAL;
+	msg->size = full_size;
+	msg->data = NULL;
+	msg->sent = sent_size;
+
+	return TFA98XX_ERROR_OK;
+}
+
+void tfa_record_free(struct tfa_msg_record *rec)
+{
+	int i;
+
+	for (i = 0; i < rec->nr_msgs; i++)
+		free(rec->msgs[i].data);
+	free(rec->msgs);
+	memset(rec, 0, sizeof(*rec));
+}
+
+/*
+ * return 1 if the last write of this command id in the state is identical
+ */
+static int tfa_record_has(struct tfa_msg_record *rec, int size, uint8_t *buffer)
+{
+	uint32_t key = TFA_MSG_KEY(buffer);
+	int i;
+
+	for (i = rec->nr_msgs - 1; i >= 0; i--) {
+		if (rec->msgs[i].key != key)
+			continue;
+		return (rec->msgs[i].data != NULL) && (rec->msgs[i].size == size)
+			&& (memcmp(rec->msgs[i].data, buffer, size) == 0);
+	}
+
+	return 0;
+}
+
+/*
+ * convert and emit one 24-bit message, labeled with the command name if label is NULL
+ */
+static enum tfa98xx_error tfa_dsp_write(int buffer_size, const uint8_t *buffer, const char *label)
+{
+	struct tfa_dsp_cmd_info info;
+	char str_cmd[64];
+	enum tfa98xx_error err;
+	double t;
+
+	if (label)
+		snprintf(str_cmd, sizeof(str_cmd), "%s", label);
+	else if (tfa_dsp_cmd_decode(buffer, buffer_size, &info) == 0 && info.partial && info.name)
+		snprintf(str_cmd, sizeof(str_cmd), "%s (partial)", info.name);
+	else
+		snprintf(str_cmd, sizeof(str_cmd), "%s", get_command_string(buffer[1], buffer[2]));
+
+	if (g_sinks) { // converted by the sinks
+		printf("Set Command --> [%s], size=%d\n", str_cmd, out_packed ? buffer_size : (buffer_size / 3) * 4);
+		t = tfa_stats_start();
+		err = tfa_sinks_msg(buffer_size, buffer, str_cmd);
+		tfa_stats_stop(STAGE_EMIT, t);
+		return err;
+	}
+
+	t = tfa_stats_start();
+	uint32_t out_length = tfa_msg_out(buffer, buffer_size);
+	tfa_stats_stop(STAGE_CONVERT, t);
+	printf("Set Command --> [%s], size=%d\n", str_cmd, out_length);
+	//printf("dsp_msg : 32bit_length = %d\n", out_length);
+	//print_message((uint32_t *)g_out32buf, out_length);
+	t = tfa_stats_start();
+	err = tfa_out_message((uint32_t *)g_out32buf, out_length, str_cmd);
+	tfa_stats_stop(STAGE_EMIT, t);
+
+	return err;
+}
+
+enum tfa98xx_error dsp_msg(tfa98xx_handle_t device_index, int buffer_size, uint8_t *buffer)
+{
+	//printf("dsp_msg : idx=%d, size=%d, cmd=0x%02x%02x%02x\n", device_index, buffer_size, buffer[0], buffer[1], buffer[2]);
+
+	if (g_record)
+		return tfa_record_add(g_record, buffer_size, buffer);
+
+	if (g_switch_state) {
+		if (tfa_record_has(g_switch_state, buffer_size, buffer)) {
+			printf("Unchanged Command --> [%s], dropped\n", get_command_string(buffer[1], buffer[2]));
+			return TFA98XX_ERROR_OK;
+		}
+		if (tfa_record_add(g_switch_state, buffer_size, buffer))
+			return TFA98XX_ERROR_FAIL;
+	}
+	g_emit_bytes += buffer_size;
+	if (g_stats && g_sinks == NULL) // else counted by the stats sink
+		tfa_stats_msg(buffer_size, buffer);
+	if (g_cache)
+		tfa_cache_put_msg(buffer_size, buffer);
+
+	if (msg_batch_max)
+		return tfa_batch_msg(device_index, buffer_size, buffer);
+
+	return tfa_dsp_write(buffer_size, buffer, NULL);
+}
+
+/*
+ * emit the messages of a replay record in order, as written while recording
+ */
+static enum tfa98xx_error tfa_record_replay(int dev_idx, struct tfa_msg_record *rec)
+{
+	enum tfa98xx_error err;
+	int i;
+
+	for (i = 0; i < rec->nr_msgs; i++) {
+		if (rec->msgs[i].key == TFA_REC_PARTIAL) {
+			tfa_out_partial(rec->msgs[i].size, rec->msgs[i].sent);
+			continue;
+		}
+		err = dsp_msg(dev_idx, rec->msgs[i].size, rec->msgs[i].data);
+		if (err != TFA98XX_ERROR_OK)
+			return err;
+	}
+
+	return TFA98XX_ERROR_OK;
+}
+
+#define NR_COEFFS 6
+#define NR_BIQUADS 28
+#define BQ_SIZE (3 * NR_COEFFS)
+#define DSP_MSG_OVERHEAD 27
+
+/*
+ * bus cost model used to choose between full and partial writes
+ */
+struct tfa_bus_cost {
+	int msg_overhead;	/* bytes of overhead per dsp message (i2c transaction, rpc header) */
+	int bytes_per_sec;	/* bus throughput, for the time estimates */
+	int max_transfer;	/* max bytes of one dsp message, 0 is no limit */
+};
+
+static struct tfa_bus_cost bus_cost = {
+	DSP_MSG_OVERHEAD,
+	400000 / 9,		/* 400 kHz i2c, 9 clocks per byte */
+	0
+};
+
+static int tfa_bus_time_us(int bytes)
+{
+	return (int)((long long)bytes * 1000000 / bus_cost.bytes_per_sec);
+}
+
+/*
+ * batching of small framework and speakerboost set messages into multi messages,
+ * a multi message has to fit g_out32buf after conversion
+ */
+#define TFA_BATCH_MAX_PAYLOAD	((int)(sizeof(g_out32buf) / 4) * 3)
+#define TFA_BATCH_SMALL_MSG	(3 + 32 * 3) /* command id and up to 32 words */
+
+struct tfa_batch {
+	int dev_idx;
+	int nr_msgs;
+	int size;		// bytes in buf, marker and length words included
+	uint8_t buf[TFA_BATCH_MAX_PAYLOAD];
+	/* totals of the conversion */
+	int nr_batches;
+	int nr_batched;		// messages sent in multi messages
+	int bytes_saved;
+};
+
+static TFA_TLS struct tfa_batch g_batch;
+
+static int tfa_batch_is_small_set(int size, const uint8_t *buffer)
+{
+	if (size < 3 || size > TFA_BATCH_SMALL_MSG)
+		return 0;
+	if (buffer[1] != MODULE_FRAMEWORK && buffer[1] != MODULE_SPEAKERBOOST)
+		return 0;
+
+	return (buffer[2] & TFA_DSP_PARAM_GET) == 0;
+}
+
+/*
+ * bus bytes saved by one multi message of nr messages and size bytes, end marker
+ * included, instead of nr single writes. over max_transfer it takes more transfers
+ */
+static int tfa_batch_saving(int nr, int size)
+{
+	int transfers = 1;
+
+	if (bus_cost.max_transfer > 0)
+		transfers = (size + bus_cost.max_transfer - 1) / bus_cost.max_transfer;
+
+	return (nr - transfers) * bus_cost.msg_overhead - 2 * 3 - nr * 3;
+}
+
+static enum tfa98xx_error tfa_batch_flush(void)
+{
+	struct tfa_batch *b = &g_batch;
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	char label[32];
+	int pos, len;
+
+	if (b->nr_msgs == 0)
+		return TFA98XX_ERROR_OK;
+
+	if (b->nr_msgs == 1 || tfa_batch_saving(b->nr_msgs, b->size + 3) <= 0) {
+		/* not worth it, the messages are written one by one */
+		for (pos = 3; pos < b->size && err == TFA98XX_ERROR_OK; pos += 3 + len) {
+			len = 3 * ((b->buf[pos] << 16) | (b->buf[pos + 1] << 8) | b->buf[pos + 2]);
+			err = tfa_dsp_write(len, &b->buf[pos + 3], NULL);
+		}
+	} else {
+		memset(&b->buf[b->size], 0, 3); // end of the multi message
+		b->size += 3;
+		snprintf(label, sizeof(label), "multi message (%d)", b->nr_msgs);
+		err = tfa_dsp_write(b->size, b->buf, label);
+		b->nr_batches++;
+		b->nr_batched += b->nr_msgs;
+		b->bytes_saved += tfa_batch_saving(b->nr_msgs, b->size);
+	}
+	b->nr_msgs = 0;
+	b->size = 0;
+
+	return err;
+}
+
+/*
+ * queue a message for the multi message of its device, messages that are not
+ * small set messages end the current one and are written directly
+ */
+static enum tfa98xx_error tfa_batch_msg(int dev_idx, int size, const uint8_t *buffer)
+{
+	struct tfa_batch *b = &g_batch;
+	int max = (msg_batch_max < TFA_BATCH_MAX_PAYLOAD) ? msg_batch_max : TFA_BATCH_MAX_PAYLOAD;
+	enum tfa98xx_error err;
+
+	if (bus_cost.max_transfer > 0 && bus_cost.max_transfer < max) // a multi message is one transfer
+		max = bus_cost.max_transfer;
+
+	if (!tfa_batch_is_small_set(size, buffer) || size % 3) {
+		err = tfa_batch_flush();
+		return (err != TFA98XX_ERROR_OK) ? err : tfa_dsp_write(size, buffer, NULL);
+	}
+
+	if (b->nr_msgs && (b->dev_idx != dev_idx || b->size + 3 + size + 3 > max)) {
+		err = tfa_batch_flush();
+		if (err != TFA98XX_ERROR_OK)
+			return err;
+	}
+	if (3 + 3 + size + 3 > max) // can never be batched
+		return tfa_dsp_write(size, buffer, NULL);
+
+	if (b->nr_msgs == 0) {
+		memcpy(b->buf, TFA_DSP_MULTI_MSG_MARKER, 3);
+		b->size = 3;
+		b->dev_idx = dev_idx;
+	}
+	b->buf[b->size++] = (uint8_t)((size / 3) >> 16);
+	b->buf[b->size++] = (uint8_t)((size / 3) >> 8);
+	b->buf[b->size++] = (uint8_t)(size / 3);
+	memcpy(&b->buf[b->size], buffer, size);
+	b->size += size;
+	b->nr_msgs++;
+
+	return TFA98XX_ERROR_OK;
+}
+
+#pragma pack (push, 1)
+struct dsp_msg_all_coeff {
+	uint8_t select_eq[3];
+	uint8_t biquad[NR_BIQUADS][NR_COEFFS][3];
+};
+#pragma pack (pop)
+
+static const int eq_biquads[] = {
+	10, 10, 2, 2, 2, 2
+};
+#define NR_EQ (int)(sizeof(eq_biquads) / sizeof(int))
+enum tfa98xx_error dsp_partial_coefficients(tfa98xx_handle_t dev_idx, uint8_t *prev, uint8_t *next)
+{
+	uint8_t bq, eq;
+	int eq_offset;
+	int new_cost, old_cost;
+	int all_fits, eq_fits, bq_fits, partial_fits = 1;
+	uint32_t eq_biquad_mask[NR_EQ];
+	uint32_t coeff_mask[(NR_BIQUADS * NR_COEFFS + 31) / 32];
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	struct dsp_msg_all_coeff *data1 = (struct dsp_msg_all_coeff *)prev;
+	struct dsp_msg_all_coeff *data2 = (struct dsp_msg_all_coeff *)next;
+
+	/* one change bit per coefficient of all biquads */
+	tfa_word_diff(&data1->biquad[0][0][0], &data2->biquad[0][0][0], NR_BIQUADS * NR_COEFFS, coeff_mask);
+
+	old_cost = bus_cost.msg_overhead + 3 + sizeof(struct dsp_msg_all_coeff);
+	new_cost = 0;
+
+	/* each message must fit in one transfer */
+	all_fits = !bus_cost.max_transfer || (int)(3 + sizeof(struct dsp_msg_all_coeff)) <= bus_cost.max_transfer;
+	bq_fits = !bus_cost.max_transfer || 6 + BQ_SIZE <= bus_cost.max_transfer;
+
+	eq_offset = 0;
+	for (eq=0; eq<NR_EQ; eq++) {
+		int nr_bq = 0;
+
+		eq_biquad_mask[eq] = 0;
+		for (bq=0; bq < eq_biquads[eq]; bq++) {
+			if (tfa_word_mask_bits(coeff_mask, (eq_offset + bq) * NR_COEFFS, NR_COEFFS)) {
+				eq_biquad_mask[eq] |= (1<<bq);
+				nr_bq++;
+			}
+		}
+
+		if (nr_bq) {
+			int bq_sz, eq_sz;
+
+			bq_sz = (2 * 3 + BQ_SIZE) * nr_bq;
+			eq_sz = 2 * 3 + BQ_SIZE * eq_biquads[eq];
+
+			/* dsp message i2c transaction overhead */
+			bq_sz += bus_cost.msg_overhead * nr_bq;
+			eq_sz += bus_cost.msg_overhead;
+
+			eq_fits = !bus_cost.max_transfer || 6 + BQ_SIZE * eq_biquads[eq] <= bus_cost.max_transfer;
+			if (!eq_fits && !bq_fits)
+				partial_fits = 0;
+
+			if (eq_fits && (!bq_fits || bq_sz >= eq_sz)) {
+				eq_biquad_mask[eq] = 0xffffffff;
+
+				new_cost += eq_sz;
+
+			} else {
+				new_cost += bq_sz;
+			}
+		}
+		printf("eq_biquad_mask[%d] = 0x%.8x\n", eq, eq_biquad_mask[eq]);
+
+		eq_offset += eq_biquads[eq];
+	}
+
+	printf("cost for writing all coefficients     = %d (%d us)\n", old_cost, tfa_bus_time_us(old_cost));
+	printf("cost for writing changed coefficients = %d (%d us)\n", new_cost, tfa_bus_time_us(new_cost));
+
+	if (!all_fits && !partial_fits) {
+		printf("coefficients do not fit in a transfer of %d bytes\n", bus_cost.max_transfer);
+		return TFA98XX_ERROR_BAD_PARAMETER;
+	}
+
+	if (all_fits && (!partial_fits || new_cost >= old_cost)) {
+		const int buffer_sz = 3 + sizeof(struct dsp_msg_all_coeff);
+		uint8_t *buffer;
+
+		buffer = malloc(buffer_sz);
+		if (buffer == NULL)
+			return TFA98XX_ERROR_FAIL;
+
+		/* cmd id */
+		buffer[0] = 0x00;
+		buffer[1] = 0x82;
+		buffer[2] = 0x00;
+
+		/* parameters */
+		memcpy(&buffer[3], data2, sizeof(struct dsp_msg_all_coeff));
+		err = dsp_msg(dev_idx, buffer_sz, (uint8_t *)buffer);
+
+		free(buffer);
+		if (err)
+			return err;
+
+	} else {
+		eq_offset = 0;
+		for (eq=0; eq<NR_EQ; eq++) {
+			uint8_t *eq2 = &data2->biquad[eq_offset][0][0];
+
+			if (eq_biquad_mask[eq] == 0xffffffff) {
+				const int msg_sz = 6 + BQ_SIZE * eq_biquads[eq];
+				uint8_t *msg;
+
+				msg = malloc(msg_sz);
+				if (msg == NULL)
+					return TFA98XX_ERROR_FAIL;
+
+				/* cmd id */
+				msg[0] = 0x00;
+				msg[1] = 0x82;
+				msg[2] = 0x00;
+
+				/* select eq and bq */
+				msg[3] = 0x00;
+				msg[4] = eq+1;
+				msg[5] = 0x00; /* all biquads */
+
+				/* biquad parameters */
 				memcpy(&msg[6], eq2, BQ_SIZE * eq_biquads[eq]);
 				err = dsp_msg(dev_idx, msg_sz, (uint8_t *)msg);
 
-				free(msg);
-				if (err)
-					return err;
+				free(msg);
+				if (err)
+					return err;
+
+			} else if (eq_biquad_mask[eq] != 0) {
+				for(bq=0; bq < eq_biquads[eq]; bq++) {
+
+					if (eq_biquad_mask[eq] & (1<<bq)) {
+						uint8_t *bq2 = &eq2[bq*BQ_SIZE];
+						const int msg_sz = 6 + BQ_SIZE;
+						uint8_t *msg;
+
+						msg = malloc(msg_sz);
+						if (msg == NULL)
+							return TFA98XX_ERROR_FAIL;
+
+						/* cmd id */
+						msg[0] = 0x00;
+						msg[1] = 0x82;
+						msg[2] = 0x00;
+
+						/* select eq and bq*/
+						msg[3] = 0x00;
+						msg[4] = eq+1;
+						msg[5] = bq+1;
+
+						/* biquad parameters */
+						memcpy(&msg[6], bq2, BQ_SIZE);
+						err = dsp_msg(dev_idx, msg_sz, (uint8_t *)msg);
+
+						free(msg);
+						if (err)
+							return err;
+					}
+				}
+			}
+			eq_offset += eq_biquads[eq];
+		}
+	}
+
+	return err;
+}
+
+static enum tfa98xx_error tfa_cont_write_vstepMax2_One(int dev_idx, struct tfa_volume_step_message_info *new_msg,
+						    struct tfa_volume_step_message_info *old_msg, int enable_partial_update)
+{
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	int len = (tfa_cont_get_msg_len(new_msg) - 1) * 3;
+	char *buf = (char*)new_msg->parameter_data;
+	uint8_t *partial = NULL;
+	int partial_size = 0;
+#if defined(TFADSP_DSP_BUFFER_POOL)
+	int buffer_p_index = -1, partial_p_index = -1;
+#endif
+	uint8_t cmdid[3];
+	int use_partial_coeff = 0;
+	int full_len = len, emit_bytes = g_record ? g_record->total_size : g_emit_bytes;
+	double t;
+
+	if (enable_partial_update) {
+		if (new_msg->message_type != old_msg->message_type) {
+			printf("Message type differ - Disable Partial Update\n");
+			enable_partial_update = 0;
+		} else if (tfa_cont_get_msg_len(new_msg) != tfa_cont_get_msg_len(old_msg)) {
+			printf("Message Length differ - Disable Partial Update\n");
+			enable_partial_update = 0;
+		}
+	}
+
+	if ((enable_partial_update) && (new_msg->message_type == 1)) {
+		/* No patial updates for message type 1 (Coefficients) */
+		enable_partial_update = 0;
+		/* but per eq / biquad updates when selected and the message holds all coefficients */
+		if (coeff_partial_mode && (len == sizeof(struct dsp_msg_all_coeff)))
+			use_partial_coeff = 1;
+	#if 0 // TODO rev=0x3b72 in the log
+		if ((tfa98xx_dev_revision(dev_idx) & 0xff ) == 0x88)
+			use_partial_coeff = 1;
+	#endif
+	}
+
+	/* Change Message Len to the actual buffer len */
+	memcpy(cmdid, new_msg->cmd_id, sizeof(cmdid));
+
+	/* The algoparams and mbdrc msg id will be changed to the reset type when SBSL=0
+	 * if SBSL=1 the msg will remain unchanged. It's up to the tuning engineer to choose the 'without_reset'
+	 * types inside the vstep. In other words: the reset msg is applied during SBSL==0 else it remains unchanged.
+	 */
+	//printf("is_cold = %d\n", is_cold);
+	// if (TFA_GET_BF(dev_idx, SBSL) == 0) {
+	if (is_cold == 1) {
+		//uint8_t org_cmd = cmdid[2];
+
+		if ((new_msg->message_type == 0) &&
+			(cmdid[2] != SB_PARAM_SET_ALGO_PARAMS)) // SB_PARAM_SET_ALGO_PARAMS_WITHOUT_RESET
+		{
+			//printf("P-ID for SetAlgoParams modified! cmdid[2]=0x%2x (to 0x00)\n", cmdid[2]);
+			cmdid[2] = SB_PARAM_SET_ALGO_PARAMS;
+		} else if ((new_msg->message_type == 2) &&
+			(cmdid[2] != SB_PARAM_SET_MBDRC)) // SB_PARAM_SET_MBDRC_WITHOUT_RESET
+		{
+			//printf("P-ID for SetMBDrc modified! cmdid[2]=0x%2x (to 0x07)\n", cmdid[2]);
+			cmdid[2] = SB_PARAM_SET_MBDRC;
+		}
+
+		//if (org_cmd != cmdid[2])
+		//	printf("P-ID: cmdid[2]=0x%02x to 0x%02x\n", org_cmd, cmdid[2]);
+	}
+
+	/*
+	 * +sizeof(struct tfa_partial_msg_block) will allow to fit one
+	 * additonnal partial block If the partial update goes over the len of
+	 * a regular message ,we can safely write our block and check afterward
+	 * that we are over the size of a usual update
+	 */
+	if (enable_partial_update) {
+		partial_size = (sizeof(uint8_t) * len) + sizeof(struct tfa_partial_msg_block);
+#if defined(TFADSP_DSP_BUFFER_POOL)
+		partial_p_index = tfa98xx_buffer_pool_access(dev_idx, -1, partial_size, POOL_GET);
+		if (partial_p_index != -1) {
+			//printf("allocated from buffer_pool[%d] for %d bytes\n", partial_p_index, partial_size);
+			partial = (uint8_t *)(handles_local[dev_idx].buf_pool[partial_p_index].pool);
+		} else {
+			partial = malloc(partial_size);
+		}
+#else
+		partial = kmalloc(partial_size, GFP_KERNEL);
+#endif // TFADSP_DSP_BUFFER_POOL
+		if (!partial)
+			printf("Partial update memory error - Disabling\n");
+	}
+
+	t = tfa_stats_start();
+	if (partial) {
+		uint8_t offset = 0, i = 0;
+		uint16_t *change;
+		uint8_t *n = new_msg->parameter_data;
+		uint8_t *p = partial;
+		uint8_t* trim = partial;
+		int w = 0, nr, nr_words = len / 3;
+		uint32_t mask_buf[64], *mask = mask_buf, bits;
+
+		/* set dspFiltersReset */
+		*p++ = 0x02;
+		*p++ = 0x00;
+		*p++ = 0x00;
+
+		/* change bit per word, the blocks below take 16 bits at a time */
+		if (nr_words > 64 * 32)
+			mask = malloc(((nr_words + 31) / 32) * sizeof(uint32_t));
+		if (mask)
+			tfa_word_diff(old_msg->parameter_data, n, nr_words, mask);
+		else
+			w = nr_words; // no memory, skip the diff
+
+		while ((w < nr_words) &&
+		      (p < (partial + len - 3))) {
+			if ((offset == 0xff) ||
+			    tfa_word_mask_bits(mask, w, 1)) {
+				*p++ = offset;
+				change = (uint16_t*) p;
+				p += 2;
+
+				nr = (nr_words - w < 16) ? nr_words - w : 16;
+				bits = tfa_word_mask_bits(mask, w, nr);
+				for (i = 0; i < nr; i++) {
+					if (bits & BIT(i)) {
+						memcpy(p, &n[3 * (w + i)], 3);
+						p += 3;
+						trim = p;
+					}
+				}
+
+				w += nr;
+				offset = 0;
+				*change = cpu_to_be16((uint16_t)bits);
+			} else {
+				w++;
+				offset++;
+			}
+		}
+
+		if (mask == NULL) {
+			printf("Partial update memory error - use regular update\n");
+		} else if (trim == partial) {
+			printf("No Change in message - discarding %d bytes\n", len);
+			len = 0;
+
+		} else if (trim < (partial + len - 3)) {
+			printf("Using partial update: %d -> %d bytes\n", len , (int)(trim-partial+3));
+
+			/* Add the termination marker */
+			memset(trim, 0x00, 3);
+			trim += 3;
+
+			/* Signal This will be a partial update */
+			cmdid[2] |= BIT(6);
+			buf = (char*) partial;
+			len = (int)(trim - partial);
+		} else {
+			printf("Partial too big - use regular update\n");
+		}
+		if (mask != mask_buf)
+			free(mask);
+	}
+	tfa_stats_stop(STAGE_DIFF, t);
+
+	if (use_partial_coeff) {
+		err = dsp_partial_coefficients(dev_idx, old_msg->parameter_data, new_msg->parameter_data);
+	} else if (len) {
+		uint8_t *buffer;
+		//printf("Command-ID used: 0x%02x%02x%02x \n", cmdid[0], cmdid[1], cmdid[2]);
+
+#if defined(TFADSP_DSP_BUFFER_POOL)
+		buffer_p_index = tfa98xx_buffer_pool_access(dev_idx, -1, 3 + len, POOL_GET);
+		if (buffer_p_index != -1) {
+			//printf("allocated from buffer_pool[%d] for %d bytes\n", buffer_p_index, 3 + len);
+			buffer = (uint8_t *)(handles_local[dev_idx].buf_pool[buffer_p_index].pool);
+		} else {
+			buffer = malloc(3 + len);
+			if (buffer == NULL) {
+				printf("kmalloc error %d bytes\n", 3 + len);
+				goto tfa_cont_write_vstepMax2_One_error_exit;
+			}
+		}
+#else
+		buffer = kmalloc(3 + len, GFP_KERNEL);
+		if (buffer == NULL)
+			goto tfa_cont_write_vstepMax2_One_error_exit;
+#endif // TFADSP_DSP_BUFFER_POOL
+
+		memcpy(&buffer[0], cmdid, 3);
+		memcpy(&buffer[3], buf, len);
+		err = dsp_msg(dev_idx, 3 + len, (uint8_t *)buffer);
+
+#if defined(TFADSP_DSP_BUFFER_POOL)
+		if (buffer_p_index != -1) {
+			tfa98xx_buffer_pool_access(dev_idx, buffer_p_index, 0, POOL_RETURN);
+		} else {
+			free(buffer);
+		}
+#else
+		kfree(buffer);
+#endif // TFADSP_DSP_BUFFER_POOL
+	}
+
+	if ((partial || use_partial_coeff) && err == TFA98XX_ERROR_OK) {
+		if (g_record == NULL)
+			tfa_out_partial(3 + full_len, g_emit_bytes - emit_bytes);
+		else if (g_record->replay)
+			err = tfa_record_partial(g_record, 3 + full_len, g_record->total_size - emit_bytes);
+	}
+
+tfa_cont_write_vstepMax2_One_error_exit:
+#if defined(TFADSP_DSP_BUFFER_POOL)
+	if (partial_p_index != -1) {
+		tfa98xx_buffer_pool_access(dev_idx, partial_p_index, 0, POOL_RETURN);
+	} else {
+		if (partial)
+			free(partial);
+	}
+#else
+	if (partial)
+		kfree(partial);
+#endif // TFADSP_DSP_BUFFER_POOL
+
+	return err;
+}
+
+void create_dsp_buffer_msg(struct tfa_msg *msg, char *buffer, int *size)
+{
+        int i, j = 0;
+
+        /* Copy cmd_id. Remember that the cmd_id is reversed */
+        buffer[0] = msg->cmd_id[2];
+        buffer[1] = msg->cmd_id[1];
+        buffer[2] = msg->cmd_id[0];
+
+        /* Copy the data to the buffer */
+        for(i=3; i<3+(msg->msg_size*3); i++) {
+                buffer[i] = (uint8_t) ((msg->data[j] >> 16) & 0xffff);
+                i++;
+                buffer[i] = (uint8_t) ((msg->data[j] >> 8) & 0xff);
+                i++;
+                buffer[i] = (uint8_t) (msg->data[j] & 0xff);
+                j++;
+        }
+
+        *size = (3+(msg->msg_size*3)) * sizeof(char);
+}
+
+int tfa_set_swvstep(tfa98xx_handle_t handle, unsigned short new_value)
+{
+	///int mtpk, active_value = tfa_get_swvstep(handle);
+	//unsigned short rev = handles_local[handle].rev & 0xff;
+	handles_local[handle].vstep[0]=new_value;
+	handles_local[handle].vstep[1]=new_value;
+
+	//return active_value;
+	return 0;
+}
+
+static TFA_TLS struct tfa_volume_step_register_info *p_reg_info = NULL; /* previous vstep written */
+
+static enum tfa98xx_error tfa_cont_write_vstepMax2(int dev_idx, struct tfa_vstep_index *vsi, int vstep_idx, int vstep_msg_idx)
+{
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	struct tfa_volume_step_register_info *reg_info = NULL;
+	struct tfa_volume_step_message_info *msg_info = NULL, *p_msg_info = NULL;
+	//struct tfa_bitfield bit_f;
+	int i, nr_messages, enp = handles_local[dev_idx].partial_enable;
+
+	if(vstep_idx >= vsi->nr_vsteps) {
+		printf("Volumestep %d is not available \n", vstep_idx);
+		return TFA98XX_ERROR_BAD_PARAMETER;
+	}
+
+	if ( p_reg_info == NULL) {
+		//printf("Inital vstep write\n");
+		enp = 0;
+ 	}
+
+	reg_info = tfa_cont_get_reg_for_vstep(vsi, vstep_idx);
+
+	msg_info = tfa_cont_get_msg_info_from_reg(reg_info);
+	nr_messages = msg_info->nr_of_messages;
+
+	if (enp) {
+		p_msg_info = tfa_cont_get_msg_info_from_reg(p_reg_info);
+		if (nr_messages != p_msg_info->nr_of_messages) {
+			printf("Message different - Disable partial update\n");
+			enp = 0;
+		}
+	}
+
+	for (i = 0; i < nr_messages; i++) {
+		msg_info = tfa_cont_get_msg_for_vstep(vsi, vstep_idx, i);
+
+		/* Messagetype(3) is Smartstudio Info! Dont send this! */
+		if(msg_info->message_type == 3) {
+			//printf("Skipping Message Type 3\n");
+			/* message_length is in bytes */
+			if(enp)
+				p_msg_info = tfa_cont_get_next_msg_info(p_msg_info);
+			continue;
+		}
+
+		/* If no vstepMsgIndex is passed on, all message needs to be send */
+		if ((vstep_msg_idx >= TFA_MAX_VSTEP_MSG_MARKER) || (vstep_msg_idx == i)) {
+			err = tfa_cont_write_vstepMax2_One(dev_idx, msg_info, p_msg_info, enp);
+			if (err != TFA98XX_ERROR_OK) {
+				/*
+				 * Force a full update for the next write
+				 * As the current status of the DSP is unknown
+				 */
+				p_reg_info = NULL;
+				return err;
+			}
+		}
+
+		if(enp)
+			p_msg_info = tfa_cont_get_next_msg_info(p_msg_info);
+	}
+
+	p_reg_info = reg_info;
+
+#if 0 // remark by jimmy
+	for(i=0; i<reg_info->nr_of_registers*2; i++) {
+		/* Byte swap the datasheetname */
+		bit_f.field = (uint16_t)(reg_info->register_info[i]>>8) | (reg_info->register_info[i]<<8);
+		i++;
+		bit_f.value = (uint16_t)reg_info->register_info[i]>>8;
+		err = tfa_run_write_bitfield(dev_idx , bit_f);
+		if (err != TFA98XX_ERROR_OK)
+			return err;
+	}
+#endif
+
+	/* Save the current vstep */
+	tfa_set_swvstep(dev_idx, (unsigned short)vstep_idx);
+
+	return err;
+}
+
+enum tfa98xx_error tfa_cont_write_file(int dev_idx,  struct tfa_file_dsc *file, int vstep_idx, int vstep_msg_idx)
+{
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	struct tfa_header *hdr = (struct tfa_header *)file->data;
+	struct tfa_vstep_index *vsi;
+	enum tfa_header_type type;
+	int size;
+
+	type = (enum tfa_header_type) hdr->id;
+
+	switch (type) {
+	case msg_hdr: /* generic DSP message */
+		//printf("tfa_cont_write_file : type=msg_hdr\n");
+		size = hdr->size - sizeof(struct tfa_msg_file);
+		err = dsp_msg(dev_idx, size, (uint8_t *)((struct tfa_msg_file *)hdr)->data);
+		break;
+	case volstep_hdr:
+		// vstep_idx=0, vstep_msg_idx=100
+		vsi = tfa_cont_find_vstep_index((struct tfa_volume_step_max2_file *)hdr);
+		if (vsi == NULL)
+			break;
+		if (vstep_idx >= vsi->nr_vsteps)
+			printf("Volumestep %d is not available \n", vstep_idx); // a profile file with less vsteps
+		else
+			err = tfa_cont_write_vstepMax2(dev_idx, vsi, vstep_idx, vstep_msg_idx);
+		//printf("tfa_cont_write_file : type=volstep_hdr\n");
+		break;
+	case speaker_hdr:
+		//printf("tfa_cont_write_file : type=speaker_hdr\n");
+		size = hdr->size - sizeof(struct tfa_spk_header) - sizeof(struct tfa_fw_ver);
+		err = dsp_msg(dev_idx, size, (uint8_t *)(((struct tfa_speaker_file *)hdr)->data + (sizeof(struct tfa_fw_ver))));
+		break;
+	case preset_hdr:
+		//printf("tfa_cont_write_file : type=preset_hdr\n");
+		break;
+	case equalizer_hdr:
+		//printf("tfa_cont_write_file : type=equalizer_hdr\n");
+		break;
+	case patch_hdr:
+		//printf("tfa_cont_write_file : type=patch_hdr\n");
+		break;
+	case config_hdr:
+		//printf("tfa_cont_write_file : type=config_hdr\n");
+		break;
+	case drc_hdr:
+		//printf("tfa_cont_write_file : type=drc_hdr\n");
+		break;
+	case info_hdr:
+		//printf("tfa_cont_write_file : type=info_hdr\n");
+		/* Ignore */
+		break;
+	default:
+		printf("Header is of unknown type: 0x%x\n", type);
+		return TFA98XX_ERROR_BAD_PARAMETER;
+	}
+
+	return err;
+}
+
+enum tfa98xx_error tfa_cont_write_files(int dev_idx) {
+	struct tfa_device_list *dev = tfa_cont_device(dev_idx);
+	struct tfa_file_dsc *file;
+	//struct tfa_cmd *cmd;
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	char buffer[(MEMTRACK_MAX_WORDS * 3) + 3] = {0}; //every word requires 3 bytes, and 3 is the msg
+	int i, end, size = 0;
+
+	if ( !dev ) {
+		return TFA98XX_ERROR_BAD_PARAMETER;
+	}
+	/* process the list and write all files  */
+	for (i = tfa_cont_dscs(dev_idx, -1, &end); i < end; i++) {
+		if ( g_idx.type[i] == dsc_file ) {
+			file = (struct tfa_file_dsc *)(g_idx.offset[i]+(uint8_t *)g_cont);
+			if ( tfa_cont_write_file(dev_idx,  file, 0 , TFA_MAX_VSTEP_MSG_MARKER) ){ // 0, 100
+				return TFA98XX_ERROR_BAD_PARAMETER;
+			}
+		}
+
+		if  ( g_idx.type[i] == dsc_set_input_select ||
+		      g_idx.type[i] == dsc_set_output_select ||
+		      g_idx.type[i] == dsc_set_program_config ||
+		      g_idx.type[i] == dsc_set_lag_w ||
+		      g_idx.type[i] == dsc_set_gains ||
+		      g_idx.type[i] == dsc_set_vbat_factors ||
+		      g_idx.type[i] == dsc_set_senses_cal ||
+		      g_idx.type[i] == dsc_set_senses_delay ||
+		      g_idx.type[i] == dsc_set_mb_drc ) {
+			//create_dsp_buffer_msg((struct tfa_msg *) ( g_idx.offset[i]+(char*)g_cont), buffer, &size);
+
+			err = dsp_msg(dev_idx, size, (uint8_t *)buffer);
+		}
+
+		if  ( g_idx.type[i] == dsc_cmd ) {
+			size = *(uint16_t *)(g_idx.offset[i]+(char*)g_cont);
+			err = dsp_msg(dev_idx, size,  (uint8_t *)(g_idx.offset[i]+2+(char*)g_cont));
+		#if 0
+			if ( tfa98xx_cnt_verbose ) {
+				cmd = (struct tfa_cmd *)(g_idx.offset[i]+(uint8_t *)g_cont);
+				printf("Writing cmd=0x%02x%02x%02x \n", cmd->value[0], cmd->value[1], cmd->value[2]);
+			}
+		#endif
+		}
+		if (err != TFA98XX_ERROR_OK)
+			break;
+
+		if  ( g_idx.type[i] == dsc_cf_mem ) {
+			//err = tfa_run_write_dsp_mem(dev_idx, (struct tfa_dsp_mem *)(g_idx.offset[i]+(uint8_t *)g_cont));
+		}
+
+		if (err != TFA98XX_ERROR_OK)
+			break;
+	}
+
+	return err;
+}
+
+struct tfa_profile_list* tfa_cont_profile(int dev_idx, int prof_ipx) {
+	if ( dev_idx >= g_devs) {
+		printf("Devlist index too high");
+		return NULL;
+	}
+	if ( prof_ipx >= tfa_cont_nr_profiles(dev_idx)) {
+		printf("Proflist index too high");
+		return NULL;
+	}
+
+	return g_idx.list[g_idx.dev_list[dev_idx] + 1 + prof_ipx];
+}
+
+enum tfa98xx_error tfa_cont_write_files_prof(int dev_idx, int prof_idx, int vstep_idx) {
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	struct tfa_profile_list *prof = tfa_cont_profile(dev_idx, prof_idx);
+	char buffer[(MEMTRACK_MAX_WORDS * 3) + 3] = {0}; //every word requires 3 bytes, and 3 is the msg
+	int i, end;
+	struct tfa_file_dsc *file;
+	//struct tfa_patch_file *patchfile;
+	int size;
+
+	if ( !prof ) {
+		return TFA98XX_ERROR_BAD_PARAMETER;
+	}
+
+	//printf("tfa_cont_write_files_prof : length=%d, name=%s\n", prof->length, prof->name.offset + (uint8_t*)g_cont);
+
+	/* process the list and write all files  */
+	for (i = tfa_cont_dscs(dev_idx, prof_idx, &end); i < end; i++) {
+		switch (g_idx.type[i]) {
+			case dsc_file:
+				//printf("tfa_cont_write_files_prof : type=dsc_file\n");
+				file = (struct tfa_file_dsc *)(g_idx.offset[i]+(uint8_t *)g_cont);
+				err = tfa_cont_write_file(dev_idx,  file, vstep_idx, TFA_MAX_VSTEP_MSG_MARKER);
+				break;
+			case dsc_patch:
+				//printf("tfa_cont_write_files_prof : type=dsc_patch\n");
+				break;
+			case dsc_cf_mem:
+				//printf("tfa_cont_write_files_prof : type=dsc_cf_mem\n");
+				break;
+			case dsc_set_input_select:
+			case dsc_set_output_select:
+			case dsc_set_program_config:
+			case dsc_set_lag_w:
+			case dsc_set_gains:
+			case dsc_set_vbat_factors:
+			case dsc_set_senses_cal:
+			case dsc_set_senses_delay:
+			case dsc_set_mb_drc:
+				//printf("tfa_cont_write_files_prof : type=%d\n", g_idx.type[i]);
+				create_dsp_buffer_msg((struct tfa_msg *)(g_idx.offset[i]+(uint8_t *)g_cont), buffer, &size);
+				err = dsp_msg(dev_idx, size, (uint8_t *)buffer);
+				break;
+			default:
+				/* ignore any other type */
+				break;
+		}
+		if (err != TFA98XX_ERROR_OK)
+			return err;
+	}
+
+	return err;
+}
+
+/*
+ * payload bytes of a descriptor, clipped to the container
+ */
+static uint32_t tfa_cont_dsc_length(struct tfa_container *cont, int length, uint8_t type, uint32_t offset)
+{
+	uint8_t *p = (uint8_t *)cont + offset;
+	uint32_t size = 0;
+
+	if (offset >= (uint32_t)length)
+		return 0;
+
+	switch (type) {
+	case dsc_file:
+		if (length - offset < sizeof(struct tfa_file_dsc) + sizeof(struct tfa_header))
+			return length - offset;
+		size = ((struct tfa_file_dsc *)p)->size;
+		if (size == 0) // size from the file header
+			size = ((struct tfa_header *)((struct tfa_file_dsc *)p)->data)->size;
+		size += sizeof(struct tfa_file_dsc);
+		break;
+	case dsc_cmd:
+		if (length - offset < 2)
+			return length - offset;
+		size = 2 + (p[0] | (p[1] << 8));
+		break;
+	case dsc_set_input_select:
+	case dsc_set_output_select:
+	case dsc_set_program_config:
+	case dsc_set_lag_w:
+	case dsc_set_gains:
+	case dsc_set_vbat_factors:
+	case dsc_set_senses_cal:
+	case dsc_set_senses_delay:
+	case dsc_set_mb_drc:
+		size = sizeof(struct tfa_msg);
+		break;
+	default:
+		break;
+	}
+
+	return (size > length - offset) ? length - offset : size;
+}
+
+/* 0 if a zero terminated string starts at offset */
+static int tfa_cont_string_check(struct tfa_container *cont, int length, uint32_t offset)
+{
+	if (offset >= (uint32_t)length)
+		return -1;
+
+	return memchr((uint8_t *)cont + offset, 0, length - offset) ? 0 : -1;
+}
+
+/*
+ * 0 if all a descriptor refers to lies within the container,
+ * the writers read it without further checks
+ */
+static int tfa_cont_dsc_check(struct tfa_container *cont, int length, uint8_t type, uint32_t offset)
+{
+	uint8_t *p = (uint8_t *)cont + offset;
+	struct tfa_file_dsc *file;
+	struct tfa_header *hdr;
+	uint32_t max;
+
+	if (offset >= (uint32_t)length)
+		return -1;
+	max = length - offset;
+
+	switch (type) {
+	case dsc_file:
+		if (max < sizeof(struct tfa_file_dsc) + sizeof(struct tfa_header))
+			return -1;
+		file = (struct tfa_file_dsc *)p;
+		hdr = (struct tfa_header *)file->data;
+		max -= sizeof(struct tfa_file_dsc);
+		if (file->size > max || hdr->size > max)
+			return -1;
+		if (hdr->id == msg_hdr && hdr->size < sizeof(struct tfa_msg_file))
+			return -1;
+		if (hdr->id == speaker_hdr && hdr->size < sizeof(struct tfa_spk_header) + sizeof(struct tfa_fw_ver))
+			return -1;
+		return tfa_cont_string_check(cont, length, file->name.offset);
+	case dsc_cmd:
+		return (max < 2 || 2u + (p[0] | (p[1] << 8)) > max) ? -1 : 0;
+	case dsc_set_input_select:
+	case dsc_set_output_select:
+	case dsc_set_program_config:
+	case dsc_set_lag_w:
+	case dsc_set_gains:
+	case dsc_set_vbat_factors:
+	case dsc_set_senses_cal:
+	case dsc_set_senses_delay:
+	case dsc_set_mb_drc:
+		if (max < sizeof(struct tfa_msg))
+			return -1;
+		return (((struct tfa_msg *)p)->msg_size > sizeof(((struct tfa_msg *)p)->data) / sizeof(int)) ? -1 : 0;
+	default: // profile lists are checked when indexed, others are not read
+		return 0;
+	}
+}
+
+static int tfa_cont_index_reserve(struct tfa_cont_index *x, int nr)
+{
+	int max = x->max_dscs ? x->max_dscs : 256;
+	void *p;
+
+	if (nr <= x->max_dscs)
+		return 0;
+	while (max < nr)
+		max *= 2;
+
+	if ((p = realloc(x->type, max * sizeof(*x->type))) == NULL)
+		return -1;
+	x->type = p;
+	if ((p = realloc(x->offset, max * sizeof(*x->offset))) == NULL)
+		return -1;
+	x->offset = p;
+	if ((p = realloc(x->dev, max * sizeof(*x->dev))) == NULL)
+		return -1;
+	x->dev = p;
+	if ((p = realloc(x->prof, max * sizeof(*x->prof))) == NULL)
+		return -1;
+	x->prof = p;
+	if ((p = realloc(x->length, max * sizeof(*x->length))) == NULL)
+		return -1;
+	x->length = p;
+	x->max_dscs = max;
+
+	return 0;
+}
+
+/*
+ * append the items of the device list (prof -1) or profile list at offset,
+ * offset 0 adds an empty list
+ */
+static int tfa_cont_index_list(struct tfa_container *cont, int length, uint32_t offset, int dev, int prof)
+{
+	struct tfa_cont_index *x = &g_idx;
+	struct tfa_desc_ptr *list = NULL;
+	uint32_t hdr_size = (prof < 0) ? sizeof(struct tfa_device_list) : sizeof(struct tfa_profile_list);
+	int i, n, nr = 0, max;
+	void *p;
+
+	if (offset) {
+		if (offset + hdr_size <= (uint32_t)length)
+			nr = (prof < 0) ? ((struct tfa_device_list *)((uint8_t *)cont + offset))->length
+				: ((struct tfa_profile_list *)((uint8_t *)cont + offset))->length;
+		if (offset + hdr_size + nr * sizeof(struct tfa_desc_ptr) > (uint32_t)length
+			|| tfa_cont_string_check(cont, length, (prof < 0)
+				? ((struct tfa_device_list *)((uint8_t *)cont + offset))->name.offset
+				: ((struct tfa_profile_list *)((uint8_t *)cont + offset))->name.offset)) {
+			printf("%s list at 0x%x exceeds the container\n", (prof < 0) ? "device" : "profile", offset);
+			return -1;
+		}
+		list = (struct tfa_desc_ptr *)((uint8_t *)cont + offset + hdr_size);
+		for (i = 0; i < nr; i++) {
+			if (tfa_cont_dsc_check(cont, length, list[i].type, list[i].offset)) {
+				printf("item %d of the %s list at 0x%x exceeds the container\n", i,
+					(prof < 0) ? "device" : "profile", offset);
+				return -1;
+			}
+		}
+	}
+
+	if (tfa_cont_index_reserve(x, x->nr_dscs + nr))
+		return -1;
+	if (x->nr_lists + 1 >= x->max_lists) { // room for the end entry of list_first
+		max = x->max_lists ? x->max_lists * 2 : 64;
+		if ((p = realloc(x->list, max * sizeof(*x->list))) == NULL)
+			return -1;
+		x->list = p;
+		if ((p = realloc(x->list_first, max * sizeof(*x->list_first))) == NULL)
+			return -1;
+		x->list_first = p;
+		x->max_lists = max;
+	}
+
+	x->list[x->nr_lists] = offset ? (uint8_t *)cont + offset : NULL;
+	x->list_first[x->nr_lists++] = x->nr_dscs;
+	for (i = 0; i < nr; i++) {
+		n = x->nr_dscs++;
+		x->type[n] = list[i].type;
+		x->offset[n] = list[i].offset;
+		x->dev[n] = dev;
+		x->prof[n] = prof;
+		x->length[n] = tfa_cont_dsc_length(cont, length, list[i].type, list[i].offset);
+	}
+	x->list_first[x->nr_lists] = x->nr_dscs;
+
+	return 0;
+}
+
+/*
+ * flatten the device and profile lists in one pass, the profiles of a device
+ * are found in its own items, returns 0 if ok
+ */
+static int tfa_cont_build_index(struct tfa_container *cont, int length)
+{
+	struct tfa_cont_index *x = &g_idx;
+	int dev, prof, i, end;
+	void *p;
+
+	g_devs = 0;
+	x->nr_dscs = 0;
+	x->nr_lists = 0;
+	if (cont->ndev + 1 > x->max_devs) {
+		if ((p = realloc(x->dev_list, (cont->ndev + 1) * sizeof(*x->dev_list))) == NULL)
+			return -1;
+		x->dev_list = p;
+		x->max_devs = cont->ndev + 1;
+	}
+	if (tfa_handles_grow(cont->ndev))
+		return -1;
+
+	for (dev = 0; dev < cont->ndev; dev++) {
+		x->dev_list[dev] = x->nr_lists;
+		i = x->nr_dscs;
+		if (tfa_cont_index_list(cont, length,
+			(cont->index[dev].type == dsc_device) ? cont->index[dev].offset : 0, dev, -1))
+			return -1;
+		for (end = x->nr_dscs, prof = 0; i < end; i++) {
+			if (x->type[i] == dsc_profile && tfa_cont_index_list(cont, length, x->offset[i], dev, prof++))
+				return -1;
+		}
+	}
+	x->dev_list[dev] = x->nr_lists;
+	g_devs = cont->ndev;
+
+	return 0;
+}
+
+void tfa_cont_free_index(void)
+{
+	free(g_idx.type);
+	free(g_idx.offset);
+	free(g_idx.dev);
+	free(g_idx.prof);
+	free(g_idx.length);
+	free(g_idx.list_first);
+	free(g_idx.list);
+	free(g_idx.dev_list);
+	memset(&g_idx, 0, sizeof(g_idx));
+	g_devs = -1;
+}
+
+static int tfa_vstep_index_cmp(const void *a, const void *b)
+{
+	const struct tfa_vstep_index *ia = a, *ib = b;
+
+	if ((uint8_t *)ia->vp == (uint8_t *)ib->vp)
+		return 0;
+	return ((uint8_t *)ia->vp < (uint8_t *)ib->vp) ? -1 : 1;
+}
+
+/*
+ * walk all vsteps of a file once and record where every vstep and message starts,
+ * fails if the walk leaves the file
+ */
+static int tfa_cont_index_vstep_file(struct tfa_vstep_index *vsi, struct tfa_file_dsc *file)
+{
+	struct tfa_volume_step_max2_file *vp = (struct tfa_volume_step_max2_file *)file->data;
+	struct tfa_volume_step_register_info *reg_info;
+	struct tfa_volume_step_message_info *msg_info;
+	uint8_t *end = file->data + (file->size ? file->size : vp->hdr.size); // both checked at indexing
+	int i, j, nr_msgs, pass;
+
+	memset(vsi, 0, sizeof(*vsi));
+	if (end < vp->vsteps_bin)
+		return -1;
+	vsi->vp = vp;
+	vsi->nr_vsteps = vp->nr_of_vsteps;
+
+	/* first pass counts the messages, second pass records them */
+	for (pass = 0; pass < 2; pass++) {
+		reg_info = (struct tfa_volume_step_register_info*) vp->vsteps_bin;
+		nr_msgs = 0;
+
+		for (i = 0; i < vsi->nr_vsteps; i++) {
+			if ((uint8_t *)reg_info >= end)
+				return -1;
+			msg_info = tfa_cont_get_msg_info_from_reg(reg_info);
+			if ((uint8_t *)msg_info >= end)
+				return -1;
+			if (pass) {
+				vsi->reg_offset[i] = (uint32_t)((uint8_t *)reg_info - (uint8_t *)vp);
+				vsi->msg_first[i] = nr_msgs;
+			}
+
+			for (j = msg_info->nr_of_messages; j > 0; j--) {
+				if ((uint8_t *)msg_info + 1 + sizeof(msg_info->message_type)
+					+ sizeof(msg_info->message_length) > end) // type and length
+					return -1;
+				if (pass)
+					vsi->msg_offset[nr_msgs] = (uint32_t)((uint8_t *)msg_info - (uint8_t *)vp);
+				nr_msgs++;
+				msg_info = tfa_cont_get_next_msg_info(msg_info);
+				if ((uint8_t *)msg_info >= end)
+					return -1;
+			}
+			reg_info = tfa_cont_get_next_reg_from_end_info(msg_info);
+		}
+
+		if (pass == 0) {
+			vsi->reg_offset = malloc(vsi->nr_vsteps * sizeof(uint32_t) + 1);
+			vsi->msg_first = malloc((vsi->nr_vsteps + 1) * sizeof(int));
+			vsi->msg_offset = malloc(nr_msgs * sizeof(uint32_t) + 1);
+			if (!vsi->reg_offset || !vsi->msg_first || !vsi->msg_offset)
+				return -1;
+		} else {
+			vsi->msg_first[i] = nr_msgs;
+		}
+	}
+
+	return 0;
+}
+
+void tfa_cont_free_vstep_index(void)
+{
+	int i;
+
+	for (i = 0; i < g_vstep_files; i++) {
+		free(g_vstep_index[i].reg_offset);
+		free(g_vstep_index[i].msg_first);
+		free(g_vstep_index[i].msg_offset);
+	}
+	free(g_vstep_index);
+	g_vstep_index = NULL;
+	g_vstep_files = 0;
+}
+
+/*
+ * build the vstep index of every volumestepMax2 file
+ * reachable from the device and profile lists, fails if a file
+ * can not be walked within its size
+ */
+static int tfa_cont_build_vstep_index(void)
+{
+	struct tfa_file_dsc *file;
+	struct tfa_vstep_index *vsi;
+	int i, max_files = 0;
+
+	tfa_cont_free_vstep_index();
+
+	for (i = 0; i < g_idx.nr_dscs; i++)
+		max_files += (g_idx.type[i] == dsc_file);
+	if (max_files == 0)
+		return 0;
+
+	g_vstep_index = malloc(max_files * sizeof(struct tfa_vstep_index));
+	if (g_vstep_index == NULL)
+		return -1;
+
+	for (i = 0; i < g_idx.nr_dscs; i++) {
+		if (g_idx.type[i] != dsc_file)
+			continue;
+		file = (struct tfa_file_dsc *)(g_idx.offset[i] + (uint8_t *)g_cont);
+		if (((struct tfa_header *)file->data)->id != volstep_hdr)
+			continue;
+		if (tfa_cont_find_vstep_index((struct tfa_volume_step_max2_file *)file->data))
+			continue; // shared file, already indexed
+
+		vsi = &g_vstep_index[g_vstep_files];
+		if (tfa_cont_index_vstep_file(vsi, file) != 0) {
+			printf("vstep file at 0x%x can not be indexed\n", g_idx.offset[i]);
+			free(vsi->reg_offset);
+			free(vsi->msg_first);
+			free(vsi->msg_offset);
+			return -1;
+		}
+
+		/* keep the index sorted, files are mostly found in offset order */
+		g_vstep_files++;
+		if (g_vstep_files > 1 && tfa_vstep_index_cmp(vsi - 1, vsi) > 0)
+			qsort(g_vstep_index, g_vstep_files, sizeof(struct tfa_vstep_index), tfa_vstep_index_cmp);
+	}
+
+	return 0;
+}
+
+char *get_profile_name(uint8_t device_idx, uint8_t profile_idx)
+{
+	struct tfa_profile_list *prof = tfa_cont_profile(device_idx, profile_idx);
+	return (char *)(prof->name.offset + (uint8_t*)g_cont);
+}
+
+/*
+ * return the highest nr of volume steps of all vstep files in the profile,
+ * a profile without vstep files still has the single vstep 0
+ */
+int tfa_cont_get_max_vstep(int dev_idx, int prof_idx)
+{
+	struct tfa_profile_list *prof = tfa_cont_profile(dev_idx, prof_idx);
+	struct tfa_file_dsc *file;
+	struct tfa_header *hdr;
+	int i, end, nr_vsteps = 1;
+
+	if ( !prof )
+		return 0;
+
+	for (i = tfa_cont_dscs(dev_idx, prof_idx, &end); i < end; i++) {
+		if (g_idx.type[i] != dsc_file)
+			continue;
+
+		file = (struct tfa_file_dsc *)(g_idx.offset[i]+(uint8_t *)g_cont);
+		hdr = (struct tfa_header *)file->data;
+		if (hdr->id == volstep_hdr) {
+			if (((struct tfa_volume_step_max2_file *)hdr)->nr_of_vsteps > nr_vsteps)
+				nr_vsteps = ((struct tfa_volume_step_max2_file *)hdr)->nr_of_vsteps;
+		}
+	}
+
+	return nr_vsteps;
+}
+
+/*
+ * switch mode : for every ordered pair of profiles of every device and every
+ * vstep write the minimal sequence from one profile to the other.
+ * The vstep is kept over the switch, a from profile with less vsteps leaves
+ * its last one behind, a to profile with less vsteps has no set for it.
+ * Messages that leave the DSP parameter unchanged are dropped and vstep
+ * messages are written as partial update against the previous profile's vstep.
+ */
+enum tfa98xx_error tfa_cont_write_switches(void)
+{
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	struct tfa_msg_record *recs, state;
+	int dev_idx, from, to, i, vstep_idx, nr_vsteps, from_vstep;
+
+	for (dev_idx = 0; dev_idx < g_devs; dev_idx++) {
+		recs = calloc(tfa_cont_nr_profiles(dev_idx) + 1, sizeof(struct tfa_msg_record));
+		if (recs == NULL)
+			return TFA98XX_ERROR_FAIL;
+
+		nr_vsteps = 1;
+		for (from = 0; from < tfa_cont_nr_profiles(dev_idx); from++) {
+			if (tfa_cont_get_max_vstep(dev_idx, from) > nr_vsteps)
+				nr_vsteps = tfa_cont_get_max_vstep(dev_idx, from);
+		}
+
+		for (vstep_idx = 0; vstep_idx < nr_vsteps; vstep_idx++) {
+			/* the state every profile leaves behind */
+			for (from = 0; from < tfa_cont_nr_profiles(dev_idx); from++) {
+				tfa_record_free(&recs[from]);
+				from_vstep = tfa_cont_get_max_vstep(dev_idx, from) - 1;
+				if (from_vstep > vstep_idx)
+					from_vstep = vstep_idx;
+				p_reg_info = NULL;
+				g_record = &recs[from];
+				err = tfa_cont_write_files_prof(dev_idx, from, from_vstep);
+				g_record = NULL;
+				recs[from].reg_info = p_reg_info;
+				if (err != TFA98XX_ERROR_OK)
+					goto tfa_cont_write_switches_exit;
+			}
+
+			for (from = 0; from < tfa_cont_nr_profiles(dev_idx); from++) {
+				for (to = 0; to < tfa_cont_nr_profiles(dev_idx); to++) {
+					if (from == to || vstep_idx >= tfa_cont_get_max_vstep(dev_idx, to))
+						continue;
+
+					printf("[switch] device %d, profile %d.%s -> %d.%s, vstep %d\n", dev_idx,
+						from, get_profile_name(dev_idx, from), to, get_profile_name(dev_idx, to), vstep_idx);
+					err = tfa_out_begin_set(dev_idx, to, vstep_idx, TFA_BLOB_SET_SWITCH, from);
+					tfa_out_text("\n/* %s%d, %s%s -> %s, %s%d */\n", "switch device index : ", dev_idx,
+						"profile name : ", get_profile_name(dev_idx, from), get_profile_name(dev_idx, to),
+						"vstep index : ", vstep_idx);
+
+					/* start from a copy of the from profile state */
+					memset(&state, 0, sizeof(state));
+					for (i = 0; i < recs[from].nr_msgs && err == TFA98XX_ERROR_OK; i++) {
+						if (recs[from].msgs[i].data)
+							err = tfa_record_add(&state, recs[from].msgs[i].size, recs[from].msgs[i].data);
+					}
+
+					g_switch_state = &state;
+					g_emit_bytes = 0;
+					p_reg_info = recs[from].reg_info;
+					handles_local[dev_idx].partial_enable = 1;
+					if (err == TFA98XX_ERROR_OK)
+						err = tfa_cont_write_files_prof(dev_idx, to, vstep_idx);
+					handles_local[dev_idx].partial_enable = 0;
+					p_reg_info = NULL;
+					g_switch_state = NULL;
+					tfa_record_free(&state);
+
+					tfa_out_end_set();
+					printf("[switch] %d -> %d bytes\n", recs[to].total_size, g_emit_bytes);
+					if (err != TFA98XX_ERROR_OK)
+						goto tfa_cont_write_switches_exit;
+				}
+			}
+		}
+
+tfa_cont_write_switches_exit:
+		for (from = 0; from < tfa_cont_nr_profiles(dev_idx); from++)
+			tfa_record_free(&recs[from]);
+		free(recs);
+		if (err != TFA98XX_ERROR_OK)
+			return err;
+	}
+
+	return err;
+}
+
+/*
+ * bytes sent for a full write of all messages of a vstep
+ */
+static int tfa_cont_get_vstep_size(struct tfa_vstep_index *vsi, int vstep_idx)
+{
+	struct tfa_volume_step_message_info *msg_info;
+	int i, nr_messages, size = 0;
+
+	nr_messages = vsi->msg_first[vstep_idx + 1] - vsi->msg_first[vstep_idx];
+	for (i = 0; i < nr_messages; i++) {
+		msg_info = tfa_cont_get_msg_for_vstep(vsi, vstep_idx, i);
+		if (msg_info->message_type != 3)
+			size += 3 + (tfa_cont_get_msg_len(msg_info) - 1) * 3;
+	}
+
+	return size;
+}
+
+/*
+ * vstep delta mode : for every vstep file of every profile write the
+ * partial update messages of each vstep -> vstep+1 and vstep -> vstep-1
+ * transition, or of every vstep pair when all_pairs is set.
+ * a transition is encoded once into a record, the label needs its size
+ * before the messages are emitted
+ */
+enum tfa98xx_error tfa_cont_write_vstep_deltas(int all_pairs)
+{
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	struct tfa_vstep_index *vsi;
+	struct tfa_file_dsc *file;
+	struct tfa_msg_record delta;
+	int dev_idx, prof_idx, i, end, from, to, full_size;
+	int total_full = 0, total_delta = 0;
+
+	for (dev_idx = 0; dev_idx < g_devs; dev_idx++) {
+		for (prof_idx = 0; prof_idx < tfa_cont_nr_profiles(dev_idx); prof_idx++) {
+			for (i = tfa_cont_dscs(dev_idx, prof_idx, &end); i < end; i++) {
+				if (g_idx.type[i] != dsc_file)
+					continue;
+				file = (struct tfa_file_dsc *)(g_idx.offset[i]+(uint8_t *)g_cont);
+				if (((struct tfa_header *)file->data)->id != volstep_hdr)
+					continue;
+				vsi = tfa_cont_find_vstep_index((struct tfa_volume_step_max2_file *)file->data);
+				if (vsi == NULL)
+					continue;
+
+				for (from = 0; from < vsi->nr_vsteps; from++) {
+					for (to = 0; to < vsi->nr_vsteps; to++) {
+						if (to == from || (!all_pairs && to != from + 1 && to != from - 1))
+							continue;
+
+						full_size = tfa_cont_get_vstep_size(vsi, to);
+						err = tfa_out_begin_set(dev_idx, prof_idx, to, TFA_BLOB_SET_VSTEP_DELTA, from);
+
+						memset(&delta, 0, sizeof(delta));
+						delta.replay = 1;
+						g_record = &delta;
+						p_reg_info = tfa_cont_get_reg_for_vstep(vsi, from);
+						handles_local[dev_idx].partial_enable = 1;
+						if (err == TFA98XX_ERROR_OK)
+							err = tfa_cont_write_vstepMax2(dev_idx, vsi, to, TFA_MAX_VSTEP_MSG_MARKER);
+						handles_local[dev_idx].partial_enable = 0;
+						p_reg_info = NULL;
+						g_record = NULL;
+
+						tfa_out_text("\n/* %s%d, %s%s, %s%d -> %d : %s%d, %s%d, %s%d */\n",
+							"vstep delta device index : ", dev_idx,
+							"profile name : ", get_profile_name(dev_idx, prof_idx),
+							"vstep index : ", from, to, "full bytes : ", full_size,
+							"delta bytes : ", delta.total_size,
+							"saved : ", full_size - delta.total_size);
+
+						g_emit_bytes = 0;
+						if (err == TFA98XX_ERROR_OK)
+							err = tfa_record_replay(dev_idx, &delta);
+						tfa_record_free(&delta);
+
+						tfa_out_end_set();
+						printf("[vstep delta] device %d, profile %d, vstep %d -> %d : %d -> %d bytes\n",
+							dev_idx, prof_idx, from, to, full_size, g_emit_bytes);
+						total_full += full_size;
+						total_delta += g_emit_bytes;
+						if (err != TFA98XX_ERROR_OK)
+							return err;
+					}
+				}
+			}
+		}
+	}
+
+	printf("[vstep delta] total : %d -> %d bytes\n", total_full, total_delta);
+
+	return err;
+}
+
+/* memo slot of a descriptor, NULL without memo */
+static struct tfa_cache_dsc *tfa_cache_dsc_slot(uint32_t id)
+{
+	struct tfa_cache *c = g_cache;
+	struct tfa_cache_dsc *old = c->dsc, *slot;
+	int i, n = c->dsc_size;
+
+	if (c->dsc_used * 2 >= c->dsc_size) { // rehash at half load
+		c->dsc = calloc(n ? n * 2 : 1024, sizeof(*c->dsc));
+		if (c->dsc == NULL) {
+			c->dsc = old;
+			return NULL;
+		}
+		c->dsc_size = n ? n * 2 : 1024;
+		c->dsc_used = 0;
+		for (i = 0; i < n; i++) {
+			if (old[i].offset) {
+				*tfa_cache_dsc_slot(old[i].offset) = old[i];
+				c->dsc_used++;
+			}
+		}
+		free(old);
+	}
+
+	for (i = (id * 2654435761u) & (c->dsc_size - 1); ; i = (i + 1) & (c->dsc_size - 1)) {
+		slot = &c->dsc[i];
+		if (slot->offset == id || slot->offset == 0)
+			return slot;
+	}
+}
+
+/* content hash of descriptor index entry i, shared files are hashed once per run */
+static uint64_t tfa_cache_dsc_hash(int i)
+{
+	struct tfa_cache_dsc *slot;
+	uint8_t type = g_idx.type[i];
+	uint32_t id = g_idx.offset[i] | ((uint32_t)type << 24);
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	slot = tfa_cache_dsc_slot(id);
+	if (slot && slot->offset == id)
+		return slot->hash;
+
+	h = tfa_cache_hash(h, &type, 1);
+	h = tfa_cache_hash(h, (uint8_t *)g_cont + g_idx.offset[i], g_idx.length[i]);
+	if (slot) {
+		slot->offset = id;
+		slot->hash = h;
+		g_cache->dsc_used++;
+	}
+
+	return h;
+}
+
+/* key of a set, over the descriptors its device and profile list reach */
+static uint64_t tfa_cache_set_key(int dev_idx, int prof_idx, int vstep_idx)
+{
+	uint32_t v[3] = { TFA_CACHE_VERSION, (uint32_t)vstep_idx, (uint32_t)is_cold };
+	uint64_t h = tfa_cache_hash(0xcbf29ce484222325ULL, v, sizeof(v)), d;
+	int i, end;
+
+	if (msg_batch_max) // other transactions, the same messages
+		h = tfa_cache_hash(h, &msg_batch_max, sizeof(msg_batch_max));
+	if (out_packed) // same messages, other text
+		h = tfa_cache_hash(h, "p", 1);
+
+	for (i = tfa_cont_dscs(dev_idx, -1, &end); i < end; i++) {
+		d = tfa_cache_dsc_hash(i);
+		h = tfa_cache_hash(h, &d, sizeof(d));
+	}
+	h = tfa_cache_hash(h, "P", 1);
+	for (i = tfa_cont_dscs(dev_idx, prof_idx, &end); i < end; i++) {
+		d = tfa_cache_dsc_hash(i);
+		h = tfa_cache_hash(h, &d, sizeof(d));
+	}
+
+	return h;
+}
+
+static int tfa_cache_entry_cmp(const void *a, const void *b)
+{
+	uint64_t ka = ((const struct tfa_cache_entry *)a)->key;
+	uint64_t kb = ((const struct tfa_cache_entry *)b)->key;
+
+	return (ka > kb) - (ka < kb);
+}
+
+/* cached set with this key, preferably one with the same CMD numbering */
+static struct tfa_cache_entry *tfa_cache_find(uint64_t key, uint32_t first_cmd)
+{
+	struct tfa_cache_entry k, *e, *first, *end = g_cache->old + g_cache->nr_old;
+
+	k.key = key;
+	first = bsearch(&k, g_cache->old, g_cache->nr_old, sizeof(k), tfa_cache_entry_cmp);
+	if (first == NULL)
+		return NULL;
+	while (first > g_cache->old && first[-1].key == key)
+		first--;
+	for (e = first; e < end && e->key == key; e++) {
+		if (e->first_cmd == first_cmd)
+			return e;
+	}
+
+	return first;
+}
+
+static int tfa_cache_add(uint64_t key, uint32_t first_cmd, uint32_t nr_msgs,
+			 const uint8_t *msgs, uint32_t msg_size, const uint8_t *text, uint32_t text_size)
+{
+	struct tfa_cache_entry *e;
+
+	if (tfa_blob_grow((void **)&g_cache->cur, &g_cache->max_cur, g_cache->nr_cur, sizeof(*e)))
+		return -1;
+	e = &g_cache->cur[g_cache->nr_cur];
+	e->data = malloc(msg_size + text_size + 1);
+	if (e->data == NULL)
+		return -1;
+	e->key = key;
+	e->first_cmd = first_cmd;
+	e->nr_msgs = nr_msgs;
+	e->msg_size = msg_size;
+	e->text_size = text_size;
+	memcpy(e->data, msgs, msg_size);
+	if (text_size)
+		memcpy(e->data + msg_size, text, text_size);
+	g_cache->nr_cur++;
+
+	return 0;
+}
+
+/*
+ * write the device and profile files of one set, unchanged sets come from the cache
+ */
+enum tfa98xx_error tfa_cont_write_set(int dev_idx, int prof_idx, int vstep_idx)
+{
+	struct tfa_device_list *dev = tfa_cont_device(dev_idx);
+	struct tfa_profile_list *prof = tfa_cont_profile(dev_idx, prof_idx);
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	struct tfa_cache_entry *e;
+	uint32_t first_cmd = cmd_count, pos, len;
+	uint64_t key;
+	int text = (out_format == OUT_HEADER && !dedup_mode && pFileHeader != NULL);
+
+	if (g_cache == NULL || dev == NULL || prof == NULL) {
+		err = tfa_cont_write_files(dev_idx);
+		if (err == TFA98XX_ERROR_OK)
+			err = tfa_cont_write_files_prof(dev_idx, prof_idx, vstep_idx);
+		return err;
+	}
+
+	key = tfa_cache_set_key(dev_idx, prof_idx, vstep_idx);
+	e = tfa_cache_find(key, first_cmd);
+	g_cache->cap.msg_size = 0;
+	g_cache->cap.nr_msgs = 0;
+	g_cache->text_size = 0;
+
+	if (e && text && e->text_size && e->first_cmd == first_cmd && g_stats == NULL) {
+		/* same messages and numbering, the text is still valid */
+		fwrite(e->data + e->msg_size, 1, e->text_size, pFileHeader);
+		cmd_count += e->nr_msgs;
+		g_cache->hits++;
+		g_cache->text_reused++;
+		tfa_cache_add(key, first_cmd, e->nr_msgs, e->data, e->msg_size, e->data + e->msg_size, e->text_size);
+		return TFA98XX_ERROR_OK;
+	}
+
+	if (e) {
+		/* replay, the text is captured again. the message sizes are checked at load */
+		g_cache->capture = 2;
+		for (pos = 0; pos < e->msg_size && err == TFA98XX_ERROR_OK; pos += len) {
+			memcpy(&len, e->data + pos, sizeof(len));
+			pos += sizeof(len);
+			err = dsp_msg(dev_idx, len, e->data + pos);
+		}
+		g_cache->hits++;
+	} else {
+		g_cache->capture = 1;
+		err = tfa_cont_write_files(dev_idx);
+		if (err == TFA98XX_ERROR_OK)
+			err = tfa_cont_write_files_prof(dev_idx, prof_idx, vstep_idx);
+		g_cache->misses++;
+	}
+	if (err == TFA98XX_ERROR_OK) // the text of the set is complete
+		err = tfa_batch_flush();
+
+	if (err == TFA98XX_ERROR_OK && g_cache->capture) {
+		if (e)
+			tfa_cache_add(key, first_cmd, e->nr_msgs, e->data, e->msg_size,
+				g_cache->text, text ? g_cache->text_size : 0);
+		else // emitted commands, fewer than captured messages when batched
+			tfa_cache_add(key, first_cmd, text ? cmd_count - first_cmd : g_cache->cap.nr_msgs,
+				g_cache->cap.data, g_cache->cap.msg_size, g_cache->text, text ? g_cache->text_size : 0);
+	}
+	g_cache->capture = 0;
+
+	return err;
+}
+
+static void tfa_cache_free_entries(struct tfa_cache_entry *e, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		free(e[i].data);
+	free(e);
+}
+
+void tfa_cache_free(void)
+{
+	if (g_cache == NULL)
+		return;
+
+	tfa_cache_free_entries(g_cache->old, g_cache->nr_old);
+	tfa_cache_free_entries(g_cache->cur, g_cache->nr_cur);
+	free(g_cache->dsc);
+	free(g_cache->cap.data);
+	free(g_cache->text);
+	free(g_cache);
+	g_cache = NULL;
+}
+
+/* watch mode : the sets of this run are the cache of the next one */
+static void tfa_cache_rotate(void)
+{
+	tfa_cache_free_entries(g_cache->old, g_cache->nr_old);
+	g_cache->old = g_cache->cur;
+	g_cache->nr_old = g_cache->nr_cur;
+	g_cache->cur = NULL;
+	g_cache->nr_cur = g_cache->max_cur = 0;
+	qsort(g_cache->old, g_cache->nr_old, sizeof(*g_cache->old), tfa_cache_entry_cmp);
+
+	/* descriptor offsets are only valid for the container just converted */
+	if (g_cache->dsc)
+		memset(g_cache->dsc, 0, g_cache->dsc_size * sizeof(*g_cache->dsc));
+	g_cache->dsc_used = 0;
+	g_cache->hits = g_cache->misses = g_cache->text_reused = 0;
+}
+
+/* crc of an entry as stored, its fields and data */
+static uint32_t tfa_cache_entry_crc(const struct tfa_cache_entry *e)
+{
+	uint32_t v[7] = { (uint32_t)e->key, (uint32_t)(e->key >> 32), e->first_cmd, e->nr_msgs,
+		e->msg_size, e->text_size, tfa_crc32(e->data, e->msg_size + e->text_size) };
+
+	return tfa_crc32((const uint8_t *)v, sizeof(v));
+}
+
+/* the size prefixed messages fill msg_size exactly and each one fits g_out32buf */
+static int tfa_cache_msgs_valid(const struct tfa_cache_entry *e)
+{
+	uint32_t pos, len;
+
+	for (pos = 0; pos < e->msg_size; pos += sizeof(len) + len) {
+		if (e->msg_size - pos < sizeof(len))
+			return 0;
+		memcpy(&len, e->data + pos, sizeof(len));
+		if (len < 3 || len % 3 || len / 3 > sizeof(g_out32buf) / sizeof(g_out32buf[0])
+			|| len > e->msg_size - pos - sizeof(len))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * read the cache of the previous run, a missing or broken cache starts empty
+ */
+static void tfa_cache_load(char *cache_name)
+{
+	struct tfa_cache_entry *e;
+	char magic[4];
+	uint32_t version, nr, i, max = 0, crc;
+	FILE *f;
+
+	f = fopen(cache_name, "rb");
+	if (f == NULL)
+		return;
+
+	if (fread(magic, 1, 4, f) != 4 || memcmp(magic, TFA_CACHE_MAGIC, 4)
+		|| fread(&version, sizeof(version), 1, f) != 1 || version != TFA_CACHE_VERSION
+		|| fread(&nr, sizeof(nr), 1, f) != 1)
+		goto bad_cache;
+
+	for (i = 0; i < nr; i++) {
+		if (tfa_blob_grow((void **)&g_cache->old, (int *)&max, g_cache->nr_old, sizeof(*e)))
+			goto bad_cache;
+		e = &g_cache->old[g_cache->nr_old];
+		if (fread(&e->key, sizeof(e->key), 1, f) != 1 || fread(&e->first_cmd, sizeof(uint32_t), 1, f) != 1
+			|| fread(&e->nr_msgs, sizeof(uint32_t), 1, f) != 1 || fread(&e->msg_size, sizeof(uint32_t), 1, f) != 1
+			|| fread(&e->text_size, sizeof(uint32_t), 1, f) != 1 || fread(&crc, sizeof(crc), 1, f) != 1
+			|| e->msg_size > (uint32_t)cnt_max_length || e->text_size > (uint32_t)cnt_max_length * 4)
+			goto bad_cache;
+		e->data = malloc(e->msg_size + e->text_size + 1);
+		if (e->data == NULL)
+			goto bad_cache;
+		g_cache->nr_old++;
+		if (fread(e->data, 1, e->msg_size + e->text_size, f) != e->msg_size + e->text_size
+			|| tfa_cache_entry_crc(e) != crc || !tfa_cache_msgs_valid(e))
+			goto bad_cache;
+	}
+	fclose(f);
+
+	qsort(g_cache->old, g_cache->nr_old, sizeof(*e), tfa_cache_entry_cmp);
+	return;
+
+bad_cache:
+	printf("cache %s ignored\n", cache_name);
+	fclose(f);
+	tfa_cache_free_entries(g_cache->old, g_cache->nr_old);
+	g_cache->old = NULL;
+	g_cache->nr_old = 0;
+}
+
+/*
+ * the sets of this run replace the cache contents, written next to it and
+ * renamed so an interrupted run leaves the previous cache
+ */
+static int tfa_cache_save(char *cache_name)
+{
+	struct tfa_cache_entry *e;
+	uint32_t version = TFA_CACHE_VERSION, nr = g_cache->nr_cur, crc;
+	char tmp_name[1024 + 4];
+	FILE *f;
+	int i, err = 0;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", cache_name);
+	f = fopen(tmp_name, "wb");
+	if (f == NULL) {
+		printf("File open fail : %s\n", tmp_name);
+		return -1;
+	}
+
+	fwrite(TFA_CACHE_MAGIC, 1, 4, f);
+	fwrite(&version, sizeof(version), 1, f);
+	fwrite(&nr, sizeof(nr), 1, f);
+	for (i = 0; i < g_cache->nr_cur; i++) {
+		e = &g_cache->cur[i];
+		fwrite(&e->key, sizeof(e->key), 1, f);
+		fwrite(&e->first_cmd, sizeof(uint32_t), 1, f);
+		fwrite(&e->nr_msgs, sizeof(uint32_t), 1, f);
+		fwrite(&e->msg_size, sizeof(uint32_t), 1, f);
+		fwrite(&e->text_size, sizeof(uint32_t), 1, f);
+		crc = tfa_cache_entry_crc(e);
+		fwrite(&crc, sizeof(crc), 1, f);
+		fwrite(e->data, 1, e->msg_size + e->text_size, f);
+	}
+	if (ferror(f))
+		err = -1;
+	if (fclose(f) != 0)
+		err = -1;
+	if (err) {
+		printf("File write fail : %s\n", tmp_name);
+		remove(tmp_name);
+		return err;
+	}
+
+#if defined(_WIN32)
+	remove(cache_name); // rename does not replace
+#endif
+	if (rename(tmp_name, cache_name) != 0) {
+		printf("File rename fail : %s\n", cache_name);
+		remove(tmp_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * batch mode : write one labelled command set for every
+ * device x profile x vstep combination of the loaded container
+ */
+enum tfa98xx_error tfa_cont_write_batch(void)
+{
+	enum tfa98xx_error err = TFA98XX_ERROR_OK;
+	int dev_idx, prof_idx, vstep_idx, nr_vsteps;
+
+	for (dev_idx = 0; dev_idx < g_devs; dev_idx++) {
+		for (prof_idx = 0; prof_idx < tfa_cont_nr_profiles(dev_idx); prof_idx++) {
+			nr_vsteps = tfa_cont_get_max_vstep(dev_idx, prof_idx);
+
+			for (vstep_idx = 0; vstep_idx < nr_vsteps; vstep_idx++) {
+				printf("[batch] device %d, profile %d.%s, vstep %d\n",
+					dev_idx, prof_idx, get_profile_name(dev_idx, prof_idx), vstep_idx);
+				err = tfa_out_begin_set(dev_idx, prof_idx, vstep_idx, TFA_BLOB_SET_FULL, 0);
+				if (err != TFA98XX_ERROR_OK)
+					return err;
+				tfa_out_text("\n/* %s%d, %s%s, %s%d */\n", "device index : ", dev_idx,
+					"profile name : ", get_profile_name(dev_idx, prof_idx), "vstep index : ", vstep_idx);
+
+				err = tfa_cont_write_set(dev_idx, prof_idx, vstep_idx);
+				if (err != TFA98XX_ERROR_OK)
+					return err;
+
+				tfa_out_end_set();
+			}
+		}
+	}
+
+	return err;
+}
+
+/*
+ * crc32 (ieee 802.3, as zlib) of the container data following the crc field.
+ * slicing-by-8 is the portable version, PCLMULQDQ folding is used when available
+ */
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+static int crc32_use_pclmul;	// set once by tfa_cpu_select()
+
+static void crc32_init_table(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320 : (c >> 1);
+		crc32_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			crc32_table[k][i] = (crc32_table[k-1][i] >> 8) ^ crc32_table[0][crc32_table[k-1][i] & 0xff];
+}
+
+/* crc is the running (inverted) value, loads are little endian */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint32_t one, two;
+
+	while (len && ((uintptr_t)buf & 7)) {
+		crc = crc32_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		memcpy(&one, buf, 4);
+		memcpy(&two, buf + 4, 4);
+		one ^= crc;
+		crc = crc32_table[7][one & 0xff] ^ crc32_table[6][(one >> 8) & 0xff] ^
+		      crc32_table[5][(one >> 16) & 0xff] ^ crc32_table[4][one >> 24] ^
+		      crc32_table[3][two & 0xff] ^ crc32_table[2][(two >> 8) & 0xff] ^
+		      crc32_table[1][(two >> 16) & 0xff] ^ crc32_table[0][two >> 24];
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc32_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(TFA_SIMD_X86)
+/*
+ * fold 64 bytes per iteration with carry-less multiplies and Barrett reduce
+ * the last 128 bits, len must be a multiple of 16 and at least 64.
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction",
+ * Gopal et al., Intel 2009 ; constants of the bit reflected crc32 polynomial
+ */
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 64;
+	len -= 64;
+
+	/* 4 parallel folds */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* fold into 128 bits */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+	/* single folds of 16 bytes */
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)buf)), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = x1;
+
+	return (uint32_t)_mm_extract_epi32(x0, 1);
+}
+#endif /* TFA_SIMD_X86 */
+
+uint32_t tfa_crc32(const uint8_t *buf, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+#if defined(TFA_SIMD_X86)
+	if (crc32_use_pclmul && len >= 64) {
+		size_t chunk = len & ~(size_t)15;
+
+		crc = crc32_pclmul(crc, buf, chunk);
+		buf += chunk;
+		len -= chunk;
+	}
+#endif
+	pthread_once(&crc32_table_once, crc32_init_table);
+
+	return ~crc32_slice8(crc, buf, len);
+}
+
+/*
+ * pick the simd kernels for this cpu, main() does this before any worker starts
+ * so the kernel pointers are plain reads. the scalar versions are used until then
+ */
+static pthread_once_t tfa_cpu_once = PTHREAD_ONCE_INIT;
+
+static void tfa_cpu_select_once(void)
+{
+#if defined(TFA_SIMD_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		tfa_msg24to32_impl = tfa_msg24to32_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		tfa_msg24to32_impl = tfa_msg24to32_ssse3;
+	if (__builtin_cpu_supports("avx2"))
+		tfa_word_diff_impl = tfa_word_diff_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		tfa_word_diff_impl = tfa_word_diff_sse2;
+	crc32_use_pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+void tfa_cpu_select(void)
+{
+	pthread_once(&tfa_cpu_once, tfa_cpu_select_once);
+}
+
+/*
+ * check the crc over the container bytes following the crc field
+ */
+static enum tfa_error tfa_cont_crc_check(struct tfa_container *cont, int length)
+{
+	uint8_t *base = (uint8_t *)&cont->crc + sizeof(cont->crc);
+	int offset = (int)(base - (uint8_t *)cont);
+	uint32_t crc;
+
+	if ((int)cont->size > length || (int)cont->size < offset) {
+		printf("container size %u does not match the file length %d\n", cont->size, length);
+		return tfa_error_container;
+	}
+
+	crc = tfa_crc32(base, cont->size - offset);
+	if (crc != cont->crc) {
+		printf("container crc error : 0x%08x, expected 0x%08x\n", crc, cont->crc);
+		return tfa_error_container;
+	}
+
+	return tfa_error_ok;
+}
+
+TFA_TLS uint16_t nr_device = 0;
+TFA_TLS uint16_t nr_profile = 0;
+
+enum tfa_error tfa_load_cnt(void *cnt, int length) {
+	struct tfa_container  *cntbuf = (struct tfa_container  *)cnt;
+	double t;
+
+	g_cont = NULL;
+
+	if ((length > cnt_max_length) || (length < (int)sizeof(struct tfa_container))) {
+		printf("incorrect length\n");
+		return tfa_error_container;
+	}
+
+	if (sizeof(struct tfa_container) + (cntbuf->ndev + cntbuf->nprof + cntbuf->nlivedata)
+		* sizeof(struct tfa_desc_ptr) > (size_t)length) {
+		printf("index table exceeds container length\n");
+		return tfa_error_container;
+	}
+
+	nr_device = cntbuf->ndev;
+	nr_profile = cntbuf->nprof;
+
+	printf("id=%.2s, version=%.2s%.2s, ", cntbuf->id, cntbuf->version, cntbuf->subversion);
+	printf("customer=%.8s, application=%.8s, type=%.8s\n", cntbuf->customer, cntbuf->application, cntbuf->type);
+	printf("device# : %d, profile# : %d\n", nr_device, nr_profile);
+
+
+	if (HDR(cntbuf->id[0],cntbuf->id[1]) == 0) {
+		printf("header is 0\n");
+		return tfa_error_container;
+	}
+
+	if ( (HDR(cntbuf->id[0],cntbuf->id[1])) != params_hdr ) {
+		printf("wrong header type: 0x%02x 0x%02x\n", cntbuf->id[0],cntbuf->id[1]);
+		return tfa_error_container;
+	}
+
+	if (cntbuf->size == 0) {
+		printf("data size is 0\n");
+		return tfa_error_container;
+	}
+
+	if (cnt_verify_crc && tfa_cont_crc_check(cntbuf, length) != tfa_error_ok)
+		return tfa_error_container;
+
+	/* check sub version level */
+	if ( (cntbuf->subversion[1] == NXPTFA_PM_SUBVERSION) &&
+		 (cntbuf->subversion[0] == '0') ) {
+		g_cont = cntbuf;
+		t = tfa_stats_start();
+		if (tfa_cont_build_index(g_cont, length)) {
+			printf("container descriptor index failed\n");
+			tfa_cont_free_index();
+			g_cont = NULL;
+			return tfa_error_container;
+		}
+		if (tfa_cont_build_vstep_index()) {
+			tfa_cont_free_vstep_index();
+			tfa_cont_free_index();
+			g_cont = NULL;
+			return tfa_error_container;
+		}
+		tfa_stats_stop(STAGE_INDEX, t);
+	} else {
+		printf("container sub-version not supported: %c%c\n",
+				cntbuf->subversion[0], cntbuf->subversion[1]);
+		return tfa_error_container;
+	}
+
+	return tfa_error_ok;
+}
+
+void tfa_cnt_unmap(uint8_t *cnt_buffer, int file_size)
+{
+#if !defined(_WIN32)
+	munmap(cnt_buffer, file_size);
+#else
+	free(cnt_buffer);
+#endif
+}
+
+#define TFA_STREAM_CHUNK (64*1024)
+
+/*
+ * read a container from a stream that can not seek (pipe, socket, tar extract).
+ * header and index table come first and give the container size, so a wrong or
+ * too big container is rejected before any descriptor data is read.
+ * the data is then read in offset order into one buffer of exactly that size
+ */
+static uint8_t *tfa_cnt_read_stream(FILE *f, char *cnt_name, int *cnt_size)
+{
+	struct tfa_container hdr;
+	uint8_t *cnt_buffer;
+	size_t index_size, done, n;
+
+	if (fread(&hdr, 1, sizeof(hdr), f) != sizeof(hdr)) {
+		printf("Stream read fail : %s (no container header)\n", cnt_name);
+		return NULL;
+	}
+
+	if (HDR(hdr.id[0], hdr.id[1]) != params_hdr || hdr.size < sizeof(hdr) || hdr.size > (uint32_t)cnt_max_length) {
+		printf("Stream not supported : %s (id=%.2s, %u bytes, max %d)\n", cnt_name, hdr.id, hdr.size, cnt_max_length);
+		return NULL;
+	}
+
+	index_size = (hdr.ndev + hdr.nprof + hdr.nlivedata) * sizeof(struct tfa_desc_ptr);
+	if (sizeof(hdr) + index_size > hdr.size) {
+		printf("index table exceeds container length\n");
+		return NULL;
+	}
+
+#if !defined(_WIN32)
+	cnt_buffer = mmap(NULL, hdr.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (cnt_buffer == MAP_FAILED)
+		cnt_buffer = NULL;
+#else
+	cnt_buffer = malloc(hdr.size);
+#endif
+	if (cnt_buffer == NULL) {
+		printf("Stream buffer fail : %s (%u bytes)\n", cnt_name, hdr.size);
+		return NULL;
+	}
+	memcpy(cnt_buffer, &hdr, sizeof(hdr));
+
+	for (done = sizeof(hdr); done < hdr.size; done += n) {
+		n = hdr.size - done;
+		if (n > TFA_STREAM_CHUNK)
+			n = TFA_STREAM_CHUNK;
+		n = fread(cnt_buffer + done, 1, n, f);
+		if (n == 0) {
+			printf("Stream read fail : %s (%u of %u bytes)\n", cnt_name, (unsigned int)done, hdr.size);
+			tfa_cnt_unmap(cnt_buffer, hdr.size);
+			return NULL;
+		}
+	}
+	*cnt_size = (int)hdr.size;
+
+	return cnt_buffer;
+}
+
+/*
+ * map a container file read-only, all descriptors are used in place.
+ * without mmap support the file is read into a buffer of its own size.
+ * "-" and files that are not regular files (fifos) are read as a stream
+ */
+uint8_t *tfa_cnt_map(char *cnt_name, int *file_size)
+{
+	uint8_t *cnt_buffer;
+#if !defined(_WIN32)
+	struct stat st;
+	FILE *f;
+	int fd;
+
+	if (strcmp(cnt_name, "-") == 0)
+		return tfa_cnt_read_stream(stdin, cnt_name, file_size);
+
+	fd = open(cnt_name, O_RDONLY);
+	if (fd < 0) {
+		printf("File open fail : %s\n", cnt_name);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == 0 && !S_ISREG(st.st_mode)) {
+		f = fdopen(fd, "rb");
+		if (f == NULL) {
+			close(fd);
+			return NULL;
+		}
+		cnt_buffer = tfa_cnt_read_stream(f, cnt_name, file_size);
+		fclose(f);
+		return cnt_buffer;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > cnt_max_length) {
+		printf("File size not supported : %s (%ld bytes, max %d)\n", cnt_name, (long)st.st_size, cnt_max_length);
+		close(fd);
+		return NULL;
+	}
+
+	cnt_buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping stays valid
+	if (cnt_buffer == MAP_FAILED) {
+		printf("File map fail : %s\n", cnt_name);
+		return NULL;
+	}
+	*file_size = (int)st.st_size;
+#else
+	FILE * pFileCnt = NULL;
+
+	if (strcmp(cnt_name, "-") == 0) {
+		_setmode(_fileno(stdin), _O_BINARY);
+		return tfa_cnt_read_stream(stdin, cnt_name, file_size);
+	}
+
+	pFileCnt = fopen(cnt_name, "rb");
+
+	if (pFileCnt == NULL)
+	{
+		printf("File open fail : %s\n", cnt_name);
+		return NULL;
+	}
+	fseek(pFileCnt, 0, SEEK_END);
+	*file_size = ftell(pFileCnt);
+	fseek(pFileCnt, 0, SEEK_SET); // roll-back
+
+	if (*file_size <= 0 || *file_size > cnt_max_length) {
+		printf("File size not supported : %s (%d bytes, max %d)\n", cnt_name, *file_size, cnt_max_length);
+		fclose(pFileCnt);
+		return NULL;
+	}
+
+	cnt_buffer = malloc(*file_size);
+	if (cnt_buffer == NULL || (int)fread(cnt_buffer, sizeof(uint8_t), *file_size, pFileCnt) != *file_size)
+	{
+		printf("File read fail\n");
+		fclose(pFileCnt);
+		free(cnt_buffer);
+		return NULL;
+	}
+	fclose(pFileCnt);
+#endif
+
+	return cnt_buffer;
+}
+
+
+/* name of a file next to name, its extension replaced by ext */
+static void tfa_side_name(char *name, char *ext, char *side_name, int size)
+{
+	char *p;
+
+	snprintf(side_name, size, "%s", name);
+	p = strrchr(side_name, '.');
+	if (p && strchr(p, '/') == NULL && strchr(p, '\\') == NULL)
+		*p = '\0';
+	strncat(side_name, ext, size - strlen(side_name) - 1);
+}
+
+static void tfa_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * write the statistics of one conversion as json, bus times use the bus cost model
+ */
+static int tfa_stats_write(char *stats_name, char *cnt_name, char *out_name)
+{
+	struct tfa_stats_set *set, total;
+	FILE *f;
+	int i, j;
+
+	f = fopen(stats_name, "wt");
+	if (f == NULL) {
+		printf("File open fail : %s\n", stats_name);
+		return -1;
+	}
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < g_stats->nr_sets; i++) {
+		set = &g_stats->sets[i];
+		total.msgs += set->msgs;
+		total.bytes += set->bytes;
+		total.partial_msgs += set->partial_msgs;
+		total.partial_full_bytes += set->partial_full_bytes;
+		total.partial_bytes += set->partial_bytes;
+	}
+
+	fprintf(f, "{\n  \"container\": ");
+	tfa_json_string(f, cnt_name);
+	fprintf(f, ",\n  \"output\": ");
+	tfa_json_string(f, out_name);
+	fprintf(f, ",\n  \"bus\": {\"msg_overhead\": %d, \"bytes_per_sec\": %d, \"max_transfer\": %d},\n",
+		bus_cost.msg_overhead, bus_cost.bytes_per_sec, bus_cost.max_transfer);
+	fprintf(f, "  \"stages_sec\": {");
+	for (i = 0; i < STAGE_MAX; i++)
+		fprintf(f, "%s\"%s\": %.6f", i ? ", " : "", tfa_stats_stage_name[i], g_stats->stage_sec[i]);
+	fprintf(f, "},\n");
+	fprintf(f, "  \"total\": {\"msgs\": %d, \"bytes\": %d, \"bus_time_us\": %d, "
+		"\"partial_msgs\": %d, \"partial_full_bytes\": %d, \"partial_bytes\": %d, \"partial_saved\": %d},\n",
+		total.msgs, total.bytes, tfa_bus_time_us(total.bytes + total.msgs * bus_cost.msg_overhead),
+		total.partial_msgs, total.partial_full_bytes, total.partial_bytes,
+		total.partial_full_bytes - total.partial_bytes);
+
+	fprintf(f, "  \"sets\": [");
+	for (i = 0; i < g_stats->nr_sets; i++) {
+		set = &g_stats->sets[i];
+		fprintf(f, "%s\n    {\"dev\": %d, \"prof\": %d, \"vstep\": %d, \"kind\": \"%s\", \"from\": %d, "
+			"\"msgs\": %d, \"bytes\": %d, \"bus_time_us\": %d,\n", i ? "," : "", set->dev, set->prof, set->vstep,
+			tfa_stats_kind_name[set->kind], set->from, set->msgs, set->bytes,
+			tfa_bus_time_us(set->bytes + set->msgs * bus_cost.msg_overhead));
+		fprintf(f, "     \"partial\": {\"msgs\": %d, \"full_bytes\": %d, \"bytes\": %d, \"saved\": %d},\n",
+			set->partial_msgs, set->partial_full_bytes, set->partial_bytes,
+			set->partial_full_bytes - set->partial_bytes);
+		fprintf(f, "     \"params\": [");
+		for (j = 0; j < set->nr_params; j++) {
+			const char *name = tfa_dsp_cmd_name(set->params[j].id >> 8, set->params[j].id & 0xff);
+
+			fprintf(f, "%s\n       {\"module\": %d, \"param\": %d, \"name\": \"%s\", \"msgs\": %d, \"bytes\": %d}",
+				j ? "," : "", set->params[j].id >> 8, set->params[j].id & 0xff,
+				name ? name : "unknown_command", set->params[j].msgs, set->params[j].bytes);
+		}
+		fprintf(f, "]}");
+	}
+	fprintf(f, "\n  ]\n}\n");
+
+	if (fclose(f) != 0) {
+		printf("File write fail : %s\n", stats_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * output sinks : with --sinks the converter queues its messages and header text in
+ * a bounded ring drained by one thread per sink, so formatting and file writes overlap
+ * with the expansion and one run gives several outputs. every sink sees every event,
+ * a slot is reused once all sinks are past it. each sink thread has its own (thread
+ * local) output state, dedup tables and CMD numbering
+ */
+static const char *const tfa_sink_name[SINK_MAX] = { "header", "blob", "null", "stats" };
+
+struct tfa_sink_ev {
+	int type;		// enum tfa_sink_ev_type
+	int arg[5];
+	int size;		// bytes in data
+	int max;
+	uint8_t *data;		// message or text, kept for the next use of the slot
+	char label[64];
+};
+
+struct tfa_sink {
+	int type;		// enum tfa_sink_type
+	struct tfa_sinks *q;
+	pthread_t thread;
+	uint64_t tail;		// events done, under the lock
+	FILE *file;		// header output
+	char out_name[1024];
+	int err;
+	int nr_msgs;		// null sink totals
+	uint64_t bytes;
+};
+
+struct tfa_sinks {
+	pthread_mutex_t lock;
+	pthread_cond_t more;	// events queued
+	pthread_cond_t room;	// slots released
+	struct tfa_sink_ev *ev;
+	int len;
+	uint64_t head;		// events queued, under the lock
+	struct tfa_sink sinks[SINK_MAX];
+	int nr_sinks;		// running
+	int nr_waits;		// queue full
+	char *cnt_name, *out_name;
+	double stage_sec[STAGE_MAX]; // of the converter, for the stats sink
+};
+
+/* next free slot, waits until every sink is done with it */
+static struct tfa_sink_ev *tfa_sinks_slot(int type, int size)
+{
+	struct tfa_sinks *q = g_sinks;
+	struct tfa_sink_ev *ev;
+	int i;
+
+	pthread_mutex_lock(&q->lock);
+	for (i = 0; i < q->nr_sinks; i++) {
+		while (q->head - q->sinks[i].tail >= (uint64_t)q->len) {
+			q->nr_waits++;
+			pthread_cond_wait(&q->room, &q->lock);
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	ev = &q->ev[q->head % q->len];
+	if (size > ev->max) {
+		uint8_t *data = realloc(ev->data, size);
+
+		if (data == NULL)
+			return NULL;
+		ev->data = data;
+		ev->max = size;
+	}
+	ev->type = type;
+	ev->size = size;
+
+	return ev;
+}
+
+static void tfa_sinks_push(void)
+{
+	struct tfa_sinks *q = g_sinks;
+
+	pthread_mutex_lock(&q->lock);
+	q->head++;
+	pthread_cond_broadcast(&q->more);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static enum tfa98xx_error tfa_sinks_msg(int size, const uint8_t *buffer, const char *label)
+{
+	struct tfa_sink_ev *ev = tfa_sinks_slot(SINK_EV_MSG, size);
+
+	if (ev == NULL)
+		return TFA98XX_ERROR_FAIL;
+	memcpy(ev->data, buffer, size);
+	snprintf(ev->label, sizeof(ev->label), "%s", label);
+	tfa_sinks_push();
+
+	return TFA98XX_ERROR_OK;
+}
+
+static enum tfa98xx_error tfa_sinks_text(const char *text, int size)
+{
+	struct tfa_sink_ev *ev = tfa_sinks_slot(SINK_EV_TEXT, size);
+
+	if (ev == NULL)
+		return TFA98XX_ERROR_FAIL;
+	memcpy(ev->data, text, size);
+	tfa_sinks_push();
+
+	return TFA98XX_ERROR_OK;
+}
+
+static enum tfa98xx_error tfa_sinks_event(int type, int a0, int a1, int a2, int a3, int a4)
+{
+	struct tfa_sink_ev *ev = tfa_sinks_slot(type, 0);
+
+	if (ev == NULL)
+		return TFA98XX_ERROR_FAIL;
+	ev->arg[0] = a0;
+	ev->arg[1] = a1;
+	ev->arg[2] = a2;
+	ev->arg[3] = a3;
+	ev->arg[4] = a4;
+	tfa_sinks_push();
+
+	return TFA98XX_ERROR_OK;
+}
+
+/* the messages of a multi message are counted one by one, as without batching */
+static void tfa_sink_stats_msg(int size, const uint8_t *buffer)
+{
+	int pos, len;
+
+	if (size < 3 || memcmp(buffer, TFA_DSP_MULTI_MSG_MARKER, 3)) {
+		tfa_stats_msg(size, buffer);
+		return;
+	}
+
+	for (pos = 3; pos + 3 <= size; pos += 3 + len) {
+		len = 3 * ((buffer[pos] << 16) | (buffer[pos + 1] << 8) | buffer[pos + 2]);
+		if (len == 0 || pos + 3 + len > size)
+			break;
+		tfa_stats_msg(len, &buffer[pos + 3]);
+	}
+}
+
+static void tfa_sink_finish(struct tfa_sink *s)
+{
+	switch (s->type) {
+	case SINK_HEADER:
+		if (dedup_mode)
+			printf("dedup (header) : %u of %u messages are repeats, %u bytes not emitted again\n",
+				g_dedup.nr_dups, g_dedup.nr_msgs, g_dedup.bytes_saved);
+		if (fclose(pFileHeader) != 0) {
+			printf("File write fail : %s\n", s->out_name);
+			s->err = 1;
+		}
+		pFileHeader = NULL;
+		s->file = NULL;
+		break;
+	case SINK_BLOB:
+		if (dedup_mode)
+			printf("dedup (blob) : %u of %u messages are repeats, %u bytes not emitted again\n",
+				g_dedup.nr_dups, g_dedup.nr_msgs, g_dedup.bytes_saved);
+		if (tfa_blob_write(s->out_name) != TFA98XX_ERROR_OK)
+			s->err = 1;
+		tfa_blob_free();
+		break;
+	case SINK_NULL:
+		printf("null : %d messages, %llu bytes converted\n", s->nr_msgs, (unsigned long long)s->bytes);
+		break;
+	case SINK_STATS:
+		memcpy(g_stats->stage_sec, s->q->stage_sec, sizeof(g_stats->stage_sec));
+		if (tfa_stats_write(s->out_name, s->q->cnt_name, s->q->out_name))
+			s->err = 1;
+		tfa_stats_free();
+		break;
+	}
+	tfa_out_free();
+	text_buf_free();
+}
+
+static void tfa_sink_event(struct tfa_sink *s, struct tfa_sink_ev *ev)
+{
+	uint32_t length;
+
+	if (s->type == SINK_STATS && g_stats == NULL)
+		return; // no memory, failed at the start
+
+	switch (ev->type) {
+	case SINK_EV_BEGIN_SET:
+		if (s->type == SINK_HEADER)
+			g_set_nr_refs = 0;
+		else if (s->type == SINK_BLOB && tfa_blob_begin_set(ev->arg[0], ev->arg[1], ev->arg[2],
+				ev->arg[3], ev->arg[4]) != TFA98XX_ERROR_OK)
+			s->err = 1;
+		else if (s->type == SINK_STATS)
+			tfa_stats_begin_set(ev->arg[0], ev->arg[1], ev->arg[2], ev->arg[3], ev->arg[4]);
+		break;
+	case SINK_EV_MSG:
+		if (s->type == SINK_STATS) {
+			tfa_sink_stats_msg(ev->size, ev->data);
+			break;
+		}
+		length = tfa_msg_out(ev->data, ev->size);
+		if (s->type == SINK_HEADER)
+			tfa_out_header_message((uint32_t *)g_out32buf, length, ev->label);
+		else if (s->type == SINK_BLOB && tfa_out_blob_message((uint32_t *)g_out32buf, length) != TFA98XX_ERROR_OK)
+			s->err = 1;
+		s->nr_msgs++;
+		s->bytes += length;
+		break;
+	case SINK_EV_TEXT:
+		if (s->type == SINK_HEADER)
+			fwrite(ev->data, 1, ev->size, pFileHeader);
+		break;
+	case SINK_EV_END_SET:
+		if (s->type == SINK_HEADER)
+			tfa_out_header_end_set();
+		break;
+	case SINK_EV_PARTIAL:
+		if (s->type == SINK_STATS)
+			tfa_stats_partial(ev->arg[0], ev->arg[1]);
+		break;
+	case SINK_EV_END:
+		tfa_sink_finish(s);
+		break;
+	}
+}
+
+static void *tfa_sink_thread(void *arg)
+{
+	struct tfa_sink *s = (struct tfa_sink *)arg;
+	struct tfa_sinks *q = s->q;
+	uint64_t head, tail = 0;
+	int release = q->len / 4 + 1; // slots handed back at a time
+	int end = 0;
+
+	pFileHeader = s->file;
+	cmd_count = 1;
+	if (s->type == SINK_STATS) {
+		g_stats = calloc(1, sizeof(struct tfa_stats));
+		if (g_stats == NULL)
+			s->err = 1;
+	}
+
+	while (!end) {
+		pthread_mutex_lock(&q->lock);
+		while (q->head == tail)
+			pthread_cond_wait(&q->more, &q->lock);
+		head = q->head;
+		pthread_mutex_unlock(&q->lock);
+
+		while (tail < head && !end) {
+			struct tfa_sink_ev *ev = &q->ev[tail % q->len];
+
+			end = (ev->type == SINK_EV_END);
+			tfa_sink_event(s, ev);
+			tail++;
+			if (tail == head || tail % release == 0) {
+				pthread_mutex_lock(&q->lock);
+				s->tail = tail;
+				pthread_cond_signal(&q->room);
+				pthread_mutex_unlock(&q->lock);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * finish all outputs and stop the sink threads, returns -1 if an output failed
+ */
+static int tfa_sinks_stop(void)
+{
+	struct tfa_sinks *q = g_sinks;
+	int i, err = 0;
+
+	if (q == NULL)
+		return 0;
+
+	if (g_stats)
+		memcpy(q->stage_sec, g_stats->stage_sec, sizeof(q->stage_sec));
+	if (q->nr_sinks)
+		tfa_sinks_event(SINK_EV_END, 0, 0, 0, 0, 0);
+
+	for (i = 0; i < q->nr_sinks; i++) {
+		pthread_join(q->sinks[i].thread, NULL);
+		if (q->sinks[i].err)
+			err = -1;
+	}
+	for (; i < SINK_MAX; i++) { // not started
+		if (q->sinks[i].file)
+			fclose(q->sinks[i].file);
+	}
+	printf("sinks : %d threads, queue of %d events, %llu events, %d waits for a free slot\n",
+		q->nr_sinks, q->len, (unsigned long long)q->head, q->nr_waits);
+
+	for (i = 0; i < q->len; i++)
+		free(q->ev[i].data);
+	free(q->ev);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->more);
+	pthread_cond_destroy(&q->room);
+	free(q);
+	g_sinks = NULL;
+
+	return err;
+}
+
+/* comma separated sink names to a mask of enum tfa_sink_type */
+static int tfa_sinks_parse(char *list, unsigned *mask)
+{
+	char *p = list;
+	int type, len;
+
+	*mask = 0;
+	while (*p) {
+		len = (int)strcspn(p, ",");
+		for (type = 0; type < SINK_MAX; type++) {
+			if ((int)strlen(tfa_sink_name[type]) == len && strncmp(p, tfa_sink_name[type], len) == 0)
+				break;
+		}
+		if (type == SINK_MAX) {
+			printf("unknown sink : %.*s (header, blob, null or stats)\n", len, p);
+			return -1;
+		}
+		*mask |= 1u << type;
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+
+	return 0;
+}
+
+/*
+ * open the selected outputs next to out_name and start a thread per sink
+ */
+static int tfa_sinks_start(char *cnt_name, char *out_name)
+{
+	struct tfa_sinks *q;
+	struct tfa_sink *s;
+	int type, i, nr = 0;
+
+	q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return -1;
+	q->len = sink_queue_len;
+	q->ev = calloc(q->len, sizeof(*q->ev));
+	if (q->ev == NULL) {
+		free(q);
+		return -1;
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->more, NULL);
+	pthread_cond_init(&q->room, NULL);
+	q->cnt_name = cnt_name;
+	q->out_name = out_name;
+	g_sinks = q;
+
+	for (type = 0; type < SINK_MAX; type++) {
+		if ((sink_mask & (1u << type)) == 0)
+			continue;
+		s = &q->sinks[nr++];
+		s->type = type;
+		s->q = q;
+		if (type == SINK_HEADER) {
+			tfa_side_name(out_name, ".h", s->out_name, sizeof(s->out_name));
+			s->file = fopen(s->out_name, "wt");
+			if (s->file == NULL) {
+				printf("File open fail : %s\n", s->out_name);
+				tfa_sinks_stop();
+				return -1;
+			}
+			setvbuf(s->file, NULL, _IOFBF, 256*1024);
+		} else if (type == SINK_BLOB)
+			tfa_side_name(out_name, ".bin", s->out_name, sizeof(s->out_name));
+		else if (type == SINK_STATS)
+			tfa_side_name(out_name, ".json", s->out_name, sizeof(s->out_name));
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&q->sinks[i].thread, NULL, tfa_sink_thread, &q->sinks[i]) != 0) {
+			printf("failed to start the %s sink\n", tfa_sink_name[q->sinks[i].type]);
+			tfa_sinks_stop();
+			return -1;
+		}
+		q->nr_sinks++;
+	}
+
+	return 0;
+}
+
+/*
+ * convert one container file into its command header
+ */
+int tfa_cnt_convert(char *cnt_name, char *out_name)
+{
+	int file_size = 0;
+	int err = 0;
+	char side_name[1024];
+	double t;
+
+	if (stats_mode || (sink_mask & (1u << SINK_STATS))) // stage times only with the stats sink
+		g_stats = calloc(1, sizeof(struct tfa_stats));
+	t = tfa_stats_start();
+
+	uint8_t* cnt_buffer = tfa_cnt_map(cnt_name, &file_size);
+	if (cnt_buffer == NULL) {
+		tfa_stats_free();
+		return -1;
+	}
+
+/********************************************************************************/
+	int index = 0;
+	int dev_idx = 0;
+	int profile_idx = 0;
+
+	if (tfa_load_cnt((void *)cnt_buffer, file_size) != tfa_error_ok) {
+		tfa_cnt_unmap(cnt_buffer, file_size);
+		tfa_stats_free();
+		return -1;
+	}
+	tfa_stats_stop(STAGE_LOAD, t);
+	if (g_stats) // index build is part of the load
+		g_stats->stage_sec[STAGE_LOAD] -= g_stats->stage_sec[STAGE_INDEX];
+	if (g_pool_devs != tfa98xx_cnt_max_device()) { // pools stay allocated in watch mode
+		for (index = 0; g_pool_devs && index < POOL_MAX_INDEX; index++)
+			tfa_buffer_pool(index, 0, POOL_FREE);
+		for(index = 0; index < POOL_MAX_INDEX; index++)
+			tfa_buffer_pool(index, buf_pool_size[index], POOL_ALLOC);
+	}
+
+	if ((cache_mode || watch_mode) && g_cache == NULL) {
+		g_cache = calloc(1, sizeof(struct tfa_cache));
+		if (g_cache && cache_mode) {
+			tfa_side_name(out_name, ".cache", side_name, sizeof(side_name));
+			tfa_cache_load(side_name);
+		}
+	}
+
+	printf("############### Container File is Loaded ###############\n");
+
+#if 0
+	printf("Select a profile index in the below items (0~%d)\n", nr_profile-1);
+	for(int i=0; i< nr_profile; i++)
+		printf("%d.%s\n", i, get_profile_name(0, i));
+	scanf("%d", &profile_idx);
+
+	if(profile_idx < 0 || profile_idx >= nr_profile) {
+		printf("Selected profile index is wrong!!!\n");
+		return EXIT_SUCCESS;
+	}
+	printf("Selected profile : %d.%s\n", profile_idx, get_profile_name(dev_idx, profile_idx));
+#endif
+
+	if (sink_mask)
+		err = tfa_sinks_start(cnt_name, out_name);
+	else if (out_format == OUT_HEADER) {
+		pFileHeader = fopen(out_name, "wt");
+		if (pFileHeader == NULL) {
+			printf("File open fail : %s\n", out_name);
+			err = -1;
+		}
+	}
+	if (err) {
+		for (index = 0; index < POOL_MAX_INDEX; index++)
+			tfa_buffer_pool(index, 0, POOL_FREE);
+		tfa_cont_free_vstep_index();
+		tfa_cont_free_index();
+		tfa_cnt_unmap(cnt_buffer, file_size);
+		tfa_stats_free();
+		tfa_cache_free();
+		return -1;
+	}
+	if (pFileHeader)
+		setvbuf(pFileHeader, NULL, _IOFBF, 256*1024); // messages are written in one piece
+	cmd_count = 1;
+	p_reg_info = NULL;
+	memset(&g_batch, 0, sizeof(g_batch));
+	if (out_packed)
+		tfa_out_text("#include <stdint.h>\n\n");
+	if (batch_mode) {
+		tfa_out_text("/* %s%s, %s%d */\n", "container : ", cnt_name, "device# : ", g_devs);
+
+		err = tfa_cont_write_batch();
+	} else if (!switch_mode && !vstep_delta_mode) {
+		err = tfa_out_begin_set(dev_idx, profile_idx, 0, TFA_BLOB_SET_FULL, 0);
+		tfa_out_text("/* %s%d, %s%s */\n", "device index : ", dev_idx, "profile name : ", get_profile_name(dev_idx, profile_idx));
+
+		if (err == TFA98XX_ERROR_OK)
+			err = tfa_cont_write_set(dev_idx, profile_idx, 0); // device_index, profile_index, vstep_index
+		tfa_out_end_set();
+	}
+
+	if (switch_mode && err == 0) {
+		if (!batch_mode)
+			tfa_out_text("/* %s%s, %s%d */\n", "container : ", cnt_name, "device# : ", g_devs);
+
+		err = tfa_cont_write_switches();
+	}
+
+	if (vstep_delta_mode && err == 0) {
+		if (!batch_mode && !switch_mode)
+			tfa_out_text("/* %s%s, %s%d */\n", "container : ", cnt_name, "device# : ", g_devs);
+
+		err = tfa_cont_write_vstep_deltas(vstep_delta_mode == 2);
+	}
+
+	if (g_sinks && tfa_sinks_stop())
+		err = -1;
+	if (dedup_mode && !sink_mask)
+		printf("dedup : %u of %u messages are repeats, %u bytes not emitted again\n",
+			g_dedup.nr_dups, g_dedup.nr_msgs, g_dedup.bytes_saved);
+	if (msg_batch_max)
+		printf("batch : %d messages in %d multi messages, %d transactions and %d bytes (%d us) saved\n",
+			g_batch.nr_batched, g_batch.nr_batches, g_batch.nr_batched - g_batch.nr_batches,
+			g_batch.bytes_saved, tfa_bus_time_us(g_batch.bytes_saved));
+
+	if(pFileHeader) {
+		fclose(pFileHeader);
+		pFileHeader = NULL;
+	}
+	if (out_format == OUT_BLOB && !sink_mask) {
+		t = tfa_stats_start();
+		if (err == 0 && tfa_blob_write(out_name))
+			err = -1;
+		tfa_stats_stop(STAGE_EMIT, t);
+		tfa_blob_free();
+	}
+	if (g_stats) {
+		tfa_side_name(out_name, ".json", side_name, sizeof(side_name));
+		if (!sink_mask && tfa_stats_write(side_name, cnt_name, out_name))
+			err = -1;
+		tfa_stats_free();
+	}
+	if (g_cache) {
+		printf("cache : %d of %d sets unchanged, %d with their text\n", g_cache->hits,
+			g_cache->hits + g_cache->misses, g_cache->text_reused);
+		tfa_side_name(out_name, ".cache", side_name, sizeof(side_name));
+		if (cache_mode && err == 0 && (g_cache->text_reused != g_cache->nr_old || g_cache->nr_cur != g_cache->nr_old)
+			&& tfa_cache_save(side_name)) // rewritten unless identical
+			err = -1;
+		if (watch_mode && err == 0)
+			tfa_cache_rotate();
+		else
+			tfa_cache_free();
+	}
+
+	for (index = 0; stats_mode && index < tfa98xx_cnt_max_device(); index++)
+		tfa98xx_buffer_pool_print_stats(index);
+	for (index = 0; !watch_mode && index < POOL_MAX_INDEX; index++)
+			tfa_buffer_pool(index, 0, POOL_FREE);
+/********************************************************************************/
+
+	tfa_cont_free_vstep_index();
+	tfa_cont_free_index();
+	tfa_cnt_unmap(cnt_buffer, file_size);
+	g_cont = NULL;
+	tfa_out_free();
+	if (!watch_mode)
+		text_buf_free();
 
-			} else if (eq_biquad_mask[eq] != 0) {
-				for(bq=0; bq < eq_biquads[eq]; bq++) {
+	if (err)
+		return -1;
 
-					if (eq_biquad_mask[eq] & (1<<bq)) {
-						uint8_t *bq2 = &eq2[bq*BQ_SIZE];
-						const int msg_sz = 6 + BQ_SIZE;
-						uint8_t *msg;
+	printf("\n%s is generated successfully~\n", out_name);
+	return 0;
+}
 
-						msg = malloc(msg_sz);
-						if (msg == NULL)
-							return TFA98XX_ERROR_FAIL;
+/* output file extension per format */
+static char *tfa_out_ext(void)
+{
+	return (out_format == OUT_BLOB) ? ".bin" : ".h";
+}
 
-						/* cmd id */
-						msg[0] = 0x00;
-						msg[1] = 0x82;
-						msg[2] = 0x00;
+/*
+ * multi container mode : every container gets its own output next to it,
+ * "dir/name.cnt" -> "dir/name.h" (or "dir/name.bin")
+ */
+static void tfa_cnt_out_name(char *cnt_name, char *out_name, int size)
+{
+	tfa_side_name(strcmp(cnt_name, "-") ? cnt_name : "stdin", tfa_out_ext(), out_name, size);
+}
 
-						/* select eq and bq*/
-						msg[3] = 0x00;
-						msg[4] = eq+1;
-						msg[5] = bq+1;
+struct tfa_cnt_jobs {
+	char **cnt_names;
+	int nr_cnt;
+	int next;	/* next container to hand out */
+	int failed;	/* nr of failed conversions */
+	pthread_mutex_t lock;
+};
 
-						/* biquad parameters */
-						memcpy(&msg[6], bq2, BQ_SIZE);
-						err = dsp_msg(dev_idx, msg_sz, (uint8_t *)msg);
+static void *tfa_cnt_worker(void *arg)
+{
+	struct tfa_cnt_jobs *jobs = (struct tfa_cnt_jobs *)arg;
+	char out_name[1024];
+	int job;
 
-						free(msg);
-						if (err)
-							return err;
-					}
-				}
-			}
-			eq_offset += eq_biquads[eq];
+	for (;;) {
+		pthread_mutex_lock(&jobs->lock);
+		job = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+
+		if (job >= jobs->nr_cnt)
+			break;
+
+		tfa_cnt_out_name(jobs->cnt_names[job], out_name, sizeof(out_name));
+		if (tfa_cnt_convert(jobs->cnt_names[job], out_name)) {
+			pthread_mutex_lock(&jobs->lock);
+			jobs->failed++;
+			pthread_mutex_unlock(&jobs->lock);
 		}
 	}
+	tfa_handles_free();
 
-	return err;
+	return NULL;
 }
 
-static enum tfa98xx_error tfa_cont_write_vstepMax2_One(int dev_idx, struct tfa_volume_step_message_info *new_msg,
-						    struct tfa_volume_step_message_info *old_msg, int enable_partial_update)
+/*
+ * convert all containers on nr_workers threads,
+ * each thread has its own (thread local) conversion context
+ */
+/* output name of a container, of its resolved path when it exists */
+static void tfa_cnt_out_key(char *cnt_name, char *key, int size)
 {
-	enum tfa98xx_error err = TFA98XX_ERROR_OK;
-	int len = (tfa_cont_get_msg_len(new_msg) - 1) * 3;
-	char *buf = (char*)new_msg->parameter_data;
-	uint8_t *partial = NULL;
-	int partial_size = 0;
-#if defined(TFADSP_DSP_BUFFER_POOL)
-	int buffer_p_index = -1, partial_p_index = -1;
+#if !defined(_WIN32)
+	char *path = strcmp(cnt_name, "-") ? realpath(cnt_name, NULL) : NULL;
+
+	if (path) {
+		tfa_cnt_out_name(path, key, size);
+		free(path);
+		return;
+	}
 #endif
-	uint8_t cmdid[3];
-	int use_partial_coeff = 0;
+	tfa_cnt_out_name(cnt_name, key, size);
+}
 
-	if (enable_partial_update) {
-		if (new_msg->message_type != old_msg->message_type) {
-			printf("Message type differ - Disable Partial Update\n");
-			enable_partial_update = 0;
-		} else if (tfa_cont_get_msg_len(new_msg) != tfa_cont_get_msg_len(old_msg)) {
-			printf("Message Length differ - Disable Partial Update\n");
-			enable_partial_update = 0;
+/*
+ * a container listed more than once is converted once. different containers
+ * writing the same output are refused, their workers would write it at once
+ */
+static int tfa_cnt_unique_names(char **cnt_names, int *nr_cnt)
+{
+	char (*keys)[1024];
+	int i, j, n = 0;
+
+	keys = malloc(*nr_cnt * sizeof(*keys));
+	if (keys == NULL)
+		return -1;
+	for (i = 0; i < *nr_cnt; i++)
+		tfa_cnt_out_key(cnt_names[i], keys[i], sizeof(keys[i]));
+
+	for (i = 0; i < *nr_cnt; i++) {
+		for (j = 0; j < i; j++) {
+			if (strcmp(keys[i], keys[j]) == 0)
+				break;
+		}
+		if (j < i && strcmp(cnt_names[i], cnt_names[j]) != 0 && strcmp(cnt_names[i], "-") != 0) {
+#if !defined(_WIN32)
+			struct stat si, sj;
+
+			if (stat(cnt_names[i], &si) == 0 && stat(cnt_names[j], &sj) == 0
+				&& si.st_dev == sj.st_dev && si.st_ino == sj.st_ino)
+				continue;
+#endif
+			printf("containers %s and %s both write %s\n", cnt_names[j], cnt_names[i], keys[i]);
+			free(keys);
+			return -1;
 		}
 	}
 
-	if ((enable_partial_update) && (new_msg->message_type == 1)) {
-		/* No patial updates for message type 1 (Coefficients) */
-		enable_partial_update = 0;
-	#if 0 // TODO rev=0x3b72 in the log
-		if ((tfa98xx_dev_revision(dev_idx) & 0xff ) == 0x88)
-			use_partial_coeff = 1;
-	#endif
+	for (i = 0; i < *nr_cnt; i++) {
+		for (j = 0; j < n; j++) {
+			if (strcmp(keys[i], keys[j]) == 0)
+				break;
+		}
+		if (j < n) {
+			printf("container %s listed more than once, converted once\n", cnt_names[i]);
+			free(cnt_names[i]);
+			continue;
+		}
+		memcpy(keys[n], keys[i], sizeof(keys[n]));
+		cnt_names[n++] = cnt_names[i];
 	}
+	*nr_cnt = n;
+	free(keys);
 
-	/* Change Message Len to the actual buffer len */
-	memcpy(cmdid, new_msg->cmd_id, sizeof(cmdid));
+	return 0;
+}
 
-	/* The algoparams and mbdrc msg id will be changed to the reset type when SBSL=0
-	 * if SBSL=1 the msg will remain unchanged. It's up to the tuning engineer to choose the 'without_reset'
-	 * types inside the vstep. In other words: the reset msg is applied during SBSL==0 else it remains unchanged.
-	 */
-	//printf("is_cold = %d\n", is_cold);
-	// if (TFA_GET_BF(dev_idx, SBSL) == 0) {
-	if (is_cold == 1) {
-		//uint8_t org_cmd = cmdid[2];
+int tfa_cnt_convert_all(char **cnt_names, int nr_cnt, int nr_workers)
+{
+	struct tfa_cnt_jobs jobs;
+	pthread_t *workers;
+	int i, started;
+
+	if (nr_workers > nr_cnt)
+		nr_workers = nr_cnt;
+	if (nr_workers < 1)
+		nr_workers = 1;
+
+	jobs.cnt_names = cnt_names;
+	jobs.nr_cnt = nr_cnt;
+	jobs.next = 0;
+	jobs.failed = 0;
+	pthread_mutex_init(&jobs.lock, NULL);
+
+	workers = malloc(nr_workers * sizeof(pthread_t));
+	if (workers == NULL) {
+		pthread_mutex_destroy(&jobs.lock);
+		return -1;
+	}
 
-		if ((new_msg->message_type == 0) &&
-			(cmdid[2] != SB_PARAM_SET_ALGO_PARAMS)) // SB_PARAM_SET_ALGO_PARAMS_WITHOUT_RESET
-		{
-			//printf("P-ID for SetAlgoParams modified! cmdid[2]=0x%2x (to 0x00)\n", cmdid[2]);
-			cmdid[2] = SB_PARAM_SET_ALGO_PARAMS;
-		} else if ((new_msg->message_type == 2) &&
-			(cmdid[2] != SB_PARAM_SET_MBDRC)) // SB_PARAM_SET_MBDRC_WITHOUT_RESET
-		{
-			//printf("P-ID for SetMBDrc modified! cmdid[2]=0x%2x (to 0x07)\n", cmdid[2]);
-			cmdid[2] = SB_PARAM_SET_MBDRC;
+	for (started = 0; started < nr_workers; started++) {
+		if (pthread_create(&workers[started], NULL, tfa_cnt_worker, &jobs) != 0) {
+			printf("failed to start worker %d\n", started);
+			break;
 		}
+	}
+	if (started == 0) // no threads, do the work here
+		tfa_cnt_worker(&jobs);
 
-		//if (org_cmd != cmdid[2])
-		//	printf("P-ID: cmdid[2]=0x%02x to 0x%02x\n", org_cmd, cmdid[2]);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	pthread_mutex_destroy(&jobs.lock);
+
+	printf("\n%d of %d containers converted\n", nr_cnt - jobs.failed, nr_cnt);
+	return jobs.failed ? -1 : 0;
+}
+
+/*
+ * watch mode : convert all containers, then convert a container again every time
+ * it is written or replaced (editors that save to a temporary and rename).
+ * buffer pools, text buffer and the set cache of every container stay resident
+ */
+#if defined(__linux__)
+struct tfa_watch {
+	char *cnt_name;
+	char out_name[1024];
+	const char *base;	/* file name in its directory */
+	int wd;			/* watch of the directory */
+	int changed;
+	struct tfa_cache *cache;
+};
+
+static int tfa_cnt_watch_convert(struct tfa_watch *w)
+{
+	double t = tfa_time_sec();
+	int err;
+
+	g_cache = w->cache;
+	err = tfa_cnt_convert(w->cnt_name, w->out_name);
+	w->cache = g_cache;
+	g_cache = NULL;
+	printf("[watch] %s -> %s %s in %.2f ms\n", w->cnt_name, w->out_name,
+		err ? "failed" : "generated", (tfa_time_sec() - t) * 1e3);
+	fflush(stdout);
+
+	return err;
+}
+
+int tfa_cnt_watch(char **cnt_names, int nr_cnt)
+{
+	char events[16 * (sizeof(struct inotify_event) + 256)], dir[1024], *slash;
+	struct inotify_event *ev;
+	struct tfa_watch *w;
+	int fd, i, n, pos;
+
+	w = calloc(nr_cnt, sizeof(*w));
+	fd = inotify_init1(IN_CLOEXEC);
+	if (w == NULL || fd < 0) {
+		printf("watch : inotify not available\n");
+		free(w);
+		return -1;
 	}
 
-	/*
-	 * +sizeof(struct tfa_partial_msg_block) will allow to fit one
-	 * additonnal partial block If the partial update goes over the len of
-	 * a regular message ,we can safely write our block and check afterward
-	 * that we are over the size of a usual update
-	 */
-	if (enable_partial_update) {
-		partial_size = (sizeof(uint8_t) * len) + sizeof(struct tfa_partial_msg_block);
-#if defined(TFADSP_DSP_BUFFER_POOL)
-		partial_p_index = tfa98xx_buffer_pool_access(dev_idx, -1, partial_size, POOL_GET);
-		if (partial_p_index != -1) {
-			//printf("allocated from buffer_pool[%d] for %d bytes\n", partial_p_index, partial_size);
-			partial = (uint8_t *)(handles_local[dev_idx].buf_pool[partial_p_index].pool);
+	for (i = 0; i < nr_cnt; i++) {
+		w[i].cnt_name = cnt_names[i];
+		if (strcmp(cnt_names[i], "-") == 0) {
+			printf("watch : can not watch stdin\n");
+			goto watch_exit;
+		}
+		if (nr_cnt == 1)
+			snprintf(w[i].out_name, sizeof(w[i].out_name), "tfadsp_commands%s", tfa_out_ext());
+		else
+			tfa_cnt_out_name(cnt_names[i], w[i].out_name, sizeof(w[i].out_name));
+
+		snprintf(dir, sizeof(dir), "%s", cnt_names[i]);
+		slash = strrchr(dir, '/');
+		if (slash) {
+			slash[slash == dir] = '\0'; // keep "/" for the root
+			w[i].base = cnt_names[i] + (slash - dir) + 1;
 		} else {
-			partial = malloc(partial_size);
+			strcpy(dir, ".");
+			w[i].base = cnt_names[i];
+		}
+		/* the directory, a rename replaces the watched inode of the file */
+		w[i].wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (w[i].wd < 0) {
+			printf("watch : can not watch %s\n", dir);
+			goto watch_exit;
+		}
+		tfa_cnt_watch_convert(&w[i]);
+	}
+
+	printf("[watch] waiting for changes of %d container(s)\n", nr_cnt);
+	fflush(stdout);
+	for (;;) {
+		n = read(fd, events, sizeof(events));
+		if (n <= 0)
+			break;
+
+		for (pos = 0; pos < n; pos += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)&events[pos];
+			for (i = 0; i < nr_cnt; i++) {
+				if (ev->wd == w[i].wd && ev->len && strcmp(ev->name, w[i].base) == 0)
+					w[i].changed = 1;
+			}
+		}
+
+		for (i = 0; i < nr_cnt; i++) {
+			if (w[i].changed) {
+				w[i].changed = 0;
+				tfa_cnt_watch_convert(&w[i]);
+			}
 		}
+	}
+	printf("watch : inotify read failed\n");
+
+watch_exit:
+	for (i = 0; i < nr_cnt; i++) {
+		g_cache = w[i].cache;
+		tfa_cache_free();
+	}
+	close(fd);
+	free(w);
+
+	return -1;
+}
 #else
-		partial = kmalloc(partial_size, GFP_KERNEL);
-#endif // TFADSP_DSP_BUFFER_POOL
-		if (!partial)
-			printf("Partial update memory error - Disabling\n");
+int tfa_cnt_watch(char **cnt_names, int nr_cnt)
+{
+	printf("watch mode needs inotify (linux)\n");
+	return -1;
+}
+#endif
+
+/*
+ * parse a size argument, a k, M or G suffix scales it. -1 if it is not a
+ * number with at most one suffix or outside 1 .. 2G-1
+ */
+static int tfa_cnt_parse_size(char *arg)
+{
+	char *end;
+	long long size = strtoll(arg, &end, 0);
+	int shift = 0;
+
+	if (*end == 'k' || *end == 'K')
+		shift = 10;
+	else if (*end == 'm' || *end == 'M')
+		shift = 20;
+	else if (*end == 'g' || *end == 'G')
+		shift = 30;
+	if (shift)
+		end++;
+
+	if (end == arg || *end != '\0' || size <= 0 || size > (0x7fffffffLL >> shift))
+		return -1;
+
+	return (int)(size << shift);
+}
+
+/* append a copy of name to the container list */
+static int tfa_cnt_add_name(char ***cnt_names, int *nr_cnt, const char *name)
+{
+	char **names, *copy;
+
+	copy = strdup(name);
+	names = copy ? realloc(*cnt_names, (*nr_cnt + 1) * sizeof(char *)) : NULL;
+	if (names == NULL) {
+		printf("no memory for container %s\n", name);
+		free(copy);
+		return -1;
 	}
+	*cnt_names = names;
+	names[(*nr_cnt)++] = copy;
 
-	if (partial) {
-		uint8_t offset = 0, i = 0;
-		uint16_t *change;
-		uint8_t *n = new_msg->parameter_data;
-		uint8_t *o = old_msg->parameter_data;
-		uint8_t *p = partial;
-		uint8_t* trim = partial;
+	return 0;
+}
 
-		/* set dspFiltersReset */
-		*p++ = 0x02;
-		*p++ = 0x00;
-		*p++ = 0x00;
+/*
+ * read container names from a list file, one per line
+ */
+static int tfa_cnt_read_list(char *list_name, char ***cnt_names, int *nr_cnt)
+{
+	FILE *pFileList;
+	char line[1024];
+	int len, err = 0;
 
-		while ((o < (old_msg->parameter_data + len)) &&
-		      (p < (partial + len - 3))) {
-			if ((offset == 0xff) ||
-			    (memcmp(n, o, 3 * sizeof(uint8_t)))) {
-				*p++ = offset;
-				change = (uint16_t*) p;
-				*change = 0;
-				p += 2;
+	pFileList = fopen(list_name, "rt");
+	if (pFileList == NULL) {
+		printf("File open fail : %s\n", list_name);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), pFileList) != NULL) {
+		len = strlen(line);
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r' || line[len-1] == ' '))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		err = tfa_cnt_add_name(cnt_names, nr_cnt, line);
+		if (err)
+			break;
+	}
+	fclose(pFileList);
+
+	return err;
+}
+
+/*
+ * synthetic container generator, used for benchmarks and scaling tests
+ */
+struct tfa_gen_config {
+	int nr_devs;
+	int nr_profs;		/* per device */
+	int nr_vsteps;		/* per profile vstep file */
+	int nr_msgs;		/* per vstep, the last one is smartstudio info if more than 2 */
+	int nr_words;		/* parameter words of the algo and mbdrc messages */
+	char types[8];		/* message types cycled per vstep : a(lgo params), m(bdrc), c(oefficients) */
+	uint32_t seed;
+};
+
+#define TFA_GEN_MAX_WORDS 500	/* messages have to fit in g_out32buf */
+#define TFA_GEN_MAX_DEVS 255	/* blob sets store the device in 8 bits */
+#define TFA_GEN_MAX_PROFS 253	/* 8 bit device list length, speaker and command included */
+
+struct tfa_gen_buf {
+	uint8_t *data;
+	int size, max;
+};
+
+static int tfa_gen_put(struct tfa_gen_buf *b, const void *data, int len)
+{
+	while (b->size + len > b->max) {
+		if (tfa_blob_grow((void **)&b->data, &b->max, b->max, 1))
+			return -1;
+	}
+	memcpy(b->data + b->size, data, len);
+	b->size += len;
+
+	return b->size - len;
+}
+
+static int tfa_gen_le16(struct tfa_gen_buf *b, uint16_t v)
+{
+	uint8_t d[2] = { v & 0xff, v >> 8 };
+
+	return tfa_gen_put(b, d, 2);
+}
+
+static int tfa_gen_le32(struct tfa_gen_buf *b, uint32_t v)
+{
+	uint8_t d[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24 };
+
+	return tfa_gen_put(b, d, 4);
+}
+
+/* 24-bit dsp word, big endian */
+static int tfa_gen_w24(struct tfa_gen_buf *b, uint32_t v)
+{
+	uint8_t d[3] = { (v >> 16) & 0xff, (v >> 8) & 0xff, v & 0xff };
+
+	return tfa_gen_put(b, d, 3);
+}
+
+static int tfa_gen_dsc(struct tfa_gen_buf *b, int offset, enum tfa_descriptor_type type)
+{
+	return tfa_gen_le32(b, (offset & 0xffffff) | ((uint32_t)type << 24));
+}
+
+/* file header, size includes the header itself */
+static int tfa_gen_hdr(struct tfa_gen_buf *b, enum tfa_header_type id, int size)
+{
+	static const char names[24] = "cust\0\0\0\0app\0\0\0\0\0type\0\0\0\0";
+	int offset = tfa_gen_le16(b, id);
+
+	tfa_gen_put(b, "V_01", 4);
+	tfa_gen_le16(b, size & 0xffff);
+	tfa_gen_le32(b, 0);
+	tfa_gen_put(b, names, sizeof(names));
+
+	return offset;
+}
+
+static uint32_t tfa_gen_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+/* name string, returns its container offset */
+static int tfa_gen_string(struct tfa_gen_buf *b, int base, const char *fmt, int a, int c)
+{
+	char name[32];
 
-				for (i = 0;
-				     (i < 16) && (o < (old_msg->parameter_data + len));
-				    i++, n += 3, o += 3) {
-					if (memcmp(n, o, 3 * sizeof(uint8_t))) {
-						*change |= BIT(i);
-						memcpy(p, n, 3);
-						p += 3;
-						trim = p;
-					}
-				}
+	snprintf(name, sizeof(name), fmt, a, c);
+	return base + tfa_gen_put(b, name, (int)strlen(name) + 1);
+}
 
-				offset = 0;
-				*change = cpu_to_be16(*change);
-			} else {
-				n += 3;
-				o += 3;
-				offset++;
+/* volumestepMax2 file of one profile, all vsteps have the same message layout */
+static void tfa_gen_vstep_file(struct tfa_gen_buf *f, struct tfa_gen_config *cfg, uint32_t *rnd)
+{
+	static const char info[] = "smartstudio";
+	int nr_types = (int)strlen(cfg->types);
+	int v, m, i, start = f->size;
+	uint8_t version[4] = { 1, 2, 3, (uint8_t)cfg->nr_vsteps };
+	uint8_t id[4];
+
+	tfa_gen_hdr(f, volstep_hdr, 0);
+	tfa_gen_put(f, version, 4);
+	for (v = 0; v < cfg->nr_vsteps; v++) {
+		tfa_gen_put(f, "\1", 1);	// one register
+		tfa_gen_le32(f, 0x1234);
+		id[0] = (uint8_t)cfg->nr_msgs;
+		tfa_gen_put(f, id, 1);
+		for (m = 0; m < cfg->nr_msgs; m++) {
+			if (m == cfg->nr_msgs - 1 && cfg->nr_msgs > 2) {
+				tfa_gen_put(f, "\3", 1);
+				tfa_gen_w24(f, sizeof(info) - 1);
+				tfa_gen_put(f, info, sizeof(info) - 1);
+				continue;
+			}
+			switch (cfg->types[m % nr_types]) {
+			case 'c':	// coefficients, alternating constant and random every 8 vsteps
+				id[0] = 1; id[1] = 0; id[2] = MODULE_BIQUADFILTERBANK; id[3] = BFB_PAR_ID_SET_COEFS;
+				tfa_gen_put(f, id, 1);
+				tfa_gen_w24(f, 2 + NR_BIQUADS * NR_COEFFS);
+				tfa_gen_put(f, id + 1, 3);
+				tfa_gen_w24(f, 0);
+				for (i = 0; i < NR_BIQUADS * NR_COEFFS; i++)
+					tfa_gen_w24(f, ((v / 8) % 2) ? tfa_gen_rand(rnd) : (uint32_t)(0x123456 + i));
+				break;
+			default:	// algo params or mbdrc, one word in five changes per vstep
+				id[0] = (cfg->types[m % nr_types] == 'm') ? 2 : 0;
+				id[1] = 0; id[2] = MODULE_SPEAKERBOOST;
+				id[3] = (cfg->types[m % nr_types] == 'm') ? SB_PARAM_SET_MBDRC_WITHOUT_RESET
+									   : SB_PARAM_SET_ALGO_PARAMS_WITHOUT_RESET;
+				tfa_gen_put(f, id, 1);
+				tfa_gen_w24(f, cfg->nr_words + 1);
+				tfa_gen_put(f, id + 1, 3);
+				for (i = 0; i < cfg->nr_words; i++)
+					tfa_gen_w24(f, i * 7 + ((i % 5) ? 0 : v));
+				break;
 			}
 		}
+	}
+	f->data[start + 6] = (f->size - start) & 0xff; // header size
+	f->data[start + 7] = ((f->size - start) >> 8) & 0xff;
+}
 
-		if (trim == partial) {
-			printf("No Change in message - discarding %d bytes\n", len);
-			len = 0;
-
-		} else if (trim < (partial + len - 3)) {
-			printf("Using partial update: %d -> %d bytes\n", len , (int)(trim-partial+3));
+/* file descriptor : name, size and contents */
+static int tfa_gen_file(struct tfa_gen_buf *b, int base, int name, struct tfa_gen_buf *file)
+{
+	int offset = tfa_gen_dsc(b, name, dsc_string);
 
-			/* Add the termination marker */
-			memset(trim, 0x00, 3);
-			trim += 3;
+	tfa_gen_le32(b, file->size);
+	tfa_gen_put(b, file->data, file->size);
+	file->size = 0;
 
-			/* Signal This will be a partial update */
-			cmdid[2] |= BIT(6);
-			buf = (char*) partial;
-			len = (int)(trim - partial);
-		} else {
-			printf("Partial too big - use regular update\n");
-		}
-	}
+	return base + offset;
+}
 
-	if (use_partial_coeff) {
-		err = dsp_partial_coefficients(dev_idx, old_msg->parameter_data, new_msg->parameter_data);
-	} else if (len) {
-		uint8_t *buffer;
-		//printf("Command-ID used: 0x%02x%02x%02x \n", cmdid[0], cmdid[1], cmdid[2]);
+/* struct tfa_msg of a dsc_set_* item */
+static int tfa_gen_msg(struct tfa_gen_buf *b, int base, uint8_t param_id, int nr_words, int *words)
+{
+	uint8_t cmd[4] = { (uint8_t)nr_words, param_id, MODULE_FRAMEWORK, 0 };
+	int i, offset = tfa_gen_put(b, cmd, 4);
 
-#if defined(TFADSP_DSP_BUFFER_POOL)
-		buffer_p_index = tfa98xx_buffer_pool_access(dev_idx, -1, 3 + len, POOL_GET);
-		if (buffer_p_index != -1) {
-			//printf("allocated from buffer_pool[%d] for %d bytes\n", buffer_p_index, 3 + len);
-			buffer = (uint8_t *)(handles_local[dev_idx].buf_pool[buffer_p_index].pool);
-		} else {
-			buffer = malloc(3 + len);
-			if (buffer == NULL) {
-				printf("kmalloc error %d bytes\n", 3 + len);
-				goto tfa_cont_write_vstepMax2_One_error_exit;
-			}
-		}
-#else
-		buffer = kmalloc(3 + len, GFP_KERNEL);
-		if (buffer == NULL)
-			goto tfa_cont_write_vstepMax2_One_error_exit;
-#endif // TFADSP_DSP_BUFFER_POOL
+	for (i = 0; i < 9; i++)
+		tfa_gen_le32(b, (i < nr_words) ? (uint32_t)words[i] : 0);
 
-		memcpy(&buffer[0], cmdid, 3);
-		memcpy(&buffer[3], buf, len);
-		err = dsp_msg(dev_idx, 3 + len, (uint8_t *)buffer);
+	return base + offset;
+}
 
-#if defined(TFADSP_DSP_BUFFER_POOL)
-		if (buffer_p_index != -1) {
-			tfa98xx_buffer_pool_access(dev_idx, buffer_p_index, 0, POOL_RETURN);
-		} else {
-			free(buffer);
+/*
+ * generate a container in memory, returns NULL on error
+ */
+uint8_t *tfa_gen_cnt(struct tfa_gen_config *cfg, int *length)
+{
+	struct tfa_gen_buf data = { NULL, 0, 0 }, file = { NULL, 0, 0 }, out = { NULL, 0, 0 };
+	int nr_desc = cfg->nr_devs * (1 + cfg->nr_profs);
+	int base = (int)sizeof(struct tfa_container) + nr_desc * (int)sizeof(struct tfa_desc_ptr);
+	int *prof_offset, *dev_offset;
+	int d, p, i, spk, name, items[8], nr_items;
+	enum tfa_descriptor_type types[8];
+	int gains[4] = { 1, 2, 3, 0 }, input[2] = { 0, 1 };
+	uint32_t rnd = cfg->seed ? cfg->seed : 1;
+	uint8_t cmd[6];
+	struct tfa_container *cont;
+
+	prof_offset = malloc(nr_desc * sizeof(int));
+	if (prof_offset == NULL)
+		return NULL;
+	dev_offset = prof_offset + cfg->nr_devs * cfg->nr_profs;
+
+	/* speaker file shared by all devices and profiles */
+	name = tfa_gen_string(&data, base, "spk.speaker", 0, 0);
+	tfa_gen_hdr(&file, speaker_hdr, 0);
+	tfa_gen_put(&file, "dumbo\0\0\0vendor\0\0\0\0\0\0\0\0\0\0type\0\0\0\0\1\2\3\10\0\1\2\3", 40);
+	cmd[0] = 0; cmd[1] = MODULE_SPEAKERBOOST; cmd[2] = SB_PARAM_SET_LSMODEL;
+	tfa_gen_put(&file, cmd, 3);
+	for (i = 0; i < 40; i++)
+		tfa_gen_w24(&file, i * 3);
+	file.data[6] = file.size & 0xff;
+	file.data[7] = (file.size >> 8) & 0xff;
+	spk = tfa_gen_file(&data, base, name, &file);
+
+	for (d = 0; d < cfg->nr_devs; d++) {
+		for (p = 0; p < cfg->nr_profs; p++) {
+			nr_items = 0;
+			types[nr_items] = dsc_file;
+			items[nr_items++] = spk;
+			name = tfa_gen_string(&data, base, "p%d_d%d.vstep", p, d);
+			tfa_gen_vstep_file(&file, cfg, &rnd);
+			types[nr_items] = dsc_file;
+			items[nr_items++] = tfa_gen_file(&data, base, name, &file);
+
+			name = tfa_gen_string(&data, base, "p%d_d%d.msg", p, d);
+			tfa_gen_hdr(&file, msg_hdr, 36 + 3 + 4 * 3);
+			cmd[0] = 0; cmd[1] = MODULE_FRAMEWORK; cmd[2] = FW_PAR_ID_SET_GAINS;
+			tfa_gen_put(&file, cmd, 3);
+			tfa_gen_w24(&file, p);
+			tfa_gen_w24(&file, d);
+			tfa_gen_w24(&file, 3);
+			tfa_gen_w24(&file, 4);
+			types[nr_items] = dsc_file;
+			items[nr_items++] = tfa_gen_file(&data, base, name, &file);
+
+			gains[3] = p % 2;
+			types[nr_items] = dsc_set_gains;
+			items[nr_items++] = tfa_gen_msg(&data, base, FW_PAR_ID_SET_GAINS, 4, gains);
+			types[nr_items] = dsc_set_input_select;
+			items[nr_items++] = tfa_gen_msg(&data, base, FW_PAR_ID_SET_INPUT_SELECTOR, 2, input);
+
+			name = tfa_gen_string(&data, base, "prof%d_d%d", p, d);
+			prof_offset[d * cfg->nr_profs + p] = base + tfa_gen_le32(&data, nr_items | (TFA_PROFID << 16));
+			tfa_gen_dsc(&data, name, dsc_string);
+			for (i = 0; i < nr_items; i++)
+				tfa_gen_dsc(&data, items[i], types[i]);
 		}
-#else
-		kfree(buffer);
-#endif // TFADSP_DSP_BUFFER_POOL
+
+		/* device list : speaker, one command and all profiles */
+		cmd[0] = 0; cmd[1] = MODULE_FRAMEWORK; cmd[2] = FW_PAR_ID_SET_MEMTRACK;
+		i = base + tfa_gen_le16(&data, 6);
+		tfa_gen_put(&data, cmd, 3);
+		tfa_gen_w24(&data, 5);
+
+		name = tfa_gen_string(&data, base, "dev%d", d, 0);
+		cmd[0] = (uint8_t)(2 + cfg->nr_profs); cmd[1] = 0; cmd[2] = 0x34 + d; cmd[3] = 0;
+		dev_offset[d] = base + tfa_gen_put(&data, cmd, 4);
+		tfa_gen_le32(&data, 0x72);
+		tfa_gen_dsc(&data, name, dsc_string);
+		tfa_gen_dsc(&data, spk, dsc_file);
+		tfa_gen_dsc(&data, i, dsc_cmd);
+		for (p = 0; p < cfg->nr_profs; p++)
+			tfa_gen_dsc(&data, prof_offset[d * cfg->nr_profs + p], dsc_profile);
 	}
 
-tfa_cont_write_vstepMax2_One_error_exit:
-#if defined(TFADSP_DSP_BUFFER_POOL)
-	if (partial_p_index != -1) {
-		tfa98xx_buffer_pool_access(dev_idx, partial_p_index, 0, POOL_RETURN);
-	} else {
-		if (partial)
-			free(partial);
+	/* container header and index */
+	tfa_gen_put(&out, "PM3_0", 5);
+	cmd[0] = NXPTFA_PM_SUBVERSION;
+	tfa_gen_put(&out, cmd, 1);
+	tfa_gen_le32(&out, 0);	// size
+	tfa_gen_le32(&out, 0);	// crc
+	tfa_gen_le16(&out, 0);
+	tfa_gen_put(&out, "cust\0\0\0\0app\0\0\0\0\0type\0\0\0\0", 24);
+	tfa_gen_le16(&out, cfg->nr_devs);
+	tfa_gen_le16(&out, cfg->nr_devs * cfg->nr_profs);
+	tfa_gen_le16(&out, 0);
+	for (d = 0; d < cfg->nr_devs; d++)
+		tfa_gen_dsc(&out, dev_offset[d], dsc_device);
+	for (i = 0; i < cfg->nr_devs * cfg->nr_profs; i++)
+		tfa_gen_dsc(&out, prof_offset[i], dsc_profile);
+	tfa_gen_put(&out, data.data, data.size);
+
+	i = (out.data != NULL && out.size == base + data.size);
+	free(prof_offset);
+	free(data.data);
+	free(file.data);
+	if (!i) {
+		free(out.data);
+		return NULL;
 	}
-#else
-	if (partial)
-		kfree(partial);
-#endif // TFADSP_DSP_BUFFER_POOL
 
-	return err;
+	cont = (struct tfa_container *)out.data;
+	cont->size = out.size;
+	cont->crc = tfa_crc32((uint8_t *)&cont->crc + sizeof(cont->crc),
+		out.size - (int)((uint8_t *)&cont->crc + sizeof(cont->crc) - out.data));
+	*length = out.size;
+
+	return out.data;
 }
 
-void create_dsp_buffer_msg(struct tfa_msg *msg, char *buffer, int *size)
+/*
+ * parse "devs,profs,vsteps,msgs,words[,types[,seed]]", returns 0 if valid
+ */
+static int tfa_gen_parse(char *arg, struct tfa_gen_config *cfg)
 {
-        int i, j = 0;
-
-        /* Copy cmd_id. Remember that the cmd_id is reversed */
-        buffer[0] = msg->cmd_id[2];
-        buffer[1] = msg->cmd_id[1];
-        buffer[2] = msg->cmd_id[0];
-
-        /* Copy the data to the buffer */
-        for(i=3; i<3+(msg->msg_size*3); i++) {
-                buffer[i] = (uint8_t) ((msg->data[j] >> 16) & 0xffff);
-                i++;
-                buffer[i] = (uint8_t) ((msg->data[j] >> 8) & 0xff);
-                i++;
-                buffer[i] = (uint8_t) (msg->data[j] & 0xff);
-                j++;
-        }
+	unsigned int seed = 1;
+	int n;
+
+	memset(cfg, 0, sizeof(*cfg));
+	strcpy(cfg->types, "am");
+	n = sscanf(arg, "%d,%d,%d,%d,%d,%7[acm],%u", &cfg->nr_devs, &cfg->nr_profs,
+		&cfg->nr_vsteps, &cfg->nr_msgs, &cfg->nr_words, cfg->types, &seed);
+	cfg->seed = seed;
+
+	if (n < 5 || cfg->nr_devs < 1 || cfg->nr_devs > TFA_GEN_MAX_DEVS
+		|| cfg->nr_profs < 1 || cfg->nr_profs > TFA_GEN_MAX_PROFS
+		|| cfg->nr_vsteps < 1 || cfg->nr_vsteps > 255 || cfg->nr_msgs < 1 || cfg->nr_msgs > 255
+		|| cfg->nr_words < 1 || cfg->nr_words > TFA_GEN_MAX_WORDS) {
+		printf("wrong container spec : %s (max %d devices, %d profiles, 255 vsteps and messages, %d words)\n",
+			arg, TFA_GEN_MAX_DEVS, TFA_GEN_MAX_PROFS, TFA_GEN_MAX_WORDS);
+		return -1;
+	}
 
-        *size = (3+(msg->msg_size*3)) * sizeof(char);
+	return 0;
 }
 
-int tfa_set_swvstep(tfa98xx_handle_t handle, unsigned short new_value)
+/*
+ * write a generated container file
+ */
+int tfa_gen_write(struct tfa_gen_config *cfg, char *cnt_name)
 {
-	///int mtpk, active_value = tfa_get_swvstep(handle);
-	//unsigned short rev = handles_local[handle].rev & 0xff;
-	handles_local[handle].vstep[0]=new_value;
-	handles_local[handle].vstep[1]=new_value;
+	FILE *f;
+	int length = 0, err = 0;
+	uint8_t *cnt = tfa_gen_cnt(cfg, &length);
 
-	//return active_value;
-	return 0;
+	if (cnt == NULL) {
+		printf("container generation failed\n");
+		return -1;
+	}
+
+	f = fopen(cnt_name, "wb");
+	if (f == NULL || (int)fwrite(cnt, 1, length, f) != length) {
+		printf("File write fail : %s\n", cnt_name);
+		err = -1;
+	}
+	if (f)
+		fclose(f);
+	free(cnt);
+
+	if (err == 0)
+		printf("%s : %d devices, %d profiles, %d vsteps, %d bytes\n", cnt_name,
+			cfg->nr_devs, cfg->nr_profs, cfg->nr_vsteps, length);
+
+	return err;
 }
 
-static enum tfa98xx_error tfa_cont_write_vstepMax2(int dev_idx, struct tfa_volume_step_max2_file *vp, int vstep_idx, int vstep_msg_idx)
+/*
+ * benchmark of the conversion stages
+ */
+
+/* the converter reports every message on stdout, keep that out of the timings */
+static int tfa_bench_mute(int saved_fd)
 {
-	enum tfa98xx_error err = TFA98XX_ERROR_OK;
-	static struct tfa_volume_step_register_info *p_reg_info = NULL;
-	struct tfa_volume_step_register_info *reg_info = NULL;
-	struct tfa_volume_step_message_info *msg_info = NULL, *p_msg_info = NULL;
-	//struct tfa_bitfield bit_f;
-	int i, nr_messages, enp = 0;
+#if !defined(_WIN32)
+	int fd;
 
-	if(vstep_idx >= vp->nr_of_vsteps) {
-		printf("Volumestep %d is not available \n", vstep_idx);
-		return TFA98XX_ERROR_BAD_PARAMETER;
+	fflush(stdout);
+	if (saved_fd >= 0) {
+		dup2(saved_fd, STDOUT_FILENO);
+		close(saved_fd);
+		return -1;
+	}
+	saved_fd = dup(STDOUT_FILENO);
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
 	}
+	return saved_fd;
+#else
+	return -1;
+#endif
+}
 
-	if ( p_reg_info == NULL) {
-		//printf("Inital vstep write\n");
-		enp = 0;
- 	}
+/*
+ * self test of the simd kernels against the scalar versions, only the kernels
+ * this cpu supports are run. returns 0 if all match
+ */
+struct tfa_selftest_conv {
+	const char *name;
+	uint32_t (*fn)(int32_t *, const uint8_t *, int);
+};
 
-	reg_info = tfa_cont_get_reg_for_vstep(vp, vstep_idx);
+struct tfa_selftest_diff {
+	const char *name;
+	int (*fn)(const uint8_t *, const uint8_t *, int, uint32_t *);
+};
 
-	msg_info = tfa_cont_get_msg_info_from_reg(reg_info);
-	nr_messages = msg_info->nr_of_messages;
+#define SELFTEST_WORDS 4096
+#define SELFTEST_GUARD 8
+#define SELFTEST_FILL 0x5a5a5a5a
 
-	if (enp) {
-		p_msg_info = tfa_cont_get_msg_info_from_reg(p_reg_info);
-		if (nr_messages != p_msg_info->nr_of_messages) {
-			printf("Message different - Disable partial update\n");
-			enp = 0;
-		}
+int tfa_simd_selftest(void)
+{
+	struct tfa_selftest_conv conv[3] = { { "scalar", tfa_msg24to32_scalar } };
+	struct tfa_selftest_diff diff[3] = { { "scalar", tfa_word_diff_scalar } };
+	int nr_conv = 1, nr_diff = 1, k, n, i, w, changed, ref_changed, fails = 0;
+	uint8_t *in, *other;
+	int32_t *out, *ref;
+	uint32_t mask[4 + SELFTEST_GUARD], ref_mask[4], len, v, rnd = 0x2545f491;
+	size_t crc_len;
+
+	tfa_cpu_select();
+#if defined(TFA_SIMD_X86)
+	if (__builtin_cpu_supports("ssse3"))
+		conv[nr_conv++] = (struct tfa_selftest_conv){ "ssse3", tfa_msg24to32_ssse3 };
+	if (__builtin_cpu_supports("avx2"))
+		conv[nr_conv++] = (struct tfa_selftest_conv){ "avx2", tfa_msg24to32_avx2 };
+	if (__builtin_cpu_supports("sse2"))
+		diff[nr_diff++] = (struct tfa_selftest_diff){ "sse2", tfa_word_diff_sse2 };
+	if (__builtin_cpu_supports("avx2"))
+		diff[nr_diff++] = (struct tfa_selftest_diff){ "avx2", tfa_word_diff_avx2 };
+#endif
+	in = malloc(3 * SELFTEST_WORDS);
+	other = malloc(3 * SELFTEST_WORDS);
+	out = malloc((SELFTEST_WORDS + SELFTEST_GUARD) * sizeof(int32_t));
+	ref = malloc(SELFTEST_WORDS * sizeof(int32_t));
+	if (in == NULL || other == NULL || out == NULL || ref == NULL) {
+		printf("[selftest] no memory\n");
+		fails = 1;
+		goto tfa_simd_selftest_exit;
 	}
 
-	for (i = 0; i < nr_messages; i++) {
-		/* Messagetype(3) is Smartstudio Info! Dont send this! */
-		if(msg_info->message_type == 3) {
-			//printf("Skipping Message Type 3\n");
-			/* message_length is in bytes */
-			msg_info = tfa_cont_get_next_msg_info(msg_info);
-			if(enp)
-				p_msg_info = tfa_cont_get_next_msg_info(p_msg_info);
-			continue;
+	/* every 24-bit value, sign extended */
+	for (k = 0; k < nr_conv; k++) {
+		for (v = 0; v < (1u << 24); v += SELFTEST_WORDS) {
+			for (i = 0; i < SELFTEST_WORDS; i++) {
+				in[3 * i] = (uint8_t)((v + i) >> 16);
+				in[3 * i + 1] = (uint8_t)((v + i) >> 8);
+				in[3 * i + 2] = (uint8_t)(v + i);
+			}
+			len = conv[k].fn(out, in, 3 * SELFTEST_WORDS);
+			for (i = 0; i < SELFTEST_WORDS; i++) {
+				if (out[i] != ((int32_t)((v + i) << 8) >> 8))
+					break;
+			}
+			if (len != 4 * SELFTEST_WORDS || i < SELFTEST_WORDS) {
+				printf("[selftest] msg24to32 %s : word 0x%06x wrong\n", conv[k].name, v + i);
+				fails++;
+				break;
+			}
 		}
+	}
 
-		/* If no vstepMsgIndex is passed on, all message needs to be send */
-		if ((vstep_msg_idx >= TFA_MAX_VSTEP_MSG_MARKER) || (vstep_msg_idx == i)) {
-			err = tfa_cont_write_vstepMax2_One(dev_idx, msg_info, p_msg_info, enp);
-			if (err != TFA98XX_ERROR_OK) {
-				/*
-				 * Force a full update for the next write
-				 * As the current status of the DSP is unknown
-				 */
-				p_reg_info = NULL;
-				return err;
+	/* every tail length, nothing written past the last word */
+	for (i = 0; i < 3 * SELFTEST_WORDS; i++)
+		in[i] = (uint8_t)tfa_gen_rand(&rnd);
+	for (n = 0; n < 32; n++) {
+		tfa_msg24to32_scalar(ref, in + n, 3 * n);
+		for (k = 1; k < nr_conv; k++) {
+			for (i = 0; i < n + SELFTEST_GUARD; i++)
+				out[i] = SELFTEST_FILL;
+			len = conv[k].fn(out, in + n, 3 * n);
+			for (i = 0; i < n + SELFTEST_GUARD; i++) {
+				if (out[i] != ((i < n) ? ref[i] : SELFTEST_FILL))
+					break;
+			}
+			if (len != 4 * (uint32_t)n || i < n + SELFTEST_GUARD) {
+				printf("[selftest] msg24to32 %s : %d words, word %d wrong\n", conv[k].name, n, i);
+				fails++;
 			}
 		}
-
-		msg_info = tfa_cont_get_next_msg_info(msg_info);
-		if(enp)
-			p_msg_info = tfa_cont_get_next_msg_info(p_msg_info);
 	}
 
-	p_reg_info = reg_info;
-
-#if 0 // remark by jimmy
-	for(i=0; i<reg_info->nr_of_registers*2; i++) {
-		/* Byte swap the datasheetname */
-		bit_f.field = (uint16_t)(reg_info->register_info[i]>>8) | (reg_info->register_info[i]<<8);
-		i++;
-		bit_f.value = (uint16_t)reg_info->register_info[i]>>8;
-		err = tfa_run_write_bitfield(dev_idx , bit_f);
-		if (err != TFA98XX_ERROR_OK)
-			return err;
+	/* word diff : every tail length with changes in each byte of each word and random ones */
+	for (n = 0; n < 128; n++) {
+		for (w = -1; w < 3 * n + 8; w++) {
+			memcpy(other, in, 3 * n);
+			if (w < 3 * n && w >= 0)
+				other[w] ^= 1u << (w % 8);
+			else if (w >= 3 * n)
+				for (i = 0; i < 3 * n; i++)
+					other[i] ^= (tfa_gen_rand(&rnd) % 4 == 0) ? (uint8_t)(1 + i % 255) : 0;
+			ref_changed = tfa_word_diff_scalar(in, other, n, ref_mask);
+			for (k = 1; k < nr_diff; k++) {
+				for (i = 0; i < 4 + SELFTEST_GUARD; i++)
+					mask[i] = SELFTEST_FILL;
+				changed = diff[k].fn(in, other, n, mask);
+				for (i = 0; i < 4 + SELFTEST_GUARD; i++) {
+					if (mask[i] != ((i < (n + 31) / 32) ? ref_mask[i] : SELFTEST_FILL))
+						break;
+				}
+				if (changed != ref_changed || i < 4 + SELFTEST_GUARD) {
+					printf("[selftest] word_diff %s : %d words, change %d wrong\n", diff[k].name, n, w);
+					fails++;
+				}
+			}
+		}
 	}
-#endif
 
-	/* Save the current vstep */
-	tfa_set_swvstep(dev_idx, (unsigned short)vstep_idx);
+	/* crc of the selected version against slicing-by-8 */
+	for (crc_len = 0; crc_len < 3 * SELFTEST_WORDS; crc_len += (crc_len < 256) ? 1 : 97) {
+		if (tfa_crc32(in, crc_len) != ~crc32_slice8(0xffffffff, in, crc_len)) {
+			printf("[selftest] crc32 : %d bytes wrong\n", (int)crc_len);
+			fails++;
+		}
+	}
 
-	return err;
+	printf("[selftest] msg24to32 :");
+	for (k = 0; k < nr_conv; k++)
+		printf(" %s", conv[k].name);
+	printf(", word_diff :");
+	for (k = 0; k < nr_diff; k++)
+		printf(" %s", diff[k].name);
+	printf(", crc32 : %s, %d failures\n", crc32_use_pclmul ? "pclmul" : "slice8", fails);
+
+tfa_simd_selftest_exit:
+	free(in);
+	free(other);
+	free(out);
+	free(ref);
+
+	return fails ? -1 : 0;
 }
 
-enum tfa98xx_error tfa_cont_write_file(int dev_idx,  struct tfa_file_dsc *file, int vstep_idx, int vstep_msg_idx)
-{
-	enum tfa98xx_error err = TFA98XX_ERROR_OK;
-	struct tfa_header *hdr = (struct tfa_header *)file->data;
-	enum tfa_header_type type;
-	int size;
+struct tfa_bench_msg {
+	struct tfa_volume_step_message_info *msg;
+	struct tfa_volume_step_message_info *prev;	/* same message of the previous vstep, NULL for vstep 0 */
+	int size;					/* 24-bit bytes including the command id */
+};
 
-	type = (enum tfa_header_type) hdr->id;
+/* bytes 0 : lookups, only the call rate is reported */
+static void tfa_bench_report(const char *stage, long long calls, double bytes, double sec)
+{
+	printf("%-16s %10lld %10.2f %9.4f %10.1f %10.1f\n", stage, calls, bytes / 1e6, sec,
+		(sec > 0) ? bytes / 1e6 / sec : 0, (sec > 0) ? calls / 1e3 / sec : 0);
+}
 
-	switch (type) {
-	case msg_hdr: /* generic DSP message */
-		//printf("tfa_cont_write_file : type=msg_hdr\n");
-		size = hdr->size - sizeof(struct tfa_msg_file);
-		err = dsp_msg(dev_idx, size, (uint8_t *)((struct tfa_msg_file *)hdr)->data);
-		break;
-	case volstep_hdr:
-		// vstep_idx=0, vstep_msg_idx=100
-		tfa_cont_write_vstepMax2(dev_idx, (struct tfa_volume_step_max2_file *)hdr, vstep_idx, vstep_msg_idx);
-		//printf("tfa_cont_write_file : type=volstep_hdr\n");
-		break;
-	case speaker_hdr:
-		//printf("tfa_cont_write_file : type=speaker_hdr\n");
-		size = hdr->size - sizeof(struct tfa_spk_header) - sizeof(struct tfa_fw_ver);
-		err = dsp_msg(dev_idx, size, (uint8_t *)(((struct tfa_speaker_file *)hdr)->data + (sizeof(struct tfa_fw_ver))));
-		break;
-	case preset_hdr:
-		//printf("tfa_cont_write_file : type=preset_hdr\n");
-		break;
-	case equalizer_hdr:
-		//printf("tfa_cont_write_file : type=equalizer_hdr\n");
-		break;
-	case patch_hdr:
-		//printf("tfa_cont_write_file : type=patch_hdr\n");
-		break;
-	case config_hdr:
-		//printf("tfa_cont_write_file : type=config_hdr\n");
-		break;
-	case drc_hdr:
-		//printf("tfa_cont_write_file : type=drc_hdr\n");
-		break;
-	case info_hdr:
-		//printf("tfa_cont_write_file : type=info_hdr\n");
-		/* Ignore */
-		break;
-	default:
-		printf("Header is of unknown type: 0x%x\n", type);
-		return TFA98XX_ERROR_BAD_PARAMETER;
+/*
+ * time load, vstep lookup, partial diff, 24 to 32-bit conversion and header
+ * writing separately. cnt_spec is a generator spec or a container file
+ */
+int tfa_cnt_bench(char *cnt_spec, int iterations)
+{
+	struct tfa_gen_config cfg;
+	struct tfa_bench_msg *msgs = NULL;
+	struct tfa_volume_step_register_info *reg;
+	struct tfa_msg_record rec;
+	int32_t *out32 = NULL;
+	uint32_t *out_offset = NULL;
+	uint8_t *cnt;
+	int length = 0, nr_msgs = 0, max_msgs = 0, saved_fd, nr_files;
+	int it, f, v, m, i, index, mapped = 0, err = -1;
+	long long calls;
+	double t, bytes;
+	volatile uint8_t sink;
+	FILE *out;
+
+	if (strchr(cnt_spec, ',')) {
+		if (tfa_gen_parse(cnt_spec, &cfg))
+			return -1;
+		cnt = tfa_gen_cnt(&cfg, &length);
+	} else {
+		cnt = tfa_cnt_map(cnt_spec, &length);
+		mapped = 1;
 	}
+	if (cnt == NULL)
+		return -1;
+	if (iterations < 1)
+		iterations = 1;
 
-	return err;
-}
-
-enum tfa98xx_error tfa_cont_write_files(int dev_idx) {
-	struct tfa_device_list *dev = tfa_cont_device(dev_idx);
-	struct tfa_file_dsc *file;
-	//struct tfa_cmd *cmd;
-	enum tfa98xx_error err = TFA98XX_ERROR_OK;
-	char buffer[(MEMTRACK_MAX_WORDS * 3) + 3] = {0}; //every word requires 3 bytes, and 3 is the msg
-	int i, size = 0;
+	printf("container : %s, %d bytes, %d iterations\n", cnt_spec, length, iterations);
+	printf("%-16s %10s %10s %9s %10s %10s\n", "stage", "calls", "MB", "s", "MB/s", "kcalls/s");
 
-	if ( !dev ) {
-		return TFA98XX_ERROR_BAD_PARAMETER;
+	/* load, includes crc check, descriptor and vstep index */
+	saved_fd = tfa_bench_mute(-1);
+	t = tfa_time_sec();
+	for (it = 0; it < iterations; it++) {
+		if (tfa_load_cnt(cnt, length) != tfa_error_ok)
+			break;
+		tfa_cont_free_vstep_index();
 	}
-	/* process the list and write all files  */
-	for(i=0;i<dev->length;i++) {
-		if ( dev->list[i].type == dsc_file ) {
-			file = (struct tfa_file_dsc *)(dev->list[i].offset+(uint8_t *)g_cont);
-			if ( tfa_cont_write_file(dev_idx,  file, 0 , TFA_MAX_VSTEP_MSG_MARKER) ){ // 0, 100
-				return TFA98XX_ERROR_BAD_PARAMETER;
-			}
-		}
+	t = tfa_time_sec() - t;
+	if (it < iterations || tfa_load_cnt(cnt, length) != tfa_error_ok) {
+		tfa_bench_mute(saved_fd);
+		printf("container load failed\n");
+		goto out_free;
+	}
+	tfa_bench_mute(saved_fd);
+	tfa_bench_report("load/devs", iterations, (double)length * iterations, t);
 
-		if  ( dev->list[i].type == dsc_set_input_select ||
-		      dev->list[i].type == dsc_set_output_select ||
-		      dev->list[i].type == dsc_set_program_config ||
-		      dev->list[i].type == dsc_set_lag_w ||
-		      dev->list[i].type == dsc_set_gains ||
-		      dev->list[i].type == dsc_set_vbat_factors ||
-		      dev->list[i].type == dsc_set_senses_cal ||
-		      dev->list[i].type == dsc_set_senses_delay ||
-		      dev->list[i].type == dsc_set_mb_drc ) {
-			//create_dsp_buffer_msg((struct tfa_msg *) ( dev->list[i].offset+(char*)g_cont), buffer, &size);
+	/* messages of all vstep files, in vstep order */
+	nr_files = g_vstep_files;
+	for (f = 0; f < nr_files; f++) {
+		struct tfa_vstep_index *vsi = &g_vstep_index[f];
 
-			err = dsp_msg(dev_idx, size, (uint8_t *)buffer);
-		}
+		for (v = 0; v < vsi->nr_vsteps; v++) {
+			for (m = 0; m < vsi->msg_first[v + 1] - vsi->msg_first[v]; m++) {
+				struct tfa_volume_step_message_info *msg = tfa_cont_get_msg_for_vstep(vsi, v, m);
+				int size = tfa_cont_get_msg_len(msg) * 3;
 
-		if  ( dev->list[i].type == dsc_cmd ) {
-			size = *(uint16_t *)(dev->list[i].offset+(char*)g_cont);
-			err = dsp_msg(dev_idx, size,  (uint8_t *)(dev->list[i].offset+2+(char*)g_cont));
-		#if 0
-			if ( tfa98xx_cnt_verbose ) {
-				cmd = (struct tfa_cmd *)(dev->list[i].offset+(uint8_t *)g_cont);
-				printf("Writing cmd=0x%02x%02x%02x \n", cmd->value[0], cmd->value[1], cmd->value[2]);
+				if (msg->message_type == 3 || size / 3 > (int)(sizeof(g_out32buf) / sizeof(g_out32buf[0])))
+					continue;
+				if (tfa_blob_grow((void **)&msgs, &max_msgs, nr_msgs, sizeof(*msgs)))
+					goto out_unload;
+				msgs[nr_msgs].msg = msg;
+				msgs[nr_msgs].prev = (v > 0 && m < vsi->msg_first[v] - vsi->msg_first[v - 1])
+					? tfa_cont_get_msg_for_vstep(vsi, v - 1, m) : NULL;
+				msgs[nr_msgs].size = size;
+				nr_msgs++;
 			}
-		#endif
 		}
-		if (err != TFA98XX_ERROR_OK)
-			break;
+	}
 
-		if  ( dev->list[i].type == dsc_cf_mem ) {
-			//err = tfa_run_write_dsp_mem(dev_idx, (struct tfa_dsp_mem *)(dev->list[i].offset+(uint8_t *)g_cont));
+	/* vstep lookup, the file index resolved as tfa_cont_write_file() does */
+	calls = 0;
+	t = tfa_time_sec();
+	for (it = 0; it < iterations; it++) {
+		for (f = 0; f < nr_files; f++) {
+			struct tfa_vstep_index *vsi = tfa_cont_find_vstep_index(g_vstep_index[f].vp);
+
+			for (v = 0; v < vsi->nr_vsteps; v++) {
+				reg = tfa_cont_get_reg_for_vstep(vsi, v);
+				sink = reg->nr_of_registers; // keep the lookup
+				calls++;
+			}
 		}
+	}
+	t = tfa_time_sec() - t;
+	(void)sink;
+	tfa_bench_report("reg_for_vstep", calls, 0, t);
 
-		if (err != TFA98XX_ERROR_OK)
-			break;
+	/* partial update diff against the previous vstep, messages are recorded, not converted */
+	for (index = 0; index < POOL_MAX_INDEX; index++)
+		tfa_buffer_pool(index, buf_pool_size[index], POOL_ALLOC);
+	calls = 0;
+	bytes = 0;
+	memset(&rec, 0, sizeof(rec));
+	g_record = &rec;
+	saved_fd = tfa_bench_mute(-1);
+	t = tfa_time_sec();
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nr_msgs; i++) {
+			if (msgs[i].prev == NULL)
+				continue;
+			tfa_cont_write_vstepMax2_One(0, msgs[i].msg, msgs[i].prev, 1);
+			bytes += msgs[i].size;
+			calls++;
+		}
+		tfa_record_free(&rec);
+	}
+	t = tfa_time_sec() - t;
+	tfa_bench_mute(saved_fd);
+	g_record = NULL;
+	for (index = 0; index < POOL_MAX_INDEX; index++)
+		tfa_buffer_pool(index, 0, POOL_FREE);
+	tfa_bench_report("partial diff", calls, bytes, t);
+
+	/* 24 to 32-bit conversion, all messages kept for the header stage */
+	out_offset = malloc((nr_msgs + 1) * sizeof(uint32_t));
+	if (out_offset == NULL)
+		goto out_unload;
+	out_offset[0] = 0;
+	for (i = 0; i < nr_msgs; i++)
+		out_offset[i + 1] = out_offset[i] + msgs[i].size / 3;
+	out32 = malloc((out_offset[nr_msgs] + 1) * sizeof(int32_t));
+	if (out32 == NULL)
+		goto out_unload;
+	bytes = 0;
+	t = tfa_time_sec();
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nr_msgs; i++)
+			bytes += tfa_msg24to32(out32 + out_offset[i], msgs[i].msg->cmd_id, msgs[i].size);
+	}
+	t = tfa_time_sec() - t;
+	tfa_bench_report("msg24to32", (long long)nr_msgs * iterations, bytes * 3 / 4, t);
+
+	/* C header text of all converted messages */
+	out = tmpfile();
+	if (out == NULL)
+		goto out_unload;
+	pFileHeader = out;
+	setvbuf(out, NULL, _IOFBF, 256*1024);
+	cmd_count = 1;
+	t = tfa_time_sec();
+	for (it = 0; it < iterations; it++) {
+		for (i = 0; i < nr_msgs; i++) {
+			fwrite_message((uint32_t *)out32 + out_offset[i], msgs[i].size / 3 * 4, "SB_PARAM_SET_ALGO_PARAMS");
+			cmd_count++;
+		}
 	}
+	fflush(out);
+	t = tfa_time_sec() - t;
+	bytes = (double)ftell(out);
+	pFileHeader = NULL;
+	fclose(out);
+	text_buf_free();
+	tfa_bench_report("fwrite_message", (long long)nr_msgs * iterations, bytes, t);
+	err = 0;
+
+out_unload:
+	tfa_cont_free_vstep_index();
+	tfa_cont_free_index();
+	g_cont = NULL;
+out_free:
+	free(msgs);
+	free(out_offset);
+	free(out32);
+	if (mapped)
+		tfa_cnt_unmap(cnt, length);
+	else
+		free(cnt);
 
 	return err;
 }
 
-struct tfa_profile_list* tfa_cont_profile(int dev_idx, int prof_ipx) {
-	if ( dev_idx >= g_devs) {
-		printf("Devlist index too high");
-		return NULL;
+/*
+ * DSP emulator : replays a command blob on a model of the DSP parameter memory.
+ * Full sets start from an empty DSP, switch and vstep delta sets start from the
+ * state their full from set leaves and must end in the state of their full to set.
+ * Bus time follows the --bus cost model.
+ */
+struct tfa_emu_param {
+	uint32_t key;		// module << 8 | param id, see tfa_emu_key
+	int nr_words;
+	uint32_t *words;	// 24-bit values
+};
+
+struct tfa_emu_state {
+	uint64_t id;		// dev, prof and vstep of the full set
+	int nr_params, max_params;
+	struct tfa_emu_param *params;
+};
+
+struct tfa_emu_totals {
+	int sets, msgs, transactions, errors, mismatches;
+	long long bytes;
+};
+
+/* the without reset variants write the same parameters */
+static uint32_t tfa_emu_key(uint8_t module, uint8_t param)
+{
+	if (module == MODULE_SPEAKERBOOST && param == SB_PARAM_SET_ALGO_PARAMS_WITHOUT_RESET)
+		param = SB_PARAM_SET_ALGO_PARAMS;
+	else if (module == MODULE_SPEAKERBOOST && param == SB_PARAM_SET_MBDRC_WITHOUT_RESET)
+		param = SB_PARAM_SET_MBDRC;
+
+	return ((uint32_t)module << 8) | param;
+}
+
+static uint32_t tfa_emu_w24(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static struct tfa_emu_param *tfa_emu_param(struct tfa_emu_state *s, uint32_t key, int nr_words)
+{
+	struct tfa_emu_param *p;
+	int i;
+
+	for (i = 0; i < s->nr_params; i++) {
+		if (s->params[i].key == key)
+			break;
 	}
-	if ( prof_ipx >= g_profs[dev_idx]) {
-		printf("Proflist index too high");
-		return NULL;
+	if (i == s->nr_params) {
+		if (nr_words < 0)
+			return NULL;
+		if (tfa_blob_grow((void **)&s->params, &s->max_params, s->nr_params, sizeof(*p)))
+			return NULL;
+		p = &s->params[s->nr_params++];
+		memset(p, 0, sizeof(*p));
+		p->key = key;
+	}
+	p = &s->params[i];
+
+	if (nr_words >= 0 && nr_words != p->nr_words) { // new size, contents are written next
+		free(p->words);
+		p->words = calloc(nr_words ? nr_words : 1, sizeof(uint32_t));
+		p->nr_words = p->words ? nr_words : 0;
+		if (p->words == NULL)
+			return NULL;
 	}
 
-	return g_prof[dev_idx][prof_ipx];
+	return p;
 }
 
-enum tfa98xx_error tfa_cont_write_files_prof(int dev_idx, int prof_idx, int vstep_idx) {
-	enum tfa98xx_error err = TFA98XX_ERROR_OK;
-	struct tfa_profile_list *prof = tfa_cont_profile(dev_idx, prof_idx);
-	char buffer[(MEMTRACK_MAX_WORDS * 3) + 3] = {0}; //every word requires 3 bytes, and 3 is the msg
-	unsigned int i;
-	struct tfa_file_dsc *file;
-	//struct tfa_patch_file *patchfile;
-	int size;
+static void tfa_emu_free(struct tfa_emu_state *s)
+{
+	int i;
 
-	if ( !prof ) {
-		return TFA98XX_ERROR_BAD_PARAMETER;
+	for (i = 0; i < s->nr_params; i++)
+		free(s->params[i].words);
+	free(s->params);
+	memset(s, 0, sizeof(*s));
+}
+
+static int tfa_emu_copy(struct tfa_emu_state *dst, const struct tfa_emu_state *src)
+{
+	struct tfa_emu_param *p;
+	int i;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->id = src->id;
+	for (i = 0; i < src->nr_params; i++) {
+		p = tfa_emu_param(dst, src->params[i].key, src->params[i].nr_words);
+		if (p == NULL)
+			return -1;
+		if (p->nr_words)
+			memcpy(p->words, src->params[i].words, p->nr_words * sizeof(uint32_t));
 	}
 
-	//printf("tfa_cont_write_files_prof : length=%d, name=%s\n", prof->length, prof->name.offset + (uint8_t*)g_cont);
+	return 0;
+}
 
-	/* process the list and write all files  */
-	for(i=0;i<prof->length;i++) {
-		switch (prof->list[i].type) {
-			case dsc_file:
-				//printf("tfa_cont_write_files_prof : type=dsc_file\n");
-				file = (struct tfa_file_dsc *)(prof->list[i].offset+(uint8_t *)g_cont);
-				err = tfa_cont_write_file(dev_idx,  file, vstep_idx, TFA_MAX_VSTEP_MSG_MARKER);
-				break;
-			case dsc_patch:
-				//printf("tfa_cont_write_files_prof : type=dsc_patch\n");
-				break;
-			case dsc_cf_mem:
-				//printf("tfa_cont_write_files_prof : type=dsc_cf_mem\n");
-				break;
-			case dsc_set_input_select:
-			case dsc_set_output_select:
-			case dsc_set_program_config:
-			case dsc_set_lag_w:
-			case dsc_set_gains:
-			case dsc_set_vbat_factors:
-			case dsc_set_senses_cal:
-			case dsc_set_senses_delay:
-			case dsc_set_mb_drc:
-				//printf("tfa_cont_write_files_prof : type=%d\n", prof->list[i].type);
-				create_dsp_buffer_msg((struct tfa_msg *)(prof->list[i].offset+(uint8_t *)g_cont), buffer, &size);
-				err = dsp_msg(dev_idx, size, (uint8_t *)buffer);
-				break;
-			default:
-				/* ignore any other type */
-				break;
+/* BIT(6) partial update : reset word, blocks of offset byte, 16 bit change mask and words, zero end */
+static int tfa_emu_partial(struct tfa_emu_state *s, uint32_t key, const uint8_t *d, int size)
+{
+	struct tfa_emu_param *p = tfa_emu_param(s, key, -1);
+	int pos = 3, w = 0, i, bits;
+
+	if (p == NULL)
+		return -1; // nothing to update
+
+	while (pos + 3 <= size) {
+		bits = (d[pos + 1] << 8) | d[pos + 2];
+		if (d[pos] == 0 && bits == 0)
+			return (pos + 3 == size) ? 0 : -1;
+		w += d[pos];
+		pos += 3;
+		for (i = 0; i < 16; i++) {
+			if ((bits & BIT(i)) == 0)
+				continue;
+			if (pos + 3 > size || w + i >= p->nr_words)
+				return -1;
+			p->words[w + i] = tfa_emu_w24(&d[pos]);
+			pos += 3;
 		}
+		w += 16;
 	}
 
-	return err;
+	return -1; // no end marker
 }
 
-static void cont_get_devs(struct tfa_container *cont) {
-	struct tfa_profile_list *prof;
-    //struct tfa_livedata_list *lived;
-	int i,j;
-	int count;
+/* BFB_PAR_ID_SET_COEFS : select word 00 eq bq, eq 0 is all, bq 0 all biquads of the eq */
+static int tfa_emu_coefs(struct tfa_emu_state *s, const uint8_t *d, int size)
+{
+	struct tfa_emu_param *p = tfa_emu_param(s, tfa_emu_key(MODULE_BIQUADFILTERBANK, BFB_PAR_ID_SET_COEFS), -1);
+	int nr_words = size / 3 - 1, eq, bq, first = 0, nr = NR_BIQUADS, i;
+	uint32_t sel;
 
-	// get nr of devlists+1
-	for(i=0 ; i < cont->ndev ; i++) {
-		g_dev[i] = tfa_cont_get_dev_list(cont, i); // cache it
+	if (nr_words < 0)
+		return -1;
+	sel = tfa_emu_w24(d);
+	eq = (sel >> 8) & 0xff;
+	bq = sel & 0xff;
+	if (eq) {
+		if (eq > NR_EQ)
+			return -1;
+		for (i = 0; i < eq - 1; i++)
+			first += eq_biquads[i];
+		nr = eq_biquads[eq - 1];
+		if (bq) {
+			if (bq > nr)
+				return -1;
+			first += bq - 1;
+			nr = 1;
+		}
 	}
+	if (nr_words != nr * NR_COEFFS)
+		return -1;
 
-	g_devs=cont->ndev;
-	// walk through devices and get the profile lists
-	for (i = 0; i < g_devs; i++) {
-		j=0;
-		count=0;
-		while ((prof = tfa_cont_get_dev_prof_list(cont, i, j)) != NULL) {
-			count++;
-			g_prof[i][j++] = prof;
-		}
-		g_profs[i] = count;    // count the nr of profiles per device
+	if (p == NULL || p->nr_words != NR_BIQUADS * NR_COEFFS) {
+		if (eq) // per eq or biquad on unknown coefficients
+			return -1;
+		p = tfa_emu_param(s, tfa_emu_key(MODULE_BIQUADFILTERBANK, BFB_PAR_ID_SET_COEFS), NR_BIQUADS * NR_COEFFS);
+		if (p == NULL)
+			return -1;
 	}
+	for (i = 0; i < nr_words; i++)
+		p->words[first * NR_COEFFS + i] = tfa_emu_w24(&d[3 + 3 * i]);
 
-        g_devs=cont->ndev;
+	return 0;
 }
 
-char *get_profile_name(uint8_t device_idx, uint8_t profile_idx)
+/* one 24-bit message as dsp_msg writes it, returns -1 if the DSP would reject it */
+static int tfa_emu_msg(struct tfa_emu_state *s, const uint8_t *msg, int size, int nested)
 {
-	struct tfa_profile_list *prof = tfa_cont_profile(device_idx, profile_idx);
-	return (char *)(prof->name.offset + (uint8_t*)g_cont);
-}
+	struct tfa_emu_param *p;
+	int pos, len, i;
 
-uint8_t nr_device = 0;
-uint8_t nr_profile = 0;
+	if (size < 3 || size % 3)
+		return -1;
 
-enum tfa_error tfa_load_cnt(void *cnt, int length) {
-	struct tfa_container  *cntbuf = (struct tfa_container  *)cnt;
+	if (memcmp(msg, TFA_DSP_MULTI_MSG_MARKER, 3) == 0) {
+		if (nested)
+			return -1;
+		for (pos = 3; pos + 3 <= size; pos += len) {
+			len = 3 * tfa_emu_w24(&msg[pos]);
+			pos += 3;
+			if (len == 0)
+				return (pos == size) ? 0 : -1;
+			if (pos + len > size || tfa_emu_msg(s, &msg[pos], len, 1))
+				return -1;
+		}
+		return -1;
+	}
 
-	g_cont = NULL;
+	if (msg[2] & TFA_DSP_PARAM_GET)
+		return 0; // reads leave the state as is
+	if (msg[1] == MODULE_BIQUADFILTERBANK && msg[2] == BFB_PAR_ID_SET_COEFS)
+		return tfa_emu_coefs(s, &msg[3], size - 3);
+	if (msg[2] & TFA_DSP_PARAM_PARTIAL)
+		return tfa_emu_partial(s, tfa_emu_key(msg[1], msg[2] & ~TFA_DSP_PARAM_PARTIAL), &msg[3], size - 3);
 
-	if (length > TFA_MAX_CNT_LENGTH) {
-		printf("incorrect length\n");
-		return tfa_error_container;
-	}
+	p = tfa_emu_param(s, tfa_emu_key(msg[1], msg[2]), size / 3 - 1);
+	if (p == NULL)
+		return -1;
+	for (i = 0; i < p->nr_words; i++)
+		p->words[i] = tfa_emu_w24(&msg[3 + 3 * i]);
 
-	nr_device = cntbuf->ndev;
-	nr_profile = cntbuf->nprof;
+	return 0;
+}
 
-	printf("id=%.2s, version=%.2s%.2s, ", cntbuf->id, cntbuf->version, cntbuf->subversion);
-	printf("customer=%.8s, application=%.8s, type=%.8s\n", cntbuf->customer, cntbuf->application, cntbuf->type);
-	printf("device# : %d, profile# : %d\n", nr_device, nr_profile);
+/* order independent digest of a state */
+static uint64_t tfa_emu_hash(const struct tfa_emu_state *s)
+{
+	uint64_t h = 0;
+	int i;
 
+	for (i = 0; i < s->nr_params; i++)
+		h += tfa_cache_hash(tfa_cache_hash(0xcbf29ce484222325ULL, &s->params[i].key, sizeof(uint32_t)),
+			s->params[i].words, s->params[i].nr_words * sizeof(uint32_t));
 
-	if (HDR(cntbuf->id[0],cntbuf->id[1]) == 0) {
-		printf("header is 0\n");
-		return tfa_error_container;
-	}
+	return h;
+}
 
-	if ( (HDR(cntbuf->id[0],cntbuf->id[1])) != params_hdr ) {
-		printf("wrong header type: 0x%02x 0x%02x\n", cntbuf->id[0],cntbuf->id[1]);
-		return tfa_error_container;
+/* parameters of ref that s does not hold in the same way, each one printed */
+static int tfa_emu_compare(struct tfa_emu_state *s, const struct tfa_emu_state *ref)
+{
+	const struct tfa_emu_param *r;
+	struct tfa_emu_param *p;
+	const char *name;
+	int i, w, differ = 0;
+
+	for (i = 0; i < ref->nr_params; i++) {
+		r = &ref->params[i];
+		p = tfa_emu_param(s, r->key, -1);
+		name = tfa_dsp_cmd_name(r->key >> 8, r->key & 0xff);
+		if (p == NULL || p->nr_words != r->nr_words) {
+			printf("[emu]   0x%04x %s : %d words, expected %d\n", r->key, name ? name : "",
+				p ? p->nr_words : 0, r->nr_words);
+			differ++;
+			continue;
+		}
+		for (w = 0; w < r->nr_words && p->words[w] == r->words[w]; w++)
+			;
+		if (w < r->nr_words) {
+			printf("[emu]   0x%04x %s : word %d is 0x%06x, expected 0x%06x\n", r->key, name ? name : "",
+				w, p->words[w], r->words[w]);
+			differ++;
+		}
 	}
 
-	if (cntbuf->size == 0) {
-		printf("data size is 0\n");
-		return tfa_error_container;
-	}
+	return differ;
+}
 
-	/* check sub version level */
-	if ( (cntbuf->subversion[1] == NXPTFA_PM_SUBVERSION) &&
-		 (cntbuf->subversion[0] == '0') ) {
-		g_cont = cntbuf;
-		cont_get_devs(g_cont);
-	} else {
-		printf("container sub-version not supported: %c%c\n",
-				cntbuf->subversion[0], cntbuf->subversion[1]);
-		return tfa_error_container;
-	}
+static int tfa_emu_state_cmp(const void *a, const void *b)
+{
+	const struct tfa_emu_state *sa = a, *sb = b;
 
-	return tfa_error_ok;
+	return (sa->id < sb->id) ? -1 : (sa->id > sb->id);
 }
 
-int main(int argc, char* argv[]) {
-	FILE * pFileCnt = NULL;
-	int file_size;
+#define TFA_EMU_ID(dev, prof, vstep) (((uint64_t)(dev) << 32) | ((uint64_t)(prof) << 16) | (vstep))
 
-	if (argc == 1) { // no argument
-		pFileCnt = fopen("Tfa9872.cnt", "rb"); // default
-	} else {
-		pFileCnt = fopen(argv[1], "rb"); // input .cnt file
+/*
+ * apply the messages of one set, the 32-bit payloads go back to the 24-bit bytes
+ * dsp_msg produced. tmp holds the largest message
+ */
+static void tfa_emu_set(const uint8_t *blob, const struct tfa_blob_header *hdr, const struct tfa_blob_set *set,
+	struct tfa_emu_state *s, uint8_t *tmp, struct tfa_emu_totals *t, long long *set_bytes, int *set_trans)
+{
+	const struct tfa_blob_msg *msgs = (const struct tfa_blob_msg *)(blob + hdr->msg_offset);
+	int packed = (memcmp(hdr->magic, TFA_BLOB_PACKED_MAGIC, 4) == 0);
+	const uint8_t *words;
+	uint32_t m, i, len;
+	int trans;
+
+	*set_bytes = 0;
+	*set_trans = 0;
+	for (m = set->first_msg; m < set->first_msg + set->nr_msgs; m++) {
+		words = blob + msgs[m].offset;
+		if (packed) { // the 24-bit message as it is
+			len = msgs[m].length / 3;
+			memcpy(tmp, words, msgs[m].length);
+		} else {
+			len = msgs[m].length;
+			for (i = 0; i < len; i++) { // little endian 32-bit, low 24 bits
+				tmp[3 * i] = words[4 * i + 2];
+				tmp[3 * i + 1] = words[4 * i + 1];
+				tmp[3 * i + 2] = words[4 * i];
+			}
+		}
+		trans = (bus_cost.max_transfer > 0) ? (int)((3 * len + bus_cost.max_transfer - 1) / bus_cost.max_transfer) : 1;
+		*set_trans += trans;
+		*set_bytes += 3 * len + (long long)trans * bus_cost.msg_overhead;
+		t->msgs++;
+		if (tfa_emu_msg(s, tmp, 3 * len, 0)) {
+			printf("[emu]   message %u (0x%02x%02x%02x, %u words) rejected\n", m, tmp[0], tmp[1], tmp[2], len);
+			t->errors++;
+		}
 	}
+	t->sets++;
+	t->transactions += *set_trans;
+	t->bytes += *set_bytes;
+}
 
-	if (pFileCnt == NULL)
-	{
-		printf("File open fail\n");
-		exit(-1);
-	}
-	fseek(pFileCnt, 0, SEEK_END);
-	file_size = ftell(pFileCnt);
-	fseek(pFileCnt, 0, SEEK_SET); // roll-back
+static long long tfa_emu_time_us(long long bytes)
+{
+	return bytes * 1000000 / bus_cost.bytes_per_sec;
+}
 
-	uint8_t* cnt_buffer = malloc(TFA_MAX_CNT_LENGTH);
-	if ((int)fread(cnt_buffer, sizeof(uint8_t), file_size, pFileCnt) != file_size)
-	{
-		printf("File read fail\n");
-		fclose(pFileCnt);
-		free(cnt_buffer);
+/*
+ * replay a blob written with -b, returns 0 if every message was understood and
+ * every switch and vstep delta set reached the state of its full set
+ */
+int tfa_emu_replay(const char *name)
+{
+	static const char *const kinds[] = { "full", "switch", "vstep delta" };
+	struct tfa_emu_totals totals[3];
+	struct tfa_emu_state *states = NULL, s, key, *ref;
+	const struct tfa_blob_header *hdr;
+	const struct tfa_blob_set *sets, *set;
+	const struct tfa_blob_msg *msgs;
+	uint8_t *blob = NULL, *tmp = NULL;
+	uint32_t i, max_len = 0, unit;
+	long long set_bytes, size;
+	int nr_states = 0, set_trans, differ, err = -1, k;
+	FILE *f;
+
+	memset(totals, 0, sizeof(totals));
+	f = fopen(name, "rb");
+	if (f == NULL) {
+		printf("can not open %s\n", name);
 		return -1;
 	}
-	fclose(pFileCnt);
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size >= (long long)sizeof(*hdr) && size < 0x7fffffff)
+		blob = malloc(size);
+	if (blob == NULL || fread(blob, 1, size, f) != (size_t)size) {
+		printf("can not read %s\n", name);
+		fclose(f);
+		free(blob);
+		return -1;
+	}
+	fclose(f);
+
+	/* to host order */
+	tfa_blob_header_le((struct tfa_blob_header *)blob);
+	hdr = (const struct tfa_blob_header *)blob;
+	unit = (memcmp(hdr->magic, TFA_BLOB_PACKED_MAGIC, 4) == 0) ? 1 : 4; // bytes per message length
+	if ((unit == 4 && memcmp(hdr->magic, TFA_BLOB_MAGIC, 4) != 0) || hdr->version != TFA_BLOB_VERSION
+		|| hdr->set_offset > size || hdr->nr_sets > (size - hdr->set_offset) / sizeof(*sets)
+		|| hdr->msg_offset > size || hdr->nr_msgs > (size - hdr->msg_offset) / sizeof(*msgs)
+		|| hdr->payload_offset > size || hdr->payload_size > size - hdr->payload_offset) {
+		printf("%s is not a command blob\n", name);
+		goto tfa_emu_replay_exit;
+	}
+	tfa_blob_tables_le((struct tfa_blob_set *)(blob + hdr->set_offset), hdr->nr_sets,
+		(struct tfa_blob_msg *)(blob + hdr->msg_offset), hdr->nr_msgs);
+	if (unit == 4)
+		tfa_blob_words_le(blob + hdr->payload_offset, hdr->payload_size);
+	sets = (const struct tfa_blob_set *)(blob + hdr->set_offset);
+	msgs = (const struct tfa_blob_msg *)(blob + hdr->msg_offset);
+	for (i = 0; i < hdr->nr_msgs; i++) {
+		if (msgs[i].offset > size || msgs[i].length > (size - msgs[i].offset) / unit) {
+			printf("message %u exceeds the blob\n", i);
+			goto tfa_emu_replay_exit;
+		}
+		if (msgs[i].length > max_len)
+			max_len = msgs[i].length;
+	}
+	for (i = 0; i < hdr->nr_sets; i++) {
+		if (sets[i].kind > TFA_BLOB_SET_VSTEP_DELTA || sets[i].first_msg > hdr->nr_msgs
+			|| sets[i].nr_msgs > hdr->nr_msgs - sets[i].first_msg) {
+			printf("set %u is not valid\n", i);
+			goto tfa_emu_replay_exit;
+		}
+	}
+	tmp = malloc(3 * max_len + 3);
+	states = calloc(hdr->nr_sets + 1, sizeof(*states));
+	if (tmp == NULL || states == NULL)
+		goto tfa_emu_replay_exit;
+
+	/* full sets first, the others are checked against them */
+	for (i = 0; i < hdr->nr_sets; i++) {
+		set = &sets[i];
+		if (set->kind != TFA_BLOB_SET_FULL)
+			continue;
+		memset(&s, 0, sizeof(s));
+		s.id = TFA_EMU_ID(set->dev, set->prof, set->vstep);
+		tfa_emu_set(blob, hdr, set, &s, tmp, &totals[TFA_BLOB_SET_FULL], &set_bytes, &set_trans);
+		printf("[emu] set %u, device %d, profile %d, vstep %d : %u msgs, %d transactions, %lld bytes, %lld us, "
+			"%d params, state %016llx\n", i, set->dev, set->prof, set->vstep, set->nr_msgs, set_trans,
+			set_bytes, tfa_emu_time_us(set_bytes), s.nr_params, (unsigned long long)tfa_emu_hash(&s));
+		states[nr_states++] = s;
+	}
+	qsort(states, nr_states, sizeof(*states), tfa_emu_state_cmp);
 
-/********************************************************************************/
-	int index = 0;
-	int dev_idx = 0;
-	int profile_idx = 0;
+	for (i = 0; i < hdr->nr_sets; i++) {
+		set = &sets[i];
+		if (set->kind == TFA_BLOB_SET_FULL)
+			continue;
+		key.id = (set->kind == TFA_BLOB_SET_SWITCH) ? TFA_EMU_ID(set->dev, set->from, set->vstep)
+			: TFA_EMU_ID(set->dev, set->prof, set->from);
+		ref = bsearch(&key, states, nr_states, sizeof(*states), tfa_emu_state_cmp);
+		memset(&s, 0, sizeof(s));
+		if (ref == NULL || tfa_emu_copy(&s, ref)) {
+			printf("[emu] set %u : no full set to start from\n", i);
+			tfa_emu_free(&s);
+			totals[set->kind].mismatches++;
+			continue;
+		}
 
-	tfa_load_cnt((void *)cnt_buffer, file_size);
-	for(index = 0; index < POOL_MAX_INDEX; index++)
-		tfa_buffer_pool(index, buf_pool_size[index], POOL_ALLOC);
+		tfa_emu_set(blob, hdr, set, &s, tmp, &totals[set->kind], &set_bytes, &set_trans);
+		printf("[emu] set %u, device %d, profile %d, vstep %d, %s from %d : %u msgs, %d transactions, "
+			"%lld bytes, %lld us\n", i, set->dev, set->prof, set->vstep, kinds[set->kind], set->from,
+			set->nr_msgs, set_trans, set_bytes, tfa_emu_time_us(set_bytes));
+
+		key.id = TFA_EMU_ID(set->dev, set->prof, set->vstep);
+		ref = bsearch(&key, states, nr_states, sizeof(*states), tfa_emu_state_cmp);
+		differ = ref ? tfa_emu_compare(&s, ref) : -1;
+		if (differ)
+			totals[set->kind].mismatches++;
+		if (differ < 0)
+			printf("[emu] set %u : no full set to compare with\n", i);
+		else if (differ)
+			printf("[emu] set %u : %d params differ from the full set\n", i, differ);
+		tfa_emu_free(&s);
+	}
 
-	printf("############### Container File is Loaded ###############\n");
+	for (k = 0; k < 3; k++) {
+		if (totals[k].sets == 0)
+			continue;
+		printf("[emu] %-11s : %d sets, %d msgs, %d transactions, %lld bytes, %lld us, %d rejected msgs, "
+			"%d state mismatches\n", kinds[k], totals[k].sets, totals[k].msgs, totals[k].transactions,
+			totals[k].bytes, tfa_emu_time_us(totals[k].bytes), totals[k].errors, totals[k].mismatches);
+	}
+	err = 0;
+	for (k = 0; k < 3; k++) {
+		if (totals[k].errors || totals[k].mismatches)
+			err = -1;
+	}
 
-#if 0
-	printf("Select a profile index in the below items (0~%d)\n", nr_profile-1);
-	for(int i=0; i< nr_profile; i++)
-		printf("%d.%s\n", i, get_profile_name(0, i));
-	scanf("%d", &profile_idx);
+tfa_emu_replay_exit:
+	for (k = 0; k < nr_states; k++)
+		tfa_emu_free(&states[k]);
+	free(states);
+	free(tmp);
+	free(blob);
 
-	if(profile_idx < 0 || profile_idx >= nr_profile) {
-		printf("Selected profile index is wrong!!!\n");
-		return EXIT_SUCCESS;
+	return err;
+}
+
+int main(int argc, char* argv[]) {
+	char **cnt_names = NULL, *bench_spec = NULL, *gen_name = NULL, *emu_name = NULL;
+	int nr_cnt = 0, nr_workers = 0, iterations = 10, selftest = 0, multi;
+	struct tfa_gen_config gen_cfg;
+	int i, err;
+
+	tfa_cpu_select();
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--all") == 0) {
+			batch_mode = 1; // all devices x profiles x vsteps
+		} else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--blob") == 0) {
+			out_format = OUT_BLOB; // binary command blob instead of the C header
+		} else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--packed") == 0) {
+			out_packed = 1; // 24-bit messages as they go to the dsp, no widening to 32-bit
+		} else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dedup") == 0) {
+			dedup_mode = 1; // emit identical messages once
+		} else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--switch") == 0) {
+			switch_mode = 1; // profile to profile switch sequences
+		} else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--vstep-delta") == 0) {
+			vstep_delta_mode = 1; // vstep +-1 partial updates
+		} else if (strcmp(argv[i], "-V") == 0 || strcmp(argv[i], "--vstep-pairs") == 0) {
+			vstep_delta_mode = 2; // partial updates between all vsteps
+		} else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--coeff-partial") == 0) {
+			coeff_partial_mode = 1; // biquad level updates of coefficients
+		} else if ((strcmp(argv[i], "-B") == 0 || strcmp(argv[i], "--batch") == 0) && i + 1 < argc) {
+			msg_batch_max = atoi(argv[++i]); // max bytes of a multi message
+		} else if (strcmp(argv[i], "--bus") == 0 && i + 1 < argc) {
+			// overhead bytes per message, bytes per second, max transfer bytes
+			if (sscanf(argv[++i], "%d,%d,%d", &bus_cost.msg_overhead,
+				&bus_cost.bytes_per_sec, &bus_cost.max_transfer) < 1 || bus_cost.bytes_per_sec <= 0) {
+				printf("wrong bus cost model : %s\n", argv[i]);
+				exit(-1);
+			}
+		} else if (strcmp(argv[i], "--sinks") == 0 && i + 1 < argc) {
+			// outputs written by sink threads in one run : header,blob,null,stats
+			if (tfa_sinks_parse(argv[++i], &sink_mask))
+				exit(-1);
+		} else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc) {
+			sink_queue_len = atoi(argv[++i]); // events queued for the sinks
+			if (sink_queue_len < 1)
+				sink_queue_len = 1;
+		} else if (strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "--stats") == 0) {
+			stats_mode = 1; // json timing and traffic report next to the output
+		} else if (strcmp(argv[i], "-C") == 0 || strcmp(argv[i], "--cache") == 0) {
+			cache_mode = 1; // reuse unchanged sets of the previous run
+		} else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--watch") == 0) {
+			watch_mode = 1; // convert again on every change
+		} else if (strcmp(argv[i], "--no-crc") == 0) {
+			cnt_verify_crc = 0; // already verified by the caller
+		} else if (strcmp(argv[i], "--pool-lazy-clear") == 0) {
+			pool_clear_on_demand = 1; // no clearing of returned pool buffers
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			cnt_max_length = tfa_cnt_parse_size(argv[++i]); // container size limit
+			if (cnt_max_length < 0) {
+				printf("wrong container size limit : %s\n", argv[i]);
+				exit(-1);
+			}
+		} else if (strcmp(argv[i], "--gen") == 0 && i + 2 < argc) {
+			// write a synthetic container : file devs,profs,vsteps,msgs,words[,types[,seed]]
+			gen_name = argv[++i];
+			if (tfa_gen_parse(argv[++i], &gen_cfg))
+				exit(-1);
+		} else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+			bench_spec = argv[++i]; // generator spec or container file
+		} else if (strcmp(argv[i], "--selftest") == 0) {
+			selftest = 1; // simd kernels against the scalar versions
+		} else if (strcmp(argv[i], "--emulate") == 0 && i + 1 < argc) {
+			emu_name = argv[++i]; // replay a command blob on the DSP model
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			iterations = atoi(argv[++i]); // benchmark iterations
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			nr_workers = atoi(argv[++i]); // nr of worker threads
+		} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			if (tfa_cnt_read_list(argv[++i], &cnt_names, &nr_cnt)) // list of .cnt files
+				exit(-1);
+		} else {
+			if (tfa_cnt_add_name(&cnt_names, &nr_cnt, argv[i])) // input .cnt file
+				exit(-1);
+		}
 	}
-	printf("Selected profile : %d.%s\n", profile_idx, get_profile_name(dev_idx, profile_idx));
-#endif
 
-	pFileHeader = fopen("tfadsp_commands.h", "wt");
-	cmd_count = 1;
-	fprintf(pFileHeader, "/* %s%d, %s%s */\n", "device index : ", dev_idx, "profile name : ", get_profile_name(dev_idx, profile_idx));
+	if (sink_mask && stats_mode)
+		sink_mask |= 1u << SINK_STATS;
 
-	tfa_cont_write_files(dev_idx);
-	tfa_cont_write_files_prof(dev_idx, profile_idx, 0); // device_index, profile_index, vstep_index
+	if (gen_name) {
+		err = tfa_gen_write(&gen_cfg, gen_name);
+		for (i = 0; i < nr_cnt; i++)
+			free(cnt_names[i]);
+		free(cnt_names);
+		return err ? -1 : EXIT_SUCCESS;
+	}
 
-	if(pFileHeader) {
-		fclose(pFileHeader);
-		pFileHeader = NULL;
+	if (emu_name) {
+		err = tfa_emu_replay(emu_name);
+		for (i = 0; i < nr_cnt; i++)
+			free(cnt_names[i]);
+		free(cnt_names);
+		return err ? -1 : EXIT_SUCCESS;
 	}
 
-	for (index = 0; index < POOL_MAX_INDEX; index++)
-			tfa_buffer_pool(index, 0, POOL_FREE);
-/********************************************************************************/
+	if (selftest || bench_spec) {
+		err = selftest ? tfa_simd_selftest() : tfa_cnt_bench(bench_spec, iterations);
+		for (i = 0; i < nr_cnt; i++)
+			free(cnt_names[i]);
+		free(cnt_names);
+		return err ? -1 : EXIT_SUCCESS;
+	}
 
-	free(cnt_buffer);
+	if (nr_cnt == 0 && tfa_cnt_add_name(&cnt_names, &nr_cnt, "Tfa9872.cnt")) // no argument, default
+		exit(-1);
+	multi = nr_cnt > 1 || nr_workers; // outputs next to the containers
+
+	if (multi && tfa_cnt_unique_names(cnt_names, &nr_cnt)) {
+		err = -1;
+	} else if (watch_mode) {
+		err = tfa_cnt_watch(cnt_names, nr_cnt);
+	} else if (!multi) {
+		err = tfa_cnt_convert(cnt_names[0], (out_format == OUT_BLOB) ? "tfadsp_commands.bin" : "tfadsp_commands.h");
+	} else {
+		err = tfa_cnt_convert_all(cnt_names, nr_cnt, nr_workers ? nr_workers : 1);
+	}
+
+	for (i = 0; i < nr_cnt; i++)
+		free(cnt_names[i]);
+	free(cnt_names);
+
+	if (err)
+		exit(-1);
 
-	printf("\ntfadsp_commands.h is generated successfully~\n");
 	return EXIT_SUCCESS;
 }
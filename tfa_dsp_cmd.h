@@ -0,0 +1,131 @@
+/*
+ * tfa_dsp_cmd.h
+ *
+ *  Command name table and message decoder for the DSP RPC ids in tfa_dsp_fw.h
+ */
+
+#ifndef TFA_DSP_CMD_H_
+#define TFA_DSP_CMD_H_
+
+#include <stdint.h>
+
+#include "tfa_dsp_fw.h"
+
+/* SET param ids with this bit are partial updates, see tfa_partial_msg_block */
+#define TFA_DSP_PARAM_PARTIAL	0x40
+#define TFA_DSP_PARAM_GET	0x80
+
+/*
+ * multi message : several messages in one dsp write. The marker word, then per
+ * message its length in 24-bit words and the message itself, a zero length ends it
+ */
+#define TFA_DSP_MULTI_MSG_MARKER	"mmm"
+
+#define TFA_DSP_MODULE_FIRST	MODULE_FRAMEWORK
+#define TFA_DSP_NR_MODULES	(MODULE_BIQUADFILTERBANK - MODULE_FRAMEWORK + 1)
+
+#define TFA_DSP_CMD(id) [id] = #id
+
+/*
+ * names per module and param id, ids shared by two defines
+ * keep the first one only (SET_MEMORY, SET_INPUT_SELECTOR, SET_MUTE, GET_MBDRC_DYNAMICS)
+ */
+static const char *const tfa_dsp_cmd_names[TFA_DSP_NR_MODULES][256] = {
+	[MODULE_FRAMEWORK - TFA_DSP_MODULE_FIRST] = {
+		TFA_DSP_CMD(FW_PAR_ID_SET_BAT_FACTORS),
+		TFA_DSP_CMD(FW_PAR_ID_SET_MEMORY),		/* == TFA1_FW_PAR_ID_SET_CURRENT_DELAY */
+		TFA_DSP_CMD(FW_PAR_ID_SET_SENSES_DELAY),
+		TFA_DSP_CMD(FW_PAR_ID_SETSENSESCAL),
+		TFA_DSP_CMD(FW_PAR_ID_SET_INPUT_SELECTOR),	/* == TFA1_FW_PAR_ID_SET_CURFRAC_DELAY */
+		TFA_DSP_CMD(FW_PAR_ID_SET_OUTPUT_SELECTOR),
+		TFA_DSP_CMD(FW_PAR_ID_SET_PROGRAM_CONFIG),
+		TFA_DSP_CMD(FW_PAR_ID_SET_GAINS),
+		TFA_DSP_CMD(FW_PAR_ID_SET_MEMTRACK),
+		TFA_DSP_CMD(FW_PAR_ID_SET_FWKUSECASE),
+		TFA_DSP_CMD(FW_PAR_ID_SET_HW_CONFIG),
+		TFA_DSP_CMD(FW_PAR_ID_SET_CHIP_TEMPSELECTOR),
+		TFA_DSP_CMD(FW_PAR_ID_GET_MEMORY),
+		TFA_DSP_CMD(FW_PAR_ID_GLOBAL_GET_INFO),
+		TFA_DSP_CMD(FW_PAR_ID_GET_FEATURE_INFO),
+		TFA_DSP_CMD(FW_PAR_ID_GET_MEMTRACK),
+		TFA_DSP_CMD(FW_PAR_ID_GET_TAG),
+		TFA_DSP_CMD(FW_PAR_ID_GET_API_VERSION),
+		TFA_DSP_CMD(FW_PAR_ID_GET_STATUS_CHANGE),
+	},
+	[MODULE_SPEAKERBOOST - TFA_DSP_MODULE_FIRST] = {
+		TFA_DSP_CMD(SB_PARAM_SET_ALGO_PARAMS),
+		TFA_DSP_CMD(SB_PARAM_SET_LAGW),
+		TFA_DSP_CMD(SB_PARAM_SET_ALGO_PARAMS_WITHOUT_RESET),
+		TFA_DSP_CMD(SB_PARAM_SET_MUTE),			/* == SB_PARAM_SET_CURRENT_DELAY */
+		TFA_DSP_CMD(SB_PARAM_SET_VOLUME),
+		TFA_DSP_CMD(SB_PARAM_SET_RE25C),
+		TFA_DSP_CMD(SB_PARAM_SET_LSMODEL),
+		TFA_DSP_CMD(SB_PARAM_SET_MBDRC),
+		TFA_DSP_CMD(SB_PARAM_SET_MBDRC_WITHOUT_RESET),
+		TFA_DSP_CMD(SB_PARAM_SET_DRC),
+		TFA_DSP_CMD(SB_PARAM_GET_ALGO_PARAMS),
+		TFA_DSP_CMD(SB_PARAM_GET_LAGW),
+		TFA_DSP_CMD(SB_PARAM_GET_RE25C),
+		TFA_DSP_CMD(SB_PARAM_GET_LSMODEL),
+		TFA_DSP_CMD(SB_PARAM_GET_MBDRC),
+		TFA_DSP_CMD(SB_PARAM_GET_MBDRC_DYNAMICS),	/* == SB_PARAM_SET_RE0 */
+		TFA_DSP_CMD(SB_PARAM_GET_TAG),
+		TFA_DSP_CMD(SB_PARAM_SET_EXCURSION_FILTERS),
+		TFA_DSP_CMD(SB_PARAM_SET_DATA_LOGGER),
+		TFA_DSP_CMD(SB_PARAM_SET_CONFIG),
+		TFA_DSP_CMD(SB_PARAM_SET_AGCINS),
+		TFA_DSP_CMD(SB_PARAM_GET_STATE),
+		TFA_DSP_CMD(SB_PARAM_GET_XMODEL),
+	},
+	[MODULE_BIQUADFILTERBANK - TFA_DSP_MODULE_FIRST] = {
+		TFA_DSP_CMD(BFB_PAR_ID_SET_COEFS),
+		TFA_DSP_CMD(BFB_PAR_ID_GET_COEFS),
+		TFA_DSP_CMD(BFB_PAR_ID_GET_CONFIG),
+	},
+};
+
+/*
+ * name of a module / param id, NULL if unknown
+ */
+static inline const char *tfa_dsp_cmd_name(uint8_t module_id, uint8_t param_id)
+{
+	if (module_id < TFA_DSP_MODULE_FIRST || module_id >= TFA_DSP_MODULE_FIRST + TFA_DSP_NR_MODULES)
+		return NULL;
+
+	return tfa_dsp_cmd_names[module_id - TFA_DSP_MODULE_FIRST][param_id];
+}
+
+/*
+ * decoded command id of one dsp message
+ */
+struct tfa_dsp_cmd_info {
+	uint8_t module_id;
+	uint8_t param_id;	/* without the partial update bit */
+	int partial;		/* partial update of param_id */
+	int nr_words;		/* 24-bit parameter words following the command id */
+	const char *name;	/* name of param_id, NULL if unknown */
+};
+
+/*
+ * decode the 3 byte command id at the start of a 24-bit dsp message,
+ * returns -1 if the message is too short
+ */
+static inline int tfa_dsp_cmd_decode(const uint8_t *msg, int size, struct tfa_dsp_cmd_info *info)
+{
+	if (size < 3)
+		return -1;
+
+	info->module_id = msg[1];
+	info->param_id = msg[2];
+	info->partial = 0;
+	if ((msg[2] & TFA_DSP_PARAM_GET) == 0 && (msg[2] & TFA_DSP_PARAM_PARTIAL)) {
+		info->param_id &= ~TFA_DSP_PARAM_PARTIAL;
+		info->partial = 1;
+	}
+	info->nr_words = (size - 3) / 3;
+	info->name = tfa_dsp_cmd_name(info->module_id, info->param_id);
+
+	return 0;
+}
+
+#endif /* TFA_DSP_CMD_H_ */
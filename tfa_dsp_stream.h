@@ -0,0 +1,147 @@
+/*
+ * tfa_dsp_stream.h
+ *
+ *  Command blob layout and the target side streaming of packed (-p) command output.
+ *  Packed messages are the 24-bit big endian dsp words as they go to the dsp, they
+ *  are handed to the platform write as they are, without widening to 32-bit
+ */
+
+#ifndef TFA_DSP_STREAM_H_
+#define TFA_DSP_STREAM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * binary command blob, the alternative to the C header output
+ *   - header, set index, message table, payloads ; all little endian
+ *   - every set is a device x profile x vstep command sequence,
+ *     it refers to nr_msgs consecutive message table entries
+ *   - payloads are the 32-bit words otherwise written as CMD<n>[] arrays,
+ *     each payload starts TFA_BLOB_ALIGN aligned from the start of the file
+ *   - a packed blob ("TFCP") has the same layout, its payloads are the 24-bit
+ *     messages back to back and message lengths are in bytes
+ */
+#define TFA_BLOB_MAGIC "TFCB"
+#define TFA_BLOB_PACKED_MAGIC "TFCP"
+#define TFA_BLOB_VERSION 1
+#define TFA_BLOB_ALIGN 16
+
+struct tfa_blob_header {
+	char magic[4];		// "TFCB" or "TFCP"
+	uint16_t version;
+	uint16_t header_size;	// sizeof(struct tfa_blob_header)
+	uint32_t nr_sets;
+	uint32_t nr_msgs;
+	uint32_t set_offset;	// struct tfa_blob_set[nr_sets]
+	uint32_t msg_offset;	// struct tfa_blob_msg[nr_msgs]
+	uint32_t payload_offset;
+	uint32_t payload_size;	// bytes
+};
+
+enum tfa_blob_set_kind {
+	TFA_BLOB_SET_FULL,		// all messages of the profile and vstep
+	TFA_BLOB_SET_SWITCH,		// from profile -> profile
+	TFA_BLOB_SET_VSTEP_DELTA	// from vstep -> vstep of the profile
+};
+
+struct tfa_blob_set {
+	uint8_t dev;
+	uint8_t kind;		// enum tfa_blob_set_kind
+	uint16_t prof;
+	uint16_t vstep;
+	uint16_t from;		// previous profile or vstep, see kind
+	uint32_t first_msg;	// message table index
+	uint32_t nr_msgs;
+};
+
+struct tfa_blob_msg {
+	uint32_t offset;	// payload offset from the start of the file
+	uint32_t length;	// nr of 32-bit words, bytes in a packed blob
+};
+
+/*
+ * platform write of one dsp message of size bytes, returns 0 on success.
+ * a multi message (TFA_DSP_MULTI_MSG_MARKER) is one write as well
+ */
+typedef int (*tfa_dsp_stream_write_t)(void *ctx, const uint8_t *msg, int size);
+
+/* little endian blob field, on any host */
+static inline uint32_t tfa_dsp_stream_le32(uint32_t v)
+{
+	const uint8_t *b = (const uint8_t *)&v;
+
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static inline uint16_t tfa_dsp_stream_le16(uint16_t v)
+{
+	const uint8_t *b = (const uint8_t *)&v;
+
+	return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+/*
+ * write nr messages of a packed header, e.g. a dedup set :
+ *   tfa_dsp_stream_msgs(SET1, SET1_SIZE, sizeof(SET1) / sizeof(SET1[0]), write, ctx);
+ * or CMD<n> arrays one by one with nr 1 and their sizeof
+ */
+static inline int tfa_dsp_stream_msgs(const uint8_t *const *msgs, const uint16_t *sizes, int nr,
+	tfa_dsp_stream_write_t write, void *ctx)
+{
+	int i, err;
+
+	for (i = 0; i < nr; i++) {
+		err = write(ctx, msgs[i], sizes[i]);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * set of a packed blob, from is the previous profile (switch) or vstep (vstep delta)
+ * and ignored for full sets. NULL if the blob is not packed or has no such set
+ */
+static inline const struct tfa_blob_set *tfa_dsp_stream_find(const uint8_t *blob,
+	int dev, int prof, int vstep, int kind, int from)
+{
+	const struct tfa_blob_header *hdr = (const struct tfa_blob_header *)blob;
+	const struct tfa_blob_set *sets = (const struct tfa_blob_set *)(blob + tfa_dsp_stream_le32(hdr->set_offset));
+	uint32_t i, nr_sets = tfa_dsp_stream_le32(hdr->nr_sets);
+
+	if (memcmp(hdr->magic, TFA_BLOB_PACKED_MAGIC, 4) != 0 || tfa_dsp_stream_le16(hdr->version) != TFA_BLOB_VERSION)
+		return NULL;
+
+	for (i = 0; i < nr_sets; i++) {
+		if (sets[i].dev == dev && tfa_dsp_stream_le16(sets[i].prof) == prof
+			&& tfa_dsp_stream_le16(sets[i].vstep) == vstep && sets[i].kind == kind
+			&& (kind == TFA_BLOB_SET_FULL || tfa_dsp_stream_le16(sets[i].from) == from))
+			return &sets[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * write the messages of a set of a packed blob in order, stops at the first failing write
+ */
+static inline int tfa_dsp_stream_set(const uint8_t *blob, const struct tfa_blob_set *set,
+	tfa_dsp_stream_write_t write, void *ctx)
+{
+	const struct tfa_blob_header *hdr = (const struct tfa_blob_header *)blob;
+	const struct tfa_blob_msg *msgs = (const struct tfa_blob_msg *)(blob + tfa_dsp_stream_le32(hdr->msg_offset));
+	uint32_t m, first = tfa_dsp_stream_le32(set->first_msg), end = first + tfa_dsp_stream_le32(set->nr_msgs);
+	int err;
+
+	for (m = first; m < end; m++) {
+		err = write(ctx, blob + tfa_dsp_stream_le32(msgs[m].offset), (int)tfa_dsp_stream_le32(msgs[m].length));
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+#endif /* TFA_DSP_STREAM_H_ */